@@ -0,0 +1,101 @@
+/*
+ * client.h
+ *
+ * Client-side declarations shared between the command line front end
+ * (main.c), the pipelined request mode (pipeline.c) and the subscription
+ * mode (subscribe.c)
+ */
+
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "protocol.h"
+#include "resolver.h"
+
+// Defaults of the pipelined mode options
+#define PIPELINE_DEFAULT_WINDOW 32       // -W: requests in flight
+#define PIPELINE_DEFAULT_TIMEOUT_MS 500  // -T: first retransmission timeout
+#define PIPELINE_DEFAULT_RETRIES 4       // -R: retransmissions before giving up
+#define PIPELINE_MAX_WINDOW 4096
+#define PIPELINE_MAX_TIMEOUT_MS 8000     // cap of the exponential backoff
+
+// Subscription mode (-P)
+#define SUBSCRIBE_DEFAULT_LEASE 60      // seconds asked for, at least two intervals
+#define SUBSCRIBE_TIMEOUT_MS 1000       // wait for an ack before sending again
+#define SUBSCRIBE_RETRIES 3             // retransmissions of an unanswered request
+
+// Happy eyeballs (RFC 8305) over the server's addresses
+#define HAPPY_EYEBALLS_DELAY_MS 250       // wait before also trying the next address
+#define HAPPY_EYEBALLS_TIMEOUT_MS 5000    // wait for a reply after the last attempt
+#define HAPPY_EYEBALLS_MAX_ATTEMPTS RESOLVER_MAX_ADDRESSES
+
+// The server: its resolved addresses until one of them has answered, then
+// the socket and address used for the rest of the run, and the format it
+// is spoken to in
+struct server_target {
+    const struct sockaddr_storage *candidates;
+    int candidate_count;
+    int sock;                              // -1 until an address has answered
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char hostname[RESOLVER_NAME_SIZE];     // for display, set with sock
+    char ip[INET6_ADDRSTRLEN];
+    int compact;                           // compact format, until the server shows it lacks it
+    int half;                              // ask for half-precision values (-M)
+};
+
+struct pipeline_options {
+    const char *input_path;  // -f: file of "type city" lines ("-" = stdin)
+    int window;
+    int timeout_ms;
+    int retries;
+};
+
+// Parses "type city" into req. Returns 0 on success, -1 on error (printed).
+int parse_request_string(const char *request_str, struct request *req);
+
+// Prints the reply to a request for city
+void print_result(const char *server_name, const char *server_ip,
+                  const struct response *resp, const char *city);
+
+// Sends the datagram to the candidate addresses of server in turn, each from
+// its own socket, starting the next attempt after HAPPY_EYEBALLS_DELAY_MS
+// without a reply, and keeps the first address that answers: its socket,
+// address and display name are stored in server. Returns the length of the
+// reply, -1 if no address answered in time (nothing is printed).
+int happy_eyeballs_connect(struct server_target *server, const char *send_buffer, int send_len,
+                           char *recv_buffer, int recv_size);
+
+// Sends one datagram to the server and waits for the reply; the first call
+// picks the server address with happy_eyeballs_connect(). Returns the
+// length of the reply, -1 on error (already printed).
+int exchange(struct server_target *server, const char *send_buffer, int send_len,
+             char *recv_buffer, int recv_size);
+
+// Sends query and prints the result, in the compact format while
+// server->compact is set; a legacy reply clears it and the query is sent
+// again in the legacy format. Returns 0 on success.
+int run_single(struct server_target *server, const struct batch_query *query);
+
+// Sends every request read from options->input_path, keeping up to
+// options->window of them in flight, and prints the results as they arrive.
+// Returns 0 if every request was answered.
+int run_pipeline(struct server_target *server, const struct pipeline_options *options);
+
+// Subscribes to the cities of the queries of breq, with the types asked
+// for each, to an update every interval seconds, and prints the updates
+// until max_updates have arrived (0 = until interrupted). Returns 0 if at
+// least one subscription was set up.
+int run_subscribe(struct server_target *server, const struct batch_request *breq,
+                  int interval, int max_updates);
+
+#endif /* CLIENT_H_ */
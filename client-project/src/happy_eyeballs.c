@@ -0,0 +1,162 @@
+/*
+ * happy_eyeballs.c
+ *
+ * Choosing among the server's addresses, after RFC 8305.
+ *
+ * UDP has no handshake, so an attempt is the first request itself: it is
+ * sent to the first address, and if no reply arrives within
+ * HAPPY_EYEBALLS_DELAY_MS it is also sent to the next one, from a socket of
+ * that address's family, without giving up on the earlier attempts. The
+ * first address to answer is kept for the rest of the run. A send that
+ * fails at once (no route to that family, for instance) moves on to the
+ * next address immediately, so a broken IPv6 path costs nothing.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#define closesocket close
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include "client.h"
+
+static uint64_t now_ms(void)
+{
+#if defined WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static socklen_t sockaddr_len(const struct sockaddr_storage *addr)
+{
+    return (addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// Races the candidates as described above. Returns the length of the first
+// reply, with the index of the address that sent it in *winner and its
+// socket, left open, in *sock; -1 if none answered in time.
+static int race(const struct sockaddr_storage *candidates, int count,
+                const char *send_buffer, int send_len,
+                char *recv_buffer, int recv_size, int *winner, int *sock)
+{
+    int socks[HAPPY_EYEBALLS_MAX_ATTEMPTS];
+    if (count > HAPPY_EYEBALLS_MAX_ATTEMPTS)
+        count = HAPPY_EYEBALLS_MAX_ATTEMPTS;
+
+    int started = 0;
+    int open_count = 0;
+    uint64_t next_attempt = now_ms();
+    uint64_t deadline = 0;
+    int recv_len = -1;
+
+    while (recv_len < 0)
+    {
+        uint64_t now = now_ms();
+
+        // Start the attempts that are due; a failed send skips to the next
+        while (started < count && now >= next_attempt)
+        {
+            int i = started++;
+            socks[i] = socket(candidates[i].ss_family, SOCK_DGRAM, IPPROTO_UDP);
+            if (socks[i] >= 0 &&
+                sendto(socks[i], send_buffer, send_len, 0, (const struct sockaddr *)&candidates[i],
+                       sockaddr_len(&candidates[i])) < 0)
+            {
+                closesocket(socks[i]);
+                socks[i] = -1;
+            }
+            if (socks[i] >= 0)
+            {
+                open_count++;
+                next_attempt = now + HAPPY_EYEBALLS_DELAY_MS;
+                deadline = now + HAPPY_EYEBALLS_TIMEOUT_MS;
+            }
+        }
+
+        if (open_count == 0 && started == count)
+            break; // every send failed
+        if (started == count && now >= deadline)
+            break; // no reply in time
+        uint64_t until = (started < count) ? next_attempt : deadline;
+
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        int max_fd = -1;
+        for (int i = 0; i < started; i++)
+        {
+            if (socks[i] < 0)
+                continue;
+            FD_SET(socks[i], &read_fds);
+            if (socks[i] > max_fd)
+                max_fd = socks[i];
+        }
+
+        uint64_t wait = (until > now) ? until - now : 0;
+        struct timeval tv;
+        tv.tv_sec = (long)(wait / 1000);
+        tv.tv_usec = (long)(wait % 1000) * 1000;
+        if (select(max_fd + 1, &read_fds, NULL, NULL, &tv) <= 0)
+            continue;
+
+        for (int i = 0; i < started && recv_len < 0; i++)
+        {
+            if (socks[i] < 0 || !FD_ISSET(socks[i], &read_fds))
+                continue;
+
+            struct sockaddr_storage from_addr;
+            socklen_t from_len = sizeof(from_addr);
+            recv_len = recvfrom(socks[i], recv_buffer, recv_size, 0,
+                                (struct sockaddr *)&from_addr, &from_len);
+            if (recv_len >= 0)
+            {
+                *winner = i;
+                *sock = socks[i];
+            }
+            else
+            {
+                // Refused or unreachable: try the next address now
+                closesocket(socks[i]);
+                socks[i] = -1;
+                open_count--;
+                next_attempt = now;
+            }
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        if (socks[i] >= 0 && (recv_len < 0 || i != *winner))
+            closesocket(socks[i]);
+    }
+    return recv_len;
+}
+
+int happy_eyeballs_connect(struct server_target *server, const char *send_buffer, int send_len,
+                           char *recv_buffer, int recv_size)
+{
+    int winner;
+    int sock;
+    int recv_len = race(server->candidates, server->candidate_count, send_buffer, send_len,
+                        recv_buffer, recv_size, &winner, &sock);
+    if (recv_len < 0)
+        return -1;
+
+    server->sock = sock;
+    server->addr = server->candidates[winner];
+    server->addr_len = sockaddr_len(&server->addr);
+    resolver_reverse_finish(&server->addr, server->hostname, sizeof(server->hostname),
+                            server->ip, sizeof(server->ip));
+    return recv_len;
+}
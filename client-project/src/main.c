@@ -23,8 +23,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include "protocol.h"
+#include <time.h>
+#include "client.h"
+#include "resolver.h"
 
 #define NO_ERROR 0
 
@@ -35,166 +36,6 @@ void clearwinsock()
 #endif
 }
 
-void to_lowercase(char *str)
-{
-    for (int i = 0; str[i]; i++)
-    {
-        str[i] = tolower((unsigned char)str[i]);
-    }
-}
-
-void capitalize_city(char *city)
-{
-    int capitalize_next = 1;
-    for (int i = 0; city[i]; i++)
-    {
-        if (city[i] == ' ')
-        {
-            capitalize_next = 1;
-        }
-        else if (capitalize_next)
-        {
-            city[i] = toupper((unsigned char)city[i]);
-            capitalize_next = 0;
-        }
-        else
-        {
-            city[i] = tolower((unsigned char)city[i]);
-        }
-    }
-}
-
-int is_valid_request_type(char type)
-{
-    return (type == REQ_TEMPERATURE || type == REQ_HUMIDITY ||
-            type == REQ_WIND || type == REQ_PRESSURE);
-}
-
-int contains_invalid_chars(const char *str)
-{
-    for (int i = 0; str[i]; i++)
-    {
-        if (str[i] == '\t')
-            return 1; // Tab not allowed
-    }
-    return 0;
-}
-
-int serialize_request(const struct request *req, char *buffer)
-{
-    int offset = 0;
-
-    // Type (1 byte, no conversion needed)
-    memcpy(buffer + offset, &req->type, sizeof(char));
-    offset += sizeof(char);
-
-    // City (64 bytes)
-    memcpy(buffer + offset, req->city, CITY_SIZE);
-    offset += CITY_SIZE;
-
-    return offset;
-}
-
-int deserialize_request(const char *buffer, struct request *req)
-{
-    int offset = 0;
-
-    // Type (1 byte)
-    memcpy(&req->type, buffer + offset, sizeof(char));
-    offset += sizeof(char);
-
-    // City (64 bytes)
-    memcpy(req->city, buffer + offset, CITY_SIZE);
-    req->city[CITY_SIZE - 1] = '\0';
-    offset += CITY_SIZE;
-
-    return offset;
-}
-
-int serialize_response(const struct response *resp, char *buffer)
-{
-    int offset = 0;
-
-    // Status (4 bytes with network byte order)
-    uint32_t net_status = htonl(resp->status);
-    memcpy(buffer + offset, &net_status, sizeof(uint32_t));
-    offset += sizeof(uint32_t);
-
-    // Type (1 byte, no conversion needed)
-    memcpy(buffer + offset, &resp->type, sizeof(char));
-    offset += sizeof(char);
-
-    // Value (float with network byte order)
-    uint32_t temp;
-    memcpy(&temp, &resp->value, sizeof(float));
-    temp = htonl(temp);
-    memcpy(buffer + offset, &temp, sizeof(float));
-    offset += sizeof(float);
-
-    return offset;
-}
-
-int deserialize_response(const char *buffer, struct response *resp)
-{
-    int offset = 0;
-
-    // Status (4 bytes)
-    uint32_t net_status;
-    memcpy(&net_status, buffer + offset, sizeof(uint32_t));
-    resp->status = ntohl(net_status);
-    offset += sizeof(uint32_t);
-
-    // Type (1 byte)
-    memcpy(&resp->type, buffer + offset, sizeof(char));
-    offset += sizeof(char);
-
-    // Value (float)
-    uint32_t temp;
-    memcpy(&temp, buffer + offset, sizeof(float));
-    temp = ntohl(temp);
-    memcpy(&resp->value, &temp, sizeof(float));
-    offset += sizeof(float);
-
-    return offset;
-}
-
-int resolve_hostname(const char *hostname, struct in_addr *addr)
-{
-    // First try to parse as IP address
-    if (inet_pton(AF_INET, hostname, addr) == 1)
-    {
-        return 1; // Already an IP address
-    }
-
-    // Try DNS lookup
-    struct hostent *host = gethostbyname(hostname);
-    if (host == NULL)
-    {
-        return 0;
-    }
-
-    memcpy(addr, host->h_addr_list[0], sizeof(struct in_addr));
-    return 1;
-}
-
-void get_hostname_from_ip(struct in_addr *addr, char *hostname, size_t hostname_len, char *ip_str, size_t ip_len)
-{
-    // Get IP string
-    inet_ntop(AF_INET, addr, ip_str, ip_len);
-
-    struct hostent *host = gethostbyaddr((const char *)addr, sizeof(struct in_addr), AF_INET);
-    if (host != NULL && host->h_name != NULL)
-    {
-        strncpy(hostname, host->h_name, hostname_len - 1);
-        hostname[hostname_len - 1] = '\0';
-    }
-    else
-    {
-        strncpy(hostname, ip_str, hostname_len - 1);
-        hostname[hostname_len - 1] = '\0';
-    }
-}
-
 int parse_request_string(const char *request_str, struct request *req)
 {
     const char *space = strchr(request_str, ' ');
@@ -287,11 +128,284 @@ void print_result(const char *server_name, const char *server_ip,
     }
 }
 
+int exchange(struct server_target *server, const char *send_buffer, int send_len,
+             char *recv_buffer, int recv_size)
+{
+    if (server->sock < 0)
+    {
+        int recv_len = happy_eyeballs_connect(server, send_buffer, send_len, recv_buffer, recv_size);
+        if (recv_len < 0)
+            printf("Nessuna risposta dal server\n");
+        return recv_len;
+    }
+
+    if (sendto(server->sock, send_buffer, send_len, 0,
+               (const struct sockaddr *)&server->addr, server->addr_len) < 0)
+    {
+        printf("Errore nell'invio della richiesta\n");
+        return -1;
+    }
+
+    struct sockaddr_storage from_addr;
+    socklen_t from_len = sizeof(from_addr);
+
+    int recv_len = recvfrom(server->sock, recv_buffer, recv_size, 0,
+                            (struct sockaddr *)&from_addr, &from_len);
+    if (recv_len < 0)
+    {
+        printf("Errore nella ricezione della risposta\n");
+        return -1;
+    }
+    return recv_len;
+}
+
+// Sends the queries of breq in as few batch datagrams as possible and
+// prints every result. Falls back to one legacy request per query when the
+// server does not understand batches. Returns 0 on success.
+int run_batch(struct server_target *server, const struct batch_request *breq)
+{
+    static struct batch_request part;
+    static struct batch_response bresp;
+    char send_buffer[BATCH_MAX_DATAGRAM];
+    char recv_buffer[BATCH_MAX_DATAGRAM];
+    unsigned int done = 0;
+
+    while (done < breq->count)
+    {
+        // Queries not answered yet, as many as fit in one datagram
+        part.count = breq->count - done;
+        part.max_response = BATCH_MAX_DATAGRAM;
+        memcpy(part.queries, breq->queries + done, part.count * sizeof(struct batch_query));
+
+        int send_len;
+        while ((send_len = serialize_batch_request(&part, send_buffer, sizeof(send_buffer))) < 0 &&
+               part.count > 1)
+        {
+            part.count--;
+        }
+        if (send_len < 0)
+        {
+            printf("Errore: richiesta batch non valida\n");
+            return 1;
+        }
+
+        int recv_len = exchange(server, send_buffer, send_len, recv_buffer, sizeof(recv_buffer));
+        if (recv_len < 0)
+            return 1;
+
+        // A server without batch support answers with a legacy response
+        if (!is_batch_message(recv_buffer, recv_len))
+            break;
+
+        if (deserialize_batch_response(recv_buffer, recv_len, &bresp) < 0 || bresp.count == 0)
+        {
+            printf("Errore: risposta batch non valida\n");
+            return 1;
+        }
+
+        for (unsigned int i = 0; i < bresp.count && done < breq->count; i++, done++)
+        {
+            struct response resp;
+            resp.status = bresp.results[i].status;
+            resp.type = bresp.results[i].type;
+            resp.value = bresp.results[i].value;
+            print_result(server->hostname, server->ip, &resp, breq->queries[done].city);
+        }
+    }
+
+    // Legacy fallback: one request per remaining query
+    for (; done < breq->count; done++)
+    {
+        struct request req;
+        memset(&req, 0, sizeof(req));
+        req.type = breq->queries[done].type;
+        strncpy(req.city, breq->queries[done].city, CITY_SIZE - 1);
+
+        int send_len = serialize_request(&req, send_buffer);
+        int recv_len = exchange(server, send_buffer, send_len, recv_buffer, sizeof(recv_buffer));
+        if (recv_len < 0)
+            return 1;
+
+        struct response resp;
+        deserialize_response(recv_buffer, &resp);
+        print_result(server->hostname, server->ip, &resp, req.city);
+    }
+
+    return 0;
+}
+
+int run_single(struct server_target *server, const struct batch_query *query)
+{
+    char send_buffer[BUFFER_SIZE];
+    char recv_buffer[BUFFER_SIZE];
+
+    if (server->compact)
+    {
+        struct compact_request creq;
+        creq.flags = server->half ? COMPACT_HALF : 0;
+        creq.id = 0;
+        creq.query = *query;
+
+        int send_len = serialize_compact_request(&creq, send_buffer, sizeof(send_buffer));
+        if (send_len < 0)
+        {
+            printf("Errore: richiesta non valida\n");
+            return 1;
+        }
+        int recv_len = exchange(server, send_buffer, send_len, recv_buffer, sizeof(recv_buffer));
+        if (recv_len < 0)
+            return 1;
+
+        struct compact_response cresp;
+        if (is_compact_message(recv_buffer, recv_len) &&
+            deserialize_compact_response(recv_buffer, recv_len, &cresp) >= 0)
+        {
+            print_result(server->hostname, server->ip, &cresp.resp, query->city);
+            return 0;
+        }
+
+        // A server without the compact format answers with a legacy response
+        server->compact = 0;
+    }
+
+    struct request req;
+    memset(&req, 0, sizeof(req));
+    req.type = query->type;
+    memcpy(req.city, query->city, CITY_SIZE);
+
+    int send_len = serialize_request(&req, send_buffer);
+    if (exchange(server, send_buffer, send_len, recv_buffer, sizeof(recv_buffer)) < 0)
+        return 1;
+
+    struct response resp;
+    deserialize_response(recv_buffer, &resp);
+    print_result(server->hostname, server->ip, &resp, req.city);
+    return 0;
+}
+
+// Label and unit of a request type, for the history listing
+static const char *type_label(char type, const char **unit)
+{
+    switch (type)
+    {
+    case REQ_TEMPERATURE:
+        *unit = "°C";
+        return "Temperatura";
+    case REQ_HUMIDITY:
+        *unit = "%";
+        return "Umidità";
+    case REQ_WIND:
+        *unit = " km/h";
+        return "Vento";
+    case REQ_PRESSURE:
+        *unit = " hPa";
+        return "Pressione";
+    }
+    *unit = "";
+    return "?";
+}
+
+// Asks for the values the server recorded for query over the last seconds
+// seconds, one datagram at a time, and prints one line per sample.
+// Returns 0 on success.
+int run_history(struct server_target *server, const struct batch_query *query, int seconds)
+{
+    static struct history_request hreq;
+    static struct history_response hresp;
+    char send_buffer[BATCH_MAX_DATAGRAM];
+    char recv_buffer[BATCH_MAX_DATAGRAM];
+
+    uint32_t now = (uint32_t)time(NULL);
+    hreq.max_response = BATCH_MAX_DATAGRAM;
+    hreq.from = (seconds > 0 && (uint32_t)seconds < now) ? now - (uint32_t)seconds : 0;
+    hreq.to = now;
+    hreq.query = *query;
+
+    unsigned long total = 0;
+    while (1)
+    {
+        int send_len = serialize_history_request(&hreq, send_buffer, sizeof(send_buffer));
+        if (send_len < 0)
+        {
+            printf("Errore: richiesta dello storico non valida\n");
+            return 1;
+        }
+
+        int recv_len = exchange(server, send_buffer, send_len, recv_buffer, sizeof(recv_buffer));
+        if (recv_len < 0)
+            return 1;
+
+        // A server without history answers with a legacy response
+        if (!is_history_message(recv_buffer, recv_len))
+        {
+            printf("Il server %s non conserva lo storico dei valori\n", server->hostname);
+            return 1;
+        }
+        if (deserialize_history_response(recv_buffer, recv_len, &hresp) < 0)
+        {
+            printf("Errore: risposta dello storico non valida\n");
+            return 1;
+        }
+
+        if (hresp.status != STATUS_SUCCESS)
+        {
+            struct response resp;
+            resp.status = hresp.status;
+            resp.type = hresp.type;
+            resp.value = 0.0f;
+            print_result(server->hostname, server->ip, &resp, query->city);
+            return 0;
+        }
+
+        if (total == 0)
+        {
+            char city_formatted[CITY_SIZE];
+            strncpy(city_formatted, query->city, CITY_SIZE - 1);
+            city_formatted[CITY_SIZE - 1] = '\0';
+            capitalize_city(city_formatted);
+
+            const char *unit;
+            printf("Storico dal server %s (ip %s). %s: %s\n", server->hostname, server->ip,
+                   city_formatted, type_label(hresp.type, &unit));
+        }
+
+        for (unsigned int i = 0; i < hresp.count; i++)
+        {
+            const char *unit;
+            type_label(hresp.type, &unit);
+
+            char when[32];
+            time_t timestamp = (time_t)hresp.timestamps[i];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
+            printf("%s  %.1f%s\n", when, hresp.values[i], unit);
+        }
+        total += hresp.count;
+
+        // The rest of the range, if it did not fit
+        if (hresp.next == 0 || hresp.count == 0 || hresp.next <= hreq.from)
+            break;
+        hreq.from = hresp.next;
+    }
+
+    printf("%lu campioni\n", total);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     char *server = "localhost";
     int port = DEFAULT_PORT;
     char *request_str = NULL;
+    static char *request_strs[BATCH_MAX_QUERIES];
+    int num_requests = 0;
+    int use_dns_cache = 1;
+    int history_seconds = 0;
+    int subscribe_interval = 0;
+    int max_updates = 0;
+    int compact = 1;
+    int half = 0;
+    struct pipeline_options pipeline = {NULL, PIPELINE_DEFAULT_WINDOW,
+                                        PIPELINE_DEFAULT_TIMEOUT_MS, PIPELINE_DEFAULT_RETRIES};
 
     for (int i = 1; i < argc; i++)
     {
@@ -306,15 +420,81 @@ int main(int argc, char *argv[])
         else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
         {
             request_str = argv[++i];
+            if (num_requests < BATCH_MAX_QUERIES)
+                request_strs[num_requests++] = request_str;
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            pipeline.input_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+        {
+            pipeline.window = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+        {
+            pipeline.timeout_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+        {
+            pipeline.retries = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+        {
+            history_seconds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+        {
+            subscribe_interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            max_updates = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-N") == 0)
+        {
+            use_dns_cache = 0;
+        }
+        else if (strcmp(argv[i], "-L") == 0)
+        {
+            compact = 0;
+        }
+        else if (strcmp(argv[i], "-M") == 0)
+        {
+            half = 1;
         }
     }
 
-    if (request_str == NULL)
+    if (pipeline.window < 1)
+        pipeline.window = 1;
+    if (pipeline.window > PIPELINE_MAX_WINDOW)
+        pipeline.window = PIPELINE_MAX_WINDOW;
+    if (pipeline.timeout_ms < 1)
+        pipeline.timeout_ms = PIPELINE_DEFAULT_TIMEOUT_MS;
+    if (pipeline.retries < 0)
+        pipeline.retries = 0;
+    if (max_updates < 0)
+        max_updates = 0;
+
+    if (request_str == NULL && pipeline.input_path == NULL)
     {
-        printf("Uso: %s [-s server] [-p port] -r \"type city\"\n", argv[0]);
+        printf("Uso: %s [-s server] [-p port] [-N] [-L | -M] -r \"type city\"\n", argv[0]);
+        printf("     %s [-s server] [-p port] [-N] -H secondi -r \"type city\"\n", argv[0]);
+        printf("     %s [-s server] [-p port] [-N] -P intervallo [-n aggiornamenti] -r \"type city\" ...\n", argv[0]);
+        printf("     %s [-s server] [-p port] [-N] [-L | -M] -f file [-W window] [-T timeout] [-R retries]\n", argv[0]);
         printf("  -s server: hostname o IP del server (default: localhost)\n");
         printf("  -p port: porta del server (default: %d)\n", DEFAULT_PORT);
-        printf("  -r request: richiesta meteo (obbligatoria)\n");
+        printf("  -r request: richiesta meteo (obbligatoria; ripetuta per inviarne più in un solo datagramma)\n");
+        printf("  -H secondi: valori registrati dal server negli ultimi secondi per la richiesta -r\n");
+        printf("  -P intervallo: sottoscrive le richieste -r e riceve un aggiornamento ogni intervallo secondi\n");
+        printf("  -n aggiornamenti: aggiornamenti da ricevere con -P prima di uscire (default: 0 = senza fine)\n");
+        printf("  -f file: richieste \"type city\", una per riga, inviate in pipeline (- = stdin)\n");
+        printf("  -W window: richieste in volo con -f (default: %d)\n", PIPELINE_DEFAULT_WINDOW);
+        printf("  -T timeout: timeout iniziale in ms prima di ritrasmettere (default: %d)\n", PIPELINE_DEFAULT_TIMEOUT_MS);
+        printf("  -R retries: ritrasmissioni prima di considerare persa una richiesta (default: %d)\n", PIPELINE_DEFAULT_RETRIES);
+        printf("  -N: non usa la cache DNS su disco\n");
+        printf("  -L: usa solo il formato classico a 65/9 byte, senza provare quello compatto\n");
+        printf("  -M: valori a mezza precisione (16 bit) nel formato compatto\n");
         printf("  type: t=temperatura, h=umidità, w=vento, p=pressione\n");
         return 1;
     }
@@ -333,74 +513,91 @@ int main(int argc, char *argv[])
     // Parse request string
     struct request req;
     memset(&req, 0, sizeof(req));
-    if (parse_request_string(request_str, &req) != 0)
+    if (request_str != NULL && parse_request_string(request_str, &req) != 0)
     {
         clearwinsock();
         return 1;
     }
 
-    int my_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (my_socket < 0)
+    // Several -r options are sent as one batch; "#<id>" selects a city by ID
+    static struct batch_request breq;
+    breq.count = num_requests;
+    for (int i = 0; i < num_requests; i++)
     {
-        printf("Errore nella creazione del socket\n");
-        clearwinsock();
-        return 1;
+        struct batch_query *q = &breq.queries[i];
+        struct request part;
+        memset(&part, 0, sizeof(part));
+        if (parse_request_string(request_strs[i], &part) != 0)
+        {
+            clearwinsock();
+            return 1;
+        }
+
+        q->type = part.type;
+        memcpy(q->city, part.city, CITY_SIZE);
+        q->city_id = -1;
+        if (part.city[0] == '#' && part.city[1] != '\0' &&
+            strspn(part.city + 1, "0123456789") == strlen(part.city + 1))
+        {
+            q->city_id = atoi(part.city + 1);
+        }
     }
 
-    struct in_addr server_addr_in;
-    if (!resolve_hostname(server, &server_addr_in))
+    resolver_init(use_dns_cache ? resolver_default_cache_path() : NULL);
+
+    static struct sockaddr_storage candidates[RESOLVER_MAX_ADDRESSES];
+    int candidate_count = resolver_lookup(server, candidates, RESOLVER_MAX_ADDRESSES);
+    if (candidate_count == 0)
     {
         printf("Errore nella risoluzione del server: %s\n", server);
-        closesocket(my_socket);
+        resolver_save();
         clearwinsock();
         return 1;
     }
+    for (int i = 0; i < candidate_count; i++)
+    {
+        if (candidates[i].ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&candidates[i])->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)&candidates[i])->sin_port = htons(port);
+    }
 
-    char server_hostname[256];
-    char server_ip[INET_ADDRSTRLEN];
-    get_hostname_from_ip(&server_addr_in, server_hostname, sizeof(server_hostname),
-                         server_ip, sizeof(server_ip));
-
-    struct sockaddr_in server_sockaddr;
-    memset(&server_sockaddr, 0, sizeof(server_sockaddr));
-    server_sockaddr.sin_family = AF_INET;
-    server_sockaddr.sin_addr = server_addr_in;
-    server_sockaddr.sin_port = htons(port);
+    // The name is only displayed: look it up while the request is on the
+    // wire, for the address most likely to answer
+    resolver_reverse_start(&candidates[0]);
 
-    // Serialize request
-    char send_buffer[BUFFER_SIZE];
-    int send_len = serialize_request(&req, send_buffer);
+    static struct server_target target;
+    target.candidates = candidates;
+    target.candidate_count = candidate_count;
+    target.sock = -1;
+    target.compact = compact;
+    target.half = half;
 
-    if (sendto(my_socket, send_buffer, send_len, 0,
-               (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr)) < 0)
+    int ret;
+    if (pipeline.input_path != NULL)
     {
-        printf("Errore nell'invio della richiesta\n");
-        closesocket(my_socket);
-        clearwinsock();
-        return 1;
+        ret = run_pipeline(&target, &pipeline);
     }
-
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-
-    int recv_len = recvfrom(my_socket, recv_buffer, sizeof(recv_buffer), 0,
-                            (struct sockaddr *)&from_addr, &from_len);
-    if (recv_len < 0)
+    else if (subscribe_interval > 0)
     {
-        printf("Errore nella ricezione della risposta\n");
-        closesocket(my_socket);
-        clearwinsock();
-        return 1;
+        ret = run_subscribe(&target, &breq, subscribe_interval, max_updates);
+    }
+    else if (history_seconds > 0)
+    {
+        ret = run_history(&target, &breq.queries[0], history_seconds);
+    }
+    else if (num_requests > 1)
+    {
+        ret = run_batch(&target, &breq);
+    }
+    else
+    {
+        ret = run_single(&target, &breq.queries[0]);
     }
 
-    // Deserialize response
-    struct response resp;
-    deserialize_response(recv_buffer, &resp);
-
-    print_result(server_hostname, server_ip, &resp, req.city);
-
-    closesocket(my_socket);
+    resolver_save();
+    if (target.sock >= 0)
+        closesocket(target.sock);
     clearwinsock();
-    return 0;
+    return ret;
 }
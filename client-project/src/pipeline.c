@@ -0,0 +1,408 @@
+/*
+ * pipeline.c
+ *
+ * Pipelined request mode.
+ *
+ * Requests are read as "type city" lines and sent without waiting for the
+ * previous reply, up to a window of requests in flight. Each one carries a
+ * request ID (the optional trailer of protocol.h, or the one of the compact
+ * format while the server speaks it) made of a sequence number and its slot
+ * in the window, so a reply finds its request in O(1) and a late reply to
+ * an old request is recognised and ignored. A request that is not answered
+ * in time is sent again with an exponentially growing timeout, and given up
+ * after the configured number of retransmissions. Until the server has
+ * answered once, the first request alone is in flight and races the
+ * server's addresses (happy_eyeballs_connect()); a legacy answer to that
+ * compact request switches the run to the legacy format.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#include <arpa/inet.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "client.h"
+
+#define SLOT_BITS 12   // PIPELINE_MAX_WINDOW == 1 << SLOT_BITS
+#define SLOT_MASK ((1u << SLOT_BITS) - 1)
+
+struct pending {
+    int in_use;
+    uint32_t id;
+    int attempts;           // transmissions so far
+    uint64_t sent_ms;       // first transmission
+    uint64_t deadline_ms;   // next retransmission
+    struct request req;
+};
+
+struct pipeline_stats {
+    unsigned long sent;          // distinct requests
+    unsigned long answered;
+    unsigned long lost;          // gave up after every retransmission
+    unsigned long invalid;       // input lines that could not be parsed
+    unsigned long retransmitted;
+    unsigned long late;          // replies to requests already answered or lost
+    uint64_t rtt_total_ms;       // over requests answered at the first attempt
+    unsigned long rtt_samples;
+};
+
+static uint64_t now_ms(void)
+{
+#if defined WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static uint64_t backoff_ms(const struct pipeline_options *options, int attempts)
+{
+    uint64_t timeout = (uint64_t)options->timeout_ms;
+    for (int i = 1; i < attempts && timeout < PIPELINE_MAX_TIMEOUT_MS; i++)
+        timeout *= 2;
+    return (timeout < PIPELINE_MAX_TIMEOUT_MS) ? timeout : PIPELINE_MAX_TIMEOUT_MS;
+}
+
+// Serializes the request of p with its ID, in the compact format while the
+// server speaks it. Returns the length, -1 if it cannot be encoded.
+static int serialize_pending(const struct server_target *server, const struct pending *p,
+                             char *buffer, int buffer_size)
+{
+    if (server->compact)
+    {
+        struct compact_request creq;
+        creq.flags = COMPACT_ID | (server->half ? COMPACT_HALF : 0);
+        creq.id = p->id;
+        creq.query.type = p->req.type;
+        creq.query.city_id = -1;
+        memcpy(creq.query.city, p->req.city, CITY_SIZE);
+        return serialize_compact_request(&creq, buffer, buffer_size);
+    }
+
+    int len = serialize_request(&p->req, buffer);
+    return len + serialize_request_id(p->id, buffer + len);
+}
+
+static int send_pending(const struct server_target *server,
+                        struct pending *p, const struct pipeline_options *options)
+{
+    char send_buffer[BUFFER_SIZE];
+    int send_len = serialize_pending(server, p, send_buffer, sizeof(send_buffer));
+
+    p->attempts++;
+    p->deadline_ms = now_ms() + backoff_ms(options, p->attempts);
+
+    if (send_len < 0 ||
+        sendto(server->sock, send_buffer, send_len, 0,
+               (const struct sockaddr *)&server->addr, server->addr_len) < 0)
+    {
+        printf("Errore nell'invio della richiesta\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next valid request from input. Returns 0, or -1 at end of input.
+static int next_request(FILE *input, struct request *req, struct pipeline_stats *stats)
+{
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+
+        memset(req, 0, sizeof(*req));
+        if (parse_request_string(line, req) == 0)
+            return 0;
+        stats->invalid++;
+    }
+    return -1;
+}
+
+// Waits until the socket is readable or timeout_ms elapses. Returns > 0 if readable.
+static int wait_readable(int sock, uint64_t timeout_ms)
+{
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sock, &read_fds);
+
+    struct timeval tv;
+    tv.tv_sec = (long)(timeout_ms / 1000);
+    tv.tv_usec = (long)(timeout_ms % 1000) * 1000;
+    return select(sock + 1, &read_fds, NULL, NULL, &tv);
+}
+
+// The requests in flight
+struct window {
+    struct pending *slots;
+    int size;
+    int in_flight;
+    int ids_echoed;      // cleared when the server ignores request IDs
+};
+
+// The request in flight with the given ID, NULL if there is none
+static struct pending *find_pending(struct window *win, uint32_t id)
+{
+    struct pending *p = &win->slots[id & SLOT_MASK];
+    if ((id & SLOT_MASK) >= (uint32_t)win->size || !p->in_use || p->id != id)
+        return NULL;
+    return p;
+}
+
+// Matches a reply to its request, prints it and frees the slot
+static void handle_reply(const struct server_target *server, struct window *win,
+                         const char *recv_buffer, int recv_len, struct pipeline_stats *stats)
+{
+    struct response resp;
+    struct pending *p = NULL;
+
+    if (recv_len > 0 && is_compact_message(recv_buffer, recv_len))
+    {
+        struct compact_response cresp;
+        if (deserialize_compact_response(recv_buffer, recv_len, &cresp) < 0 ||
+            !(cresp.flags & COMPACT_ID))
+            return;
+        p = find_pending(win, cresp.id);
+        resp = cresp.resp;
+    }
+    else if (recv_len < (int)RESPONSE_BUFFER_SIZE)
+    {
+        return;
+    }
+    else if (recv_len == (int)RESPONSE_WITH_ID_SIZE)
+    {
+        uint32_t id;
+        deserialize_request_id(recv_buffer + RESPONSE_BUFFER_SIZE, &id);
+        p = find_pending(win, id);
+        deserialize_response(recv_buffer, &resp);
+    }
+    else if (recv_len == (int)RESPONSE_BUFFER_SIZE)
+    {
+        // Server without request IDs: assume replies come in order and
+        // match the oldest request; new ones are sent one at a time
+        if (win->ids_echoed)
+        {
+            printf("Avviso: il server non supporta l'ID delle richieste, invio una richiesta alla volta\n");
+            win->ids_echoed = 0;
+        }
+        for (int i = 0; i < win->size; i++)
+        {
+            if (win->slots[i].in_use && (p == NULL || (int32_t)(win->slots[i].id - p->id) < 0))
+                p = &win->slots[i];
+        }
+        deserialize_response(recv_buffer, &resp);
+    }
+
+    if (p == NULL)
+    {
+        stats->late++;
+        return;
+    }
+
+    print_result(server->hostname, server->ip, &resp, p->req.city);
+
+    if (p->attempts == 1)
+    {
+        stats->rtt_total_ms += now_ms() - p->sent_ms;
+        stats->rtt_samples++;
+    }
+    p->in_use = 0;
+    win->in_flight--;
+    stats->answered++;
+}
+
+// Sends p, the first request, with happy_eyeballs_connect() until an
+// address answers, retransmitting like any other request. Returns 0 once
+// the server is chosen, -1 if the request was given up.
+static int choose_server(struct server_target *server, struct window *win, struct pending *p,
+                         const struct pipeline_options *options, struct pipeline_stats *stats)
+{
+    char send_buffer[BUFFER_SIZE];
+    int send_len = serialize_pending(server, p, send_buffer, sizeof(send_buffer));
+    if (send_len < 0)
+    {
+        printf("Errore nell'invio della richiesta\n");
+        return -1;
+    }
+
+    while (p->attempts <= options->retries)
+    {
+        if (p->attempts > 0)
+            stats->retransmitted++;
+        p->attempts++;
+
+        char recv_buffer[BUFFER_SIZE];
+        int recv_len = happy_eyeballs_connect(server, send_buffer, send_len,
+                                              recv_buffer, sizeof(recv_buffer));
+        if (recv_len >= 0)
+        {
+            // A server without the compact format answers with a legacy
+            // response: the request goes again in the legacy format
+            if (server->compact && !is_compact_message(recv_buffer, recv_len))
+            {
+                server->compact = 0;
+                p->attempts = 0;
+                p->sent_ms = now_ms();
+                return send_pending(server, p, options);
+            }
+            handle_reply(server, win, recv_buffer, recv_len, stats);
+            return 0;
+        }
+    }
+
+    printf("Nessuna risposta dal server per la richiesta '%c %s'\n", p->req.type, p->req.city);
+    p->in_use = 0;
+    win->in_flight--;
+    stats->lost++;
+    return -1;
+}
+
+static void print_summary(const struct pipeline_stats *stats, uint64_t elapsed_ms)
+{
+    double seconds = (elapsed_ms > 0) ? elapsed_ms / 1000.0 : 0.001;
+    double loss = (stats->sent > 0) ? 100.0 * stats->lost / stats->sent : 0.0;
+
+    printf("\nRichieste inviate: %lu, risposte: %lu, perse: %lu (%.2f%%), non valide: %lu\n",
+           stats->sent, stats->answered, stats->lost, loss, stats->invalid);
+    printf("Ritrasmissioni: %lu, risposte in ritardo: %lu\n",
+           stats->retransmitted, stats->late);
+    printf("Tempo: %.3f s, throughput: %.1f risposte/s", seconds, stats->answered / seconds);
+    if (stats->rtt_samples > 0)
+        printf(", RTT medio: %.2f ms", (double)stats->rtt_total_ms / stats->rtt_samples);
+    printf("\n");
+}
+
+int run_pipeline(struct server_target *server, const struct pipeline_options *options)
+{
+    FILE *input = stdin;
+    if (strcmp(options->input_path, "-") != 0)
+    {
+        input = fopen(options->input_path, "r");
+        if (input == NULL)
+        {
+            printf("Errore nell'apertura del file %s\n", options->input_path);
+            return 1;
+        }
+    }
+
+    struct window win;
+    win.size = options->window;
+    win.in_flight = 0;
+    win.ids_echoed = 1;
+    win.slots = calloc((size_t)win.size, sizeof(struct pending));
+    if (win.slots == NULL)
+    {
+        printf("Errore di allocazione della finestra di richieste\n");
+        if (input != stdin)
+            fclose(input);
+        return 1;
+    }
+
+    struct pipeline_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint32_t sequence = (uint32_t)now_ms();
+    int end_of_input = 0;
+    int ret = 0;
+    uint64_t start = now_ms();
+
+    while ((!end_of_input || win.in_flight > 0) && ret == 0)
+    {
+        // Fill the window (a single request at a time if IDs are not echoed
+        // or no address has answered yet)
+        int limit = (win.ids_echoed && server->sock >= 0) ? win.size : 1;
+        for (int i = 0; i < win.size && win.in_flight < limit && !end_of_input; i++)
+        {
+            struct pending *p = &win.slots[i];
+            if (p->in_use)
+                continue;
+            if (next_request(input, &p->req, &stats) < 0)
+            {
+                end_of_input = 1;
+                break;
+            }
+
+            p->in_use = 1;
+            p->id = (sequence++ << SLOT_BITS) | (uint32_t)i;
+            p->attempts = 0;
+            p->sent_ms = now_ms();
+            win.in_flight++;
+            stats.sent++;
+            if (server->sock < 0)
+            {
+                if (choose_server(server, &win, p, options, &stats) < 0)
+                    ret = 1;
+            }
+            else if (send_pending(server, p, options) < 0)
+            {
+                ret = 1;
+            }
+        }
+        if (win.in_flight == 0 || ret != 0)
+            continue;
+
+        // Retransmit or give up the expired requests; find the next deadline
+        uint64_t now = now_ms();
+        uint64_t next_deadline = UINT64_MAX;
+        for (int i = 0; i < win.size; i++)
+        {
+            struct pending *p = &win.slots[i];
+            if (!p->in_use)
+                continue;
+            if (p->deadline_ms <= now)
+            {
+                if (p->attempts > options->retries)
+                {
+                    printf("Nessuna risposta dal server per la richiesta '%c %s'\n",
+                           p->req.type, p->req.city);
+                    p->in_use = 0;
+                    win.in_flight--;
+                    stats.lost++;
+                    continue;
+                }
+                stats.retransmitted++;
+                if (send_pending(server, p, options) < 0)
+                    ret = 1;
+            }
+            if (p->deadline_ms < next_deadline)
+                next_deadline = p->deadline_ms;
+        }
+        if (win.in_flight == 0 || ret != 0)
+            continue;
+
+        // Drain every reply that is ready, waiting at most until the next deadline
+        uint64_t wait = (next_deadline > now) ? next_deadline - now : 0;
+        while (wait_readable(server->sock, wait) > 0)
+        {
+            wait = 0;
+
+            char recv_buffer[BUFFER_SIZE];
+            struct sockaddr_storage from_addr;
+            socklen_t from_len = sizeof(from_addr);
+            int recv_len = recvfrom(server->sock, recv_buffer, sizeof(recv_buffer), 0,
+                                    (struct sockaddr *)&from_addr, &from_len);
+            handle_reply(server, &win, recv_buffer, recv_len, &stats);
+        }
+    }
+
+    print_summary(&stats, now_ms() - start);
+
+    free(win.slots);
+    if (input != stdin)
+        fclose(input);
+
+    if (ret == 0 && (stats.lost > 0 || stats.invalid > 0))
+        ret = 1;
+    return ret;
+}
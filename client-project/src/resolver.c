@@ -0,0 +1,496 @@
+/*
+ * resolver.c
+ *
+ * getaddrinfo()/getnameinfo() with a cache file shared by client runs.
+ *
+ * The file holds one entry per line:
+ *
+ *   F <expiry> <host name> <address>[,<address>...]   forward lookup
+ *   R <expiry> <address> <host name>                  reverse lookup
+ *
+ * where <expiry> is a Unix time and "-" in place of the result records a
+ * name that does not exist. getaddrinfo() does not report the TTL of the
+ * DNS records, so entries live RESOLVER_TTL seconds (RESOLVER_NEGATIVE_TTL
+ * for missing names); temporary failures are never cached. The file is
+ * rewritten through a temporary file and rename(), so a concurrent client
+ * reads either the old or the new version.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "resolver.h"
+
+#define RESOLVER_GAI_ADDRESSES 16   // getaddrinfo() results considered
+
+struct cache_entry {
+    char kind;                         // 'F' or 'R'
+    long long expires;
+    char key[RESOLVER_NAME_SIZE];      // host name (lowercase) or address
+    char value[RESOLVER_NAME_SIZE];    // addresses or host name, "-" if none
+};
+
+static struct cache_entry entries[RESOLVER_CACHE_ENTRIES];
+static int entry_count;
+static const char *cache_file;
+static int dirty;
+
+// A reverse lookup in flight. Shared by its thread and the caller, and
+// freed by whichever lets go last, so a lookup that is too slow can simply
+// be abandoned.
+struct reverse_lookup {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int refs;
+    int done;
+    int status;                        // getnameinfo() result
+    struct sockaddr_storage addr;
+    char key[INET6_ADDRSTRLEN];        // text form of addr
+    char name[RESOLVER_NAME_SIZE];
+};
+
+// Started by resolver_reverse_start(), NULL when answered from the cache
+static struct reverse_lookup *pending;
+
+const char *resolver_default_cache_path(void)
+{
+    static char path[1024];
+#if defined WIN32
+    const char *dir = getenv("LOCALAPPDATA");
+    const char *file = "\\meteo_dns_cache";
+#else
+    const char *dir = getenv("HOME");
+    const char *file = "/.meteo_dns_cache";
+#endif
+    if (dir == NULL || dir[0] == '\0')
+        return NULL;
+    if (snprintf(path, sizeof(path), "%s%s", dir, file) >= (int)sizeof(path))
+        return NULL;
+    return path;
+}
+
+static struct cache_entry *cache_find(char kind, const char *key)
+{
+    long long now = (long long)time(NULL);
+    for (int i = 0; i < entry_count; i++)
+    {
+        if (entries[i].kind == kind && entries[i].expires > now && strcmp(entries[i].key, key) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
+
+static void cache_store(char kind, const char *key, const char *value, int ttl)
+{
+    long long now = (long long)time(NULL);
+    struct cache_entry *slot = NULL;
+
+    for (int i = 0; i < entry_count && slot == NULL; i++)
+    {
+        if (entries[i].kind == kind && strcmp(entries[i].key, key) == 0)
+            slot = &entries[i];
+    }
+    if (slot == NULL && entry_count < RESOLVER_CACHE_ENTRIES)
+        slot = &entries[entry_count++];
+    if (slot == NULL)
+    {
+        // Full: replace the entry closest to expiring
+        slot = &entries[0];
+        for (int i = 1; i < entry_count; i++)
+        {
+            if (entries[i].expires < slot->expires)
+                slot = &entries[i];
+        }
+    }
+
+    slot->kind = kind;
+    slot->expires = now + ttl;
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+    snprintf(slot->value, sizeof(slot->value), "%s", value);
+    dirty = 1;
+}
+
+void resolver_init(const char *cache_path)
+{
+    cache_file = cache_path;
+    entry_count = 0;
+    dirty = 0;
+    if (cache_file == NULL)
+        return;
+
+    FILE *file = fopen(cache_file, "r");
+    if (file == NULL)
+        return;
+
+    long long now = (long long)time(NULL);
+    char line[2 * RESOLVER_NAME_SIZE + 64];
+    while (entry_count < RESOLVER_CACHE_ENTRIES && fgets(line, sizeof(line), file) != NULL)
+    {
+        struct cache_entry *e = &entries[entry_count];
+        if (sscanf(line, "%c %lld %255s %255s", &e->kind, &e->expires, e->key, e->value) != 4)
+            continue;
+        if ((e->kind == 'F' || e->kind == 'R') && e->expires > now)
+            entry_count++;
+    }
+    fclose(file);
+}
+
+void resolver_save(void)
+{
+    if (cache_file == NULL || !dirty)
+        return;
+
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_file, (int)getpid());
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+        return;
+
+    long long now = (long long)time(NULL);
+    for (int i = 0; i < entry_count; i++)
+    {
+        if (entries[i].expires > now)
+            fprintf(file, "%c %lld %s %s\n", entries[i].kind, entries[i].expires,
+                    entries[i].key, entries[i].value);
+    }
+
+    if (fclose(file) != 0)
+    {
+        remove(tmp_path);
+        return;
+    }
+#if defined WIN32
+    remove(cache_file); // rename() does not replace an existing file
+#endif
+    if (rename(tmp_path, cache_file) != 0)
+        remove(tmp_path);
+    dirty = 0;
+}
+
+static socklen_t address_len(const struct sockaddr_storage *addr)
+{
+    return (addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void address_text(const struct sockaddr_storage *addr, char *text, size_t len)
+{
+    const void *ip = (addr->ss_family == AF_INET6)
+                         ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+                         : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+    if (inet_ntop(addr->ss_family, ip, text, len) == NULL && len > 0)
+        text[0] = '\0';
+}
+
+static int parse_address(const char *text, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+    if (inet_pton(AF_INET6, text, &addr6->sin6_addr) == 1)
+    {
+        addr6->sin6_family = AF_INET6;
+        return 1;
+    }
+    if (inet_pton(AF_INET, text, &addr4->sin_addr) == 1)
+    {
+        addr4->sin_family = AF_INET;
+        return 1;
+    }
+    return 0;
+}
+
+// Reorders addrs so that families alternate, starting with the family of
+// the first address; the order within each family is kept
+static void interleave_families(struct sockaddr_storage *addrs, int count)
+{
+    struct sockaddr_storage sorted[RESOLVER_GAI_ADDRESSES];
+    int first_family = addrs[0].ss_family;
+    int next[2] = {0, 0};   // next unused address of the first and the other family
+
+    for (int n = 0; n < count; n++)
+    {
+        int want_first = (n % 2 == 0);
+        int picked = -1;
+        for (int pass = 0; pass < 2 && picked < 0; pass++)
+        {
+            int first = (pass == 0) ? want_first : !want_first;
+            int side = first ? 0 : 1;
+            for (int i = next[side]; i < count; i++)
+            {
+                if ((addrs[i].ss_family == first_family) == first)
+                {
+                    picked = i;
+                    next[side] = i + 1;
+                    break;
+                }
+            }
+        }
+        sorted[n] = addrs[picked];
+    }
+    memcpy(addrs, sorted, (size_t)count * sizeof(*addrs));
+}
+
+int resolver_lookup(const char *hostname, struct sockaddr_storage *addrs, int max_addrs)
+{
+    if (max_addrs > RESOLVER_MAX_ADDRESSES)
+        max_addrs = RESOLVER_MAX_ADDRESSES;
+    if (max_addrs < 1)
+        return 0;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    // Numeric addresses (with a scope ID, if any) need no DNS and no cache
+    struct addrinfo *result = NULL;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(hostname, NULL, &hints, &result) == 0)
+    {
+        memset(&addrs[0], 0, sizeof(addrs[0]));
+        memcpy(&addrs[0], result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        return 1;
+    }
+    hints.ai_flags = 0;
+
+    char key[RESOLVER_NAME_SIZE];
+    size_t len = strlen(hostname);
+    if (len == 0 || len >= sizeof(key) || strchr(hostname, ' ') != NULL)
+        return 0;
+    for (size_t i = 0; i <= len; i++)
+        key[i] = (char)tolower((unsigned char)hostname[i]);
+
+    struct cache_entry *cached = cache_find('F', key);
+    if (cached != NULL)
+    {
+        if (strcmp(cached->value, "-") == 0)
+            return 0;
+
+        int count = 0;
+        const char *p = cached->value;
+        while (*p != '\0' && count < max_addrs)
+        {
+            char text[INET6_ADDRSTRLEN];
+            size_t text_len = strcspn(p, ",");
+            if (text_len < sizeof(text))
+            {
+                memcpy(text, p, text_len);
+                text[text_len] = '\0';
+                if (parse_address(text, &addrs[count]))
+                    count++;
+            }
+            p += text_len;
+            if (*p == ',')
+                p++;
+        }
+        if (count > 0)
+            return count;
+    }
+
+    int status = getaddrinfo(hostname, NULL, &hints, &result);
+    if (status != 0)
+    {
+        if (status == EAI_NONAME)
+            cache_store('F', key, "-", RESOLVER_NEGATIVE_TTL);
+        return 0;
+    }
+
+    // Interleave everything getaddrinfo() found, then keep the first few
+    struct sockaddr_storage found[RESOLVER_GAI_ADDRESSES];
+    int found_count = 0;
+    for (struct addrinfo *ai = result; ai != NULL && found_count < RESOLVER_GAI_ADDRESSES; ai = ai->ai_next)
+    {
+        if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+            ai->ai_addrlen > sizeof(found[found_count]))
+            continue;
+        memset(&found[found_count], 0, sizeof(found[found_count]));
+        memcpy(&found[found_count], ai->ai_addr, ai->ai_addrlen);
+        found_count++;
+    }
+    freeaddrinfo(result);
+
+    if (found_count == 0)
+        return 0;
+    interleave_families(found, found_count);
+    if (found_count > RESOLVER_MAX_ADDRESSES)
+        found_count = RESOLVER_MAX_ADDRESSES;
+
+    // Cached in the order to try, comma separated
+    char value[RESOLVER_NAME_SIZE] = "";
+    for (int i = 0; i < found_count; i++)
+    {
+        char text[INET6_ADDRSTRLEN];
+        address_text(&found[i], text, sizeof(text));
+        size_t used = strlen(value);
+        snprintf(value + used, sizeof(value) - used, "%s%s", i ? "," : "", text);
+    }
+    cache_store('F', key, value, RESOLVER_TTL);
+
+    int count = (found_count < max_addrs) ? found_count : max_addrs;
+    memcpy(addrs, found, (size_t)count * sizeof(*addrs));
+    return count;
+}
+
+static void release_lookup(struct reverse_lookup *lookup)
+{
+    pthread_mutex_lock(&lookup->lock);
+    int last = (--lookup->refs == 0);
+    pthread_mutex_unlock(&lookup->lock);
+
+    if (last)
+    {
+        pthread_mutex_destroy(&lookup->lock);
+        pthread_cond_destroy(&lookup->done_cond);
+        free(lookup);
+    }
+}
+
+static void *reverse_main(void *arg)
+{
+    struct reverse_lookup *lookup = arg;
+
+    char name[RESOLVER_NAME_SIZE];
+    int status = getnameinfo((struct sockaddr *)&lookup->addr, address_len(&lookup->addr),
+                             name, sizeof(name), NULL, 0, NI_NAMEREQD);
+
+    pthread_mutex_lock(&lookup->lock);
+    lookup->status = status;
+    if (status == 0)
+        memcpy(lookup->name, name, sizeof(name));
+    lookup->done = 1;
+    pthread_cond_signal(&lookup->done_cond);
+    pthread_mutex_unlock(&lookup->lock);
+
+    release_lookup(lookup);
+    return NULL;
+}
+
+void resolver_reverse_start(const struct sockaddr_storage *addr)
+{
+    if (pending != NULL)
+    {
+        release_lookup(pending);
+        pending = NULL;
+    }
+
+    char key[INET6_ADDRSTRLEN];
+    address_text(addr, key, sizeof(key));
+    if (cache_find('R', key) != NULL)
+        return;
+
+    struct reverse_lookup *lookup = calloc(1, sizeof(*lookup));
+    if (lookup == NULL)
+        return;
+    pthread_mutex_init(&lookup->lock, NULL);
+    pthread_cond_init(&lookup->done_cond, NULL);
+    lookup->refs = 2;
+    lookup->addr = *addr;
+    memcpy(lookup->key, key, sizeof(key));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reverse_main, lookup) != 0)
+    {
+        pthread_mutex_destroy(&lookup->lock);
+        pthread_cond_destroy(&lookup->done_cond);
+        free(lookup);
+        return;
+    }
+    pthread_detach(thread);
+    pending = lookup;
+}
+
+// Waits for the pending lookup. Returns 1 and copies the name if found.
+static int wait_pending(char *hostname, size_t hostname_len)
+{
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_sec += RESOLVER_REVERSE_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (RESOLVER_REVERSE_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    struct reverse_lookup *lookup = pending;
+    pending = NULL;
+
+    pthread_mutex_lock(&lookup->lock);
+    while (!lookup->done)
+    {
+        if (pthread_cond_timedwait(&lookup->done_cond, &lookup->lock, &deadline) != 0)
+            break;
+    }
+    int found = 0;
+    if (lookup->done)
+    {
+        // Too slow a lookup is abandoned and the address shown instead
+        found = (lookup->status == 0);
+        if (found)
+        {
+            cache_store('R', lookup->key, lookup->name, RESOLVER_TTL);
+            snprintf(hostname, hostname_len, "%s", lookup->name);
+        }
+        else if (lookup->status == EAI_NONAME)
+        {
+            cache_store('R', lookup->key, "-", RESOLVER_NEGATIVE_TTL);
+        }
+    }
+    pthread_mutex_unlock(&lookup->lock);
+
+    release_lookup(lookup);
+    return found;
+}
+
+void resolver_reverse_finish(const struct sockaddr_storage *addr,
+                             char *hostname, size_t hostname_len, char *ip_str, size_t ip_len)
+{
+    // Get IP string
+    address_text(addr, ip_str, ip_len);
+
+    char key[INET6_ADDRSTRLEN];
+    address_text(addr, key, sizeof(key));
+
+    int found = 0;
+    struct cache_entry *cached = cache_find('R', key);
+    if (cached != NULL)
+    {
+        found = (strcmp(cached->value, "-") != 0);
+        if (found)
+            snprintf(hostname, hostname_len, "%s", cached->value);
+    }
+    else
+    {
+        // The address that answered may not be the one looked up at start
+        if (pending == NULL || strcmp(pending->key, key) != 0)
+            resolver_reverse_start(addr);
+        if (pending != NULL)
+            found = wait_pending(hostname, hostname_len);
+    }
+
+    if (pending != NULL)
+    {
+        release_lookup(pending);
+        pending = NULL;
+    }
+    if (!found)
+        snprintf(hostname, hostname_len, "%s", ip_str);
+}
@@ -0,0 +1,59 @@
+/*
+ * resolver.h
+ *
+ * Name resolution for the client, on top of getaddrinfo()/getnameinfo().
+ * Forward and reverse results are kept in a small text file between runs,
+ * so repeated invocations skip DNS until an entry expires. The reverse
+ * lookup is only needed to display the server name, so it runs in its own
+ * thread while the request is on the wire.
+ */
+
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <stddef.h>
+
+#define RESOLVER_TTL 300               // seconds a resolved name or address is kept
+#define RESOLVER_NEGATIVE_TTL 60       // seconds a "no such name" answer is kept
+#define RESOLVER_CACHE_ENTRIES 256     // entries kept in the cache file
+#define RESOLVER_NAME_SIZE 256         // longest cached host name, including '\0'
+#define RESOLVER_REVERSE_TIMEOUT_MS 2000  // longest wait for the display name
+#define RESOLVER_MAX_ADDRESSES 4       // addresses returned (and cached) per name
+
+// Default cache file: $HOME/.meteo_dns_cache (%LOCALAPPDATA% on Windows),
+// or NULL if there is no such directory
+const char *resolver_default_cache_path(void);
+
+// Loads the unexpired entries of the cache file. With path NULL nothing is
+// read or written and every lookup goes to DNS.
+void resolver_init(const char *cache_path);
+
+// IPv6 and IPv4 addresses of hostname, which may also be a numeric address,
+// in the order they should be tried: the family getaddrinfo() prefers
+// first, then alternating families (RFC 8305). Ports are left at 0.
+// Returns the number of addresses stored, 0 if the name cannot be resolved.
+int resolver_lookup(const char *hostname, struct sockaddr_storage *addrs, int max_addrs);
+
+// Starts the reverse lookup of addr, unless the cache already has it
+void resolver_reverse_start(const struct sockaddr_storage *addr);
+
+// Copies the name of addr into hostname, or its text form when there is
+// none; ip_str always receives the text form. Waits up to
+// RESOLVER_REVERSE_TIMEOUT_MS for the lookup started by
+// resolver_reverse_start(), or starts one if that was another address.
+void resolver_reverse_finish(const struct sockaddr_storage *addr,
+                             char *hostname, size_t hostname_len, char *ip_str, size_t ip_len);
+
+// Writes the cache file back if a lookup added anything to it
+void resolver_save(void);
+
+#endif /* RESOLVER_H_ */
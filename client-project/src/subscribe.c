@@ -0,0 +1,361 @@
+/*
+ * subscribe.c
+ *
+ * Subscription mode (-P option).
+ *
+ * The -r requests are grouped by city into one subscription each, covering
+ * all the types asked for that city. A subscription is set up one city at a
+ * time: the first request gets a cookie from the server and is sent again
+ * with it to confirm. After that the server pushes an update every interval
+ * seconds; the client prints them, renews each lease halfway through and
+ * cancels every subscription once it has received the updates it wanted.
+ * Should the server forget a subscription (a restart, or a lost renewal),
+ * the ack to the renewal carries a new cookie and the client confirms it
+ * again.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#include <arpa/inet.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "client.h"
+
+struct subscription {
+    struct subscribe_request req;   // cookie as last given by the server
+    const char *city;               // for display
+    int active;                     // confirmed and not refused since
+    uint64_t renew_ms;              // next renewal (or retransmission)
+};
+
+static const char subscribe_types[SUBSCRIBE_MAX_TYPES] = {REQ_TEMPERATURE, REQ_HUMIDITY, REQ_WIND,
+                                                          REQ_PRESSURE};
+
+static uint64_t now_ms(void)
+{
+#if defined WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+// Waits until the socket is readable or timeout_ms elapses. Returns > 0 if readable.
+static int wait_readable(int sock, uint64_t timeout_ms)
+{
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sock, &read_fds);
+
+    struct timeval tv;
+    tv.tv_sec = (long)(timeout_ms / 1000);
+    tv.tv_usec = (long)(timeout_ms % 1000) * 1000;
+    return select(sock + 1, &read_fds, NULL, NULL, &tv);
+}
+
+// Index of the subscription to city (by ID, or by name when city_id < 0), -1 if none
+static int find_city(const struct subscription *subs, int count, int city_id, const char *city)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (city_id >= 0 ? subs[i].req.city_id == city_id
+                         : (city != NULL && subs[i].req.city_id < 0 &&
+                            strcmp(subs[i].req.city, city) == 0))
+            return i;
+    }
+    return -1;
+}
+
+static int send_subscription(struct server_target *server, const struct subscription *sub)
+{
+    char send_buffer[BATCH_MAX_DATAGRAM];
+    int send_len = serialize_subscribe_request(&sub->req, send_buffer, sizeof(send_buffer));
+    if (send_len < 0)
+        return -1;
+    return (sendto(server->sock, send_buffer, send_len, 0,
+                   (const struct sockaddr *)&server->addr, server->addr_len) < 0)
+               ? -1
+               : 0;
+}
+
+static void print_update(const struct server_target *server, const struct subscription *sub,
+                         const struct subscribe_update *update)
+{
+    for (unsigned int i = 0; i < update->count; i++)
+    {
+        struct response resp;
+        resp.status = update->results[i].status;
+        resp.type = update->results[i].type;
+        resp.value = update->results[i].value;
+        print_result(server->hostname, server->ip, &resp, sub->city);
+    }
+}
+
+// Applies an ack to sub. Returns 1 if the request must be sent again with
+// the cookie just received, 0 otherwise.
+static int handle_ack(const struct server_target *server, struct subscription *sub,
+                      const struct subscribe_ack *ack)
+{
+    if (ack->status != STATUS_SUCCESS)
+    {
+        sub->active = 0;
+        if (ack->status == SUBSCRIBE_FULL)
+        {
+            printf("Il server %s non accetta altre sottoscrizioni\n", server->hostname);
+        }
+        else
+        {
+            int t = 0;
+            while (t < SUBSCRIBE_MAX_TYPES - 1 && !(sub->req.types & (1u << t)))
+                t++;
+            struct response resp;
+            resp.status = ack->status;
+            resp.type = subscribe_types[t];
+            resp.value = 0.0f;
+            print_result(server->hostname, server->ip, &resp, sub->city);
+        }
+        return 0;
+    }
+
+    if (ack->cookie != sub->req.cookie)
+    {
+        sub->req.cookie = ack->cookie;
+        return 1;
+    }
+
+    // Updates are matched by ID from now on
+    if (!sub->active)
+    {
+        char city_formatted[CITY_SIZE];
+        strncpy(city_formatted, sub->city, CITY_SIZE - 1);
+        city_formatted[CITY_SIZE - 1] = '\0';
+        capitalize_city(city_formatted);
+        printf("Sottoscrizione a %s: un aggiornamento ogni %u s\n", city_formatted, ack->interval);
+    }
+    sub->req.city_id = ack->city_id;
+    sub->req.interval = ack->interval;
+    sub->active = 1;
+    sub->renew_ms = now_ms() + (uint64_t)ack->lease * 1000 / 2;
+    return 0;
+}
+
+// Handles one datagram from the server: prints an update, or applies an ack
+// to sub (the subscription being set up) or to the one with its city ID.
+// Returns the number of updates printed, -1 for a legacy reply.
+static int handle_message(struct server_target *server, struct subscription *subs, int count,
+                          struct subscription *sub, const char *buffer, int len)
+{
+    int kind = subscribe_message_kind(buffer, len);
+
+    if (kind == SUBSCRIBE_UPDATE)
+    {
+        struct subscribe_update update;
+        int i;
+        if (deserialize_subscribe_update(buffer, len, &update) < 0 ||
+            (i = find_city(subs, count, update.city_id, NULL)) < 0 || !subs[i].active)
+            return 0;
+        print_update(server, &subs[i], &update);
+        return 1;
+    }
+
+    if (kind == SUBSCRIBE_ACK)
+    {
+        struct subscribe_ack ack;
+        if (deserialize_subscribe_ack(buffer, len, &ack) < 0)
+            return 0;
+        if (sub == NULL)
+        {
+            int i = find_city(subs, count, ack.city_id, NULL);
+            if (i < 0)
+                return 0;
+            sub = &subs[i];
+        }
+        if (handle_ack(server, sub, &ack))
+            send_subscription(server, sub);
+        return 0;
+    }
+
+    // A server without subscriptions answers with a legacy response
+    return (len == (int)RESPONSE_BUFFER_SIZE) ? -1 : 0;
+}
+
+// Subscribes to one city, waiting for the confirmation. Returns the updates
+// printed meanwhile (of cities already subscribed), -1 on error.
+static int setup(struct server_target *server, struct subscription *subs, int count,
+                 struct subscription *sub)
+{
+    char buffer[BATCH_MAX_DATAGRAM];
+    int printed = 0;
+
+    if (server->sock < 0)
+    {
+        // The first request also picks the server address
+        int send_len = serialize_subscribe_request(&sub->req, buffer, sizeof(buffer));
+        if (send_len < 0)
+        {
+            printf("Errore: richiesta di sottoscrizione non valida\n");
+            return -1;
+        }
+        int recv_len = exchange(server, buffer, send_len, buffer, sizeof(buffer));
+        if (recv_len < 0)
+            return -1;
+        if (handle_message(server, subs, count, sub, buffer, recv_len) < 0)
+        {
+            printf("Il server %s non supporta gli aggiornamenti periodici\n", server->hostname);
+            return -1;
+        }
+        if (sub->active || sub->req.cookie == 0)
+            return 0;
+    }
+    else if (send_subscription(server, sub) < 0)
+    {
+        printf("Errore nell'invio della richiesta\n");
+        return -1;
+    }
+
+    uint32_t cookie = sub->req.cookie;
+    for (int attempt = 0; attempt <= SUBSCRIBE_RETRIES && !sub->active;)
+    {
+        uint64_t deadline = now_ms() + SUBSCRIBE_TIMEOUT_MS;
+        uint64_t now;
+        while (!sub->active && (now = now_ms()) < deadline)
+        {
+            if (wait_readable(server->sock, deadline - now) <= 0)
+                break;
+            int recv_len = recvfrom(server->sock, buffer, sizeof(buffer), 0, NULL, NULL);
+            if (recv_len <= 0)
+                continue;
+            int n = handle_message(server, subs, count, sub, buffer, recv_len);
+            if (n < 0)
+            {
+                printf("Il server %s non supporta gli aggiornamenti periodici\n", server->hostname);
+                return -1;
+            }
+            printed += n;
+
+            // Refused, or a new cookie (already sent back): a fresh deadline
+            if (sub->req.cookie == 0 || (!sub->active && sub->req.cookie != cookie))
+                break;
+        }
+
+        if (sub->active || sub->req.cookie == 0)
+            break;
+        if (sub->req.cookie == cookie)
+        {
+            attempt++;
+            send_subscription(server, sub);
+        }
+        cookie = sub->req.cookie;
+    }
+
+    if (!sub->active && sub->req.cookie != 0)
+        printf("Nessuna conferma della sottoscrizione dal server\n");
+    return printed;
+}
+
+int run_subscribe(struct server_target *server, const struct batch_request *breq,
+                  int interval, int max_updates)
+{
+    static struct subscription subs[BATCH_MAX_QUERIES];
+    int count = 0;
+
+    // One subscription per city, with every type asked for it
+    for (unsigned int q = 0; q < breq->count; q++)
+    {
+        const struct batch_query *query = &breq->queries[q];
+        int t = 0;
+        while (t < SUBSCRIBE_MAX_TYPES && subscribe_types[t] != query->type)
+            t++;
+        if (t == SUBSCRIBE_MAX_TYPES)
+        {
+            printf("Errore: tipo '%c' non valido\n", query->type);
+            return 1;
+        }
+
+        int i = find_city(subs, count, query->city_id, query->city);
+        if (i < 0)
+        {
+            i = count++;
+            memset(&subs[i], 0, sizeof(subs[i]));
+            subs[i].req.interval = (unsigned int)interval;
+            subs[i].req.lease = SUBSCRIBE_DEFAULT_LEASE;
+            if (subs[i].req.lease < 2 * subs[i].req.interval)
+                subs[i].req.lease = 2 * subs[i].req.interval;
+            subs[i].req.city_id = query->city_id;
+            memcpy(subs[i].req.city, query->city, CITY_SIZE);
+            subs[i].city = query->city;
+        }
+        subs[i].req.types |= 1u << t;
+    }
+
+    int received = 0;
+    int active = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int n = setup(server, subs, count, &subs[i]);
+        if (n < 0)
+            return 1;
+        received += n;
+        active += subs[i].active;
+    }
+    if (active == 0)
+        return 1;
+
+    char buffer[BATCH_MAX_DATAGRAM];
+    while (max_updates == 0 || received < max_updates)
+    {
+        // Renewals (and their retransmissions) are due first
+        uint64_t now = now_ms();
+        uint64_t next = now + 60000;
+        active = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (!subs[i].active)
+                continue;
+            active++;
+            if (subs[i].renew_ms <= now)
+            {
+                send_subscription(server, &subs[i]);
+                subs[i].renew_ms = now + SUBSCRIBE_TIMEOUT_MS;
+            }
+            if (subs[i].renew_ms < next)
+                next = subs[i].renew_ms;
+        }
+        if (active == 0)
+            return 1;
+
+        if (wait_readable(server->sock, next - now) <= 0)
+            continue;
+        int recv_len = recvfrom(server->sock, buffer, sizeof(buffer), 0, NULL, NULL);
+        if (recv_len > 0)
+        {
+            int n = handle_message(server, subs, count, NULL, buffer, recv_len);
+            if (n > 0)
+                received += n;
+        }
+    }
+
+    // The server would drop them when the lease ends; cancelling spares it
+    // the updates until then
+    for (int i = 0; i < count; i++)
+    {
+        if (!subs[i].active)
+            continue;
+        subs[i].req.lease = 0;
+        send_subscription(server, &subs[i]);
+    }
+
+    printf("%d aggiornamenti ricevuti\n", received);
+    return 0;
+}
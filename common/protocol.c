@@ -0,0 +1,1210 @@
+/*
+ * protocol.c
+ *
+ * Protocol codec and validation shared by client and server. Each project
+ * compiles it through the one-line src/protocol.c that includes this file,
+ * so both binaries encode and check messages with the same code. The
+ * fixed-size legacy messages are encoded by the inline functions of
+ * protocol.h; this file holds the variable-length extensions.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <ctype.h>
+#include <string.h>
+#include "protocol.h"
+
+/*
+ * ============================================================================
+ * VALIDATION
+ * ============================================================================
+ */
+
+const unsigned char char_class[256] = {
+    ['\t'] = CHAR_INVALID,
+    ['!'] = CHAR_INVALID, ['"'] = CHAR_INVALID, ['#'] = CHAR_INVALID,
+    ['$'] = CHAR_INVALID, ['%'] = CHAR_INVALID, ['&'] = CHAR_INVALID,
+    ['('] = CHAR_INVALID, [')'] = CHAR_INVALID, ['*'] = CHAR_INVALID,
+    ['+'] = CHAR_INVALID, ['/'] = CHAR_INVALID,
+    [':'] = CHAR_INVALID, [';'] = CHAR_INVALID, ['<'] = CHAR_INVALID,
+    ['='] = CHAR_INVALID, ['>'] = CHAR_INVALID, ['?'] = CHAR_INVALID,
+    ['@'] = CHAR_INVALID,
+    ['['] = CHAR_INVALID, ['\\'] = CHAR_INVALID, [']'] = CHAR_INVALID,
+    ['^'] = CHAR_INVALID, ['`'] = CHAR_INVALID,
+    ['{'] = CHAR_INVALID, ['|'] = CHAR_INVALID, ['}'] = CHAR_INVALID,
+    ['~'] = CHAR_INVALID,
+    [REQ_TEMPERATURE] = CHAR_REQUEST_TYPE, [REQ_HUMIDITY] = CHAR_REQUEST_TYPE,
+    [REQ_WIND] = CHAR_REQUEST_TYPE, [REQ_PRESSURE] = CHAR_REQUEST_TYPE,
+};
+
+int is_valid_request_type(char type)
+{
+    return (char_class[(unsigned char)type] & CHAR_REQUEST_TYPE) != 0;
+}
+
+int contains_invalid_chars(const char *str)
+{
+    for (int i = 0; str[i]; i++)
+    {
+        if (char_class[(unsigned char)str[i]] & CHAR_INVALID)
+            return 1;
+    }
+    return 0;
+}
+
+void to_lowercase(char *str)
+{
+    for (int i = 0; str[i]; i++)
+    {
+        str[i] = tolower((unsigned char)str[i]);
+    }
+}
+
+void capitalize_city(char *city)
+{
+    int capitalize_next = 1;
+    for (int i = 0; city[i]; i++)
+    {
+        if (city[i] == ' ')
+        {
+            capitalize_next = 1;
+        }
+        else if (capitalize_next)
+        {
+            city[i] = toupper((unsigned char)city[i]);
+            capitalize_next = 0;
+        }
+        else
+        {
+            city[i] = tolower((unsigned char)city[i]);
+        }
+    }
+}
+
+/*
+ * ============================================================================
+ * BATCH AND HISTORY EXTENSIONS
+ * ============================================================================
+ */
+
+int is_batch_message(const char *buffer, int len)
+{
+    return len >= BATCH_RESPONSE_HEADER_SIZE && len != (int)REQUEST_BUFFER_SIZE &&
+           (unsigned char)buffer[0] == BATCH_MAGIC && buffer[1] == BATCH_VERSION;
+}
+
+int serialize_batch_request(const struct batch_request *req, char *buffer, int buffer_size)
+{
+    int offset = 0;
+
+    if (req->count > BATCH_MAX_QUERIES || buffer_size < BATCH_REQUEST_HEADER_SIZE)
+        return -1;
+
+    // Magic and version (1 byte each)
+    buffer[offset++] = (char)BATCH_MAGIC;
+    buffer[offset++] = BATCH_VERSION;
+
+    // Count and max response size (2 bytes each, network byte order)
+    uint16_t net_count = htons((uint16_t)req->count);
+    memcpy(buffer + offset, &net_count, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    uint16_t net_max = htons((uint16_t)req->max_response);
+    memcpy(buffer + offset, &net_max, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    for (unsigned int i = 0; i < req->count; i++)
+    {
+        const struct batch_query *q = &req->queries[i];
+
+        if (q->city_id >= 0)
+        {
+            // Type, marker, city ID (2 bytes)
+            if (q->city_id > 0xFFFF || offset + 4 > buffer_size)
+                return -1;
+            buffer[offset++] = q->type;
+            buffer[offset++] = (char)BATCH_CITY_BY_ID;
+            uint16_t net_id = htons((uint16_t)q->city_id);
+            memcpy(buffer + offset, &net_id, sizeof(uint16_t));
+            offset += sizeof(uint16_t);
+        }
+        else
+        {
+            // Type, length, city name without terminator
+            size_t len = strnlen(q->city, CITY_SIZE);
+            if (len == 0 || len >= CITY_SIZE || offset + 2 + (int)len > buffer_size)
+                return -1;
+            buffer[offset++] = q->type;
+            buffer[offset++] = (char)len;
+            memcpy(buffer + offset, q->city, len);
+            offset += (int)len;
+        }
+    }
+
+    // Never as long as a legacy request: pad with a byte the decoder skips
+    if (offset == (int)REQUEST_BUFFER_SIZE)
+    {
+        if (offset + 1 > buffer_size)
+            return -1;
+        buffer[offset++] = '\0';
+    }
+
+    return offset;
+}
+
+int deserialize_batch_request(const char *buffer, int len, struct batch_request *req)
+{
+    int offset = 0;
+
+    if (len < BATCH_REQUEST_HEADER_SIZE || !is_batch_message(buffer, len))
+        return -1;
+    offset += 2; // magic and version
+
+    uint16_t net_count;
+    memcpy(&net_count, buffer + offset, sizeof(uint16_t));
+    req->count = ntohs(net_count);
+    offset += sizeof(uint16_t);
+
+    uint16_t net_max;
+    memcpy(&net_max, buffer + offset, sizeof(uint16_t));
+    req->max_response = ntohs(net_max);
+    offset += sizeof(uint16_t);
+
+    if (req->count > BATCH_MAX_QUERIES)
+        return -1;
+
+    for (unsigned int i = 0; i < req->count; i++)
+    {
+        struct batch_query *q = &req->queries[i];
+
+        if (offset + 2 > len)
+            return -1;
+        q->type = buffer[offset++];
+        unsigned char marker = (unsigned char)buffer[offset++];
+
+        if (marker == BATCH_CITY_BY_ID)
+        {
+            if (offset + 2 > len)
+                return -1;
+            uint16_t net_id;
+            memcpy(&net_id, buffer + offset, sizeof(uint16_t));
+            q->city_id = ntohs(net_id);
+            q->city[0] = '\0';
+            offset += sizeof(uint16_t);
+        }
+        else
+        {
+            if (marker == 0 || marker >= CITY_SIZE || offset + marker > len)
+                return -1;
+            q->city_id = -1;
+            memset(q->city, 0, CITY_SIZE);
+            memcpy(q->city, buffer + offset, marker);
+            offset += marker;
+        }
+    }
+
+    return offset;
+}
+
+int serialize_batch_response(const struct batch_response *resp, char *buffer, int buffer_size)
+{
+    int offset = 0;
+
+    if (resp->count > BATCH_MAX_QUERIES ||
+        BATCH_RESPONSE_HEADER_SIZE + (int)resp->count * BATCH_RESULT_SIZE > buffer_size)
+        return -1;
+
+    // Magic and version (1 byte each)
+    buffer[offset++] = (char)BATCH_MAGIC;
+    buffer[offset++] = BATCH_VERSION;
+
+    // Count (2 bytes, network byte order)
+    uint16_t net_count = htons((uint16_t)resp->count);
+    memcpy(buffer + offset, &net_count, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    for (unsigned int i = 0; i < resp->count; i++)
+    {
+        const struct batch_result *r = &resp->results[i];
+
+        // Status and type (1 byte each)
+        buffer[offset++] = (char)r->status;
+        buffer[offset++] = r->type;
+
+        // Value (float with network byte order)
+        uint32_t temp;
+        memcpy(&temp, &r->value, sizeof(float));
+        temp = htonl(temp);
+        memcpy(buffer + offset, &temp, sizeof(float));
+        offset += sizeof(float);
+    }
+
+    return offset;
+}
+
+int deserialize_batch_response(const char *buffer, int len, struct batch_response *resp)
+{
+    int offset = 0;
+
+    if (!is_batch_message(buffer, len))
+        return -1;
+    offset += 2; // magic and version
+
+    uint16_t net_count;
+    memcpy(&net_count, buffer + offset, sizeof(uint16_t));
+    resp->count = ntohs(net_count);
+    offset += sizeof(uint16_t);
+
+    if (resp->count > BATCH_MAX_QUERIES ||
+        offset + (int)resp->count * BATCH_RESULT_SIZE > len)
+        return -1;
+
+    for (unsigned int i = 0; i < resp->count; i++)
+    {
+        struct batch_result *r = &resp->results[i];
+
+        r->status = (unsigned char)buffer[offset++];
+        r->type = buffer[offset++];
+
+        uint32_t temp;
+        memcpy(&temp, buffer + offset, sizeof(float));
+        temp = ntohl(temp);
+        memcpy(&r->value, &temp, sizeof(float));
+        offset += sizeof(float);
+    }
+
+    return offset;
+}
+
+int is_history_message(const char *buffer, int len)
+{
+    return len >= HISTORY_REQUEST_HEADER_SIZE &&
+           (unsigned char)buffer[0] == HISTORY_MAGIC && buffer[1] == HISTORY_VERSION;
+}
+
+int serialize_history_request(const struct history_request *req, char *buffer, int buffer_size)
+{
+    int offset = 0;
+
+    if (buffer_size < HISTORY_REQUEST_HEADER_SIZE)
+        return -1;
+
+    // Magic and version (1 byte each)
+    buffer[offset++] = (char)HISTORY_MAGIC;
+    buffer[offset++] = HISTORY_VERSION;
+
+    // Max response size (2 bytes), from and to (4 bytes each), network byte order
+    uint16_t net_max = htons((uint16_t)req->max_response);
+    memcpy(buffer + offset, &net_max, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    uint32_t net_time = htonl(req->from);
+    memcpy(buffer + offset, &net_time, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    net_time = htonl(req->to);
+    memcpy(buffer + offset, &net_time, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    // Query, as in a batch request
+    const struct batch_query *q = &req->query;
+    if (q->city_id >= 0)
+    {
+        if (q->city_id > 0xFFFF || offset + 4 > buffer_size)
+            return -1;
+        buffer[offset++] = q->type;
+        buffer[offset++] = (char)BATCH_CITY_BY_ID;
+        uint16_t net_id = htons((uint16_t)q->city_id);
+        memcpy(buffer + offset, &net_id, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+    }
+    else
+    {
+        size_t len = strnlen(q->city, CITY_SIZE);
+        if (len == 0 || len >= CITY_SIZE || offset + 2 + (int)len > buffer_size)
+            return -1;
+        buffer[offset++] = q->type;
+        buffer[offset++] = (char)len;
+        memcpy(buffer + offset, q->city, len);
+        offset += (int)len;
+    }
+
+    return offset;
+}
+
+int deserialize_history_request(const char *buffer, int len, struct history_request *req)
+{
+    int offset = 0;
+
+    if (!is_history_message(buffer, len) || len < HISTORY_REQUEST_HEADER_SIZE + 2)
+        return -1;
+    offset += 2; // magic and version
+
+    uint16_t net_max;
+    memcpy(&net_max, buffer + offset, sizeof(uint16_t));
+    req->max_response = ntohs(net_max);
+    offset += sizeof(uint16_t);
+
+    uint32_t net_time;
+    memcpy(&net_time, buffer + offset, sizeof(uint32_t));
+    req->from = ntohl(net_time);
+    offset += sizeof(uint32_t);
+
+    memcpy(&net_time, buffer + offset, sizeof(uint32_t));
+    req->to = ntohl(net_time);
+    offset += sizeof(uint32_t);
+
+    struct batch_query *q = &req->query;
+    q->type = buffer[offset++];
+    unsigned char marker = (unsigned char)buffer[offset++];
+
+    if (marker == BATCH_CITY_BY_ID)
+    {
+        if (offset + 2 > len)
+            return -1;
+        uint16_t net_id;
+        memcpy(&net_id, buffer + offset, sizeof(uint16_t));
+        q->city_id = ntohs(net_id);
+        q->city[0] = '\0';
+        offset += sizeof(uint16_t);
+    }
+    else
+    {
+        if (marker == 0 || marker >= CITY_SIZE || offset + marker > len)
+            return -1;
+        q->city_id = -1;
+        memset(q->city, 0, CITY_SIZE);
+        memcpy(q->city, buffer + offset, marker);
+        offset += marker;
+    }
+
+    return offset;
+}
+
+// Encoder/decoder state of the history bit stream
+struct gorilla_state {
+    uint32_t timestamp;
+    uint32_t delta;      // wraps like the timestamps; the difference is signed
+    uint32_t value;      // bits of the float
+    int leading;         // window of the last XOR written in full, -1 before any
+    int trailing;
+};
+
+// Appends the low width bits of value at bit pos, most significant first,
+// into a zeroed stream; with stream NULL only counts them. Returns the new
+// position.
+static int put_bits(unsigned char *stream, int pos, uint32_t value, int width)
+{
+    if (stream == NULL)
+        return pos + width;
+
+    for (int i = width - 1; i >= 0; i--, pos++)
+    {
+        if ((value >> i) & 1)
+            stream[pos >> 3] |= (unsigned char)(0x80 >> (pos & 7));
+    }
+    return pos;
+}
+
+// Reads width bits at *pos into *value. Returns -1 past the end of the stream.
+static int get_bits(const unsigned char *stream, int stream_bits, int *pos, int width,
+                    uint32_t *value)
+{
+    if (*pos + width > stream_bits)
+        return -1;
+
+    uint32_t bits = 0;
+    for (int i = 0; i < width; i++, (*pos)++)
+        bits = (bits << 1) | ((stream[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+    *value = bits;
+    return 0;
+}
+
+// Appends one sample after the first. With stream NULL only the length is
+// computed and state is left alone. Returns the new bit position.
+static int put_sample(unsigned char *stream, int pos, struct gorilla_state *state,
+                      uint32_t timestamp, uint32_t value)
+{
+    uint32_t delta = timestamp - state->timestamp;
+    int32_t dod = (int32_t)(delta - state->delta);
+
+    if (dod == 0)
+        pos = put_bits(stream, pos, 0x0, 1);
+    else if (dod >= -64 && dod <= 63)
+        pos = put_bits(stream, put_bits(stream, pos, 0x2, 2), (uint32_t)dod & 0x7F, 7);
+    else if (dod >= -256 && dod <= 255)
+        pos = put_bits(stream, put_bits(stream, pos, 0x6, 3), (uint32_t)dod & 0x1FF, 9);
+    else if (dod >= -2048 && dod <= 2047)
+        pos = put_bits(stream, put_bits(stream, pos, 0xE, 4), (uint32_t)dod & 0xFFF, 12);
+    else
+        pos = put_bits(stream, put_bits(stream, pos, 0xF, 4), (uint32_t)dod, 32);
+
+    uint32_t xor = value ^ state->value;
+    int leading = state->leading;
+    int trailing = state->trailing;
+
+    if (xor == 0)
+    {
+        pos = put_bits(stream, pos, 0x0, 1);
+    }
+    else
+    {
+        int lz = __builtin_clz(xor);
+        int tz = __builtin_ctz(xor);
+        if (leading >= 0 && lz >= leading && tz >= trailing)
+        {
+            pos = put_bits(stream, pos, 0x2, 2);
+            pos = put_bits(stream, pos, xor >> trailing, 32 - leading - trailing);
+        }
+        else
+        {
+            leading = lz;
+            trailing = tz;
+            pos = put_bits(stream, pos, 0x3, 2);
+            pos = put_bits(stream, pos, (uint32_t)leading, 5);
+            pos = put_bits(stream, pos, (uint32_t)(32 - leading - trailing - 1), 5);
+            pos = put_bits(stream, pos, xor >> trailing, 32 - leading - trailing);
+        }
+    }
+
+    if (stream != NULL)
+    {
+        state->timestamp = timestamp;
+        state->delta = delta;
+        state->value = value;
+        state->leading = leading;
+        state->trailing = trailing;
+    }
+    return pos;
+}
+
+// Reads one sample after the first into state. Returns -1 if the stream is
+// malformed or too short.
+static int get_sample(const unsigned char *stream, int stream_bits, int *pos,
+                      struct gorilla_state *state)
+{
+    // Timestamp: count the leading 1 bits of the prefix (at most 4)
+    uint32_t bit;
+    int ones = 0;
+    while (ones < 4)
+    {
+        if (get_bits(stream, stream_bits, pos, 1, &bit) < 0)
+            return -1;
+        if (bit == 0)
+            break;
+        ones++;
+    }
+
+    static const int dod_widths[5] = {0, 7, 9, 12, 32};
+    int32_t dod = 0;
+    if (ones > 0)
+    {
+        int width = dod_widths[ones];
+        uint32_t raw;
+        if (get_bits(stream, stream_bits, pos, width, &raw) < 0)
+            return -1;
+        // Sign-extend the two's complement field
+        if (width < 32 && (raw >> (width - 1)) & 1)
+            raw |= ~0u << width;
+        dod = (int32_t)raw;
+    }
+    state->delta += (uint32_t)dod;
+    state->timestamp += state->delta;
+
+    // Value
+    if (get_bits(stream, stream_bits, pos, 1, &bit) < 0)
+        return -1;
+    if (bit == 0)
+        return 0;
+
+    if (get_bits(stream, stream_bits, pos, 1, &bit) < 0)
+        return -1;
+    if (bit == 1)
+    {
+        uint32_t leading, length;
+        if (get_bits(stream, stream_bits, pos, 5, &leading) < 0 ||
+            get_bits(stream, stream_bits, pos, 5, &length) < 0 ||
+            (int)(leading + length + 1) > 32)
+            return -1;
+        state->leading = (int)leading;
+        state->trailing = 32 - (int)leading - (int)length - 1;
+    }
+    else if (state->leading < 0)
+    {
+        return -1;
+    }
+
+    uint32_t xor;
+    if (get_bits(stream, stream_bits, pos, 32 - state->leading - state->trailing, &xor) < 0)
+        return -1;
+    state->value ^= xor << state->trailing;
+    return 0;
+}
+
+int serialize_history_response(const struct history_response *resp, char *buffer, int buffer_size)
+{
+    if (resp->count > HISTORY_MAX_SAMPLES || buffer_size < HISTORY_RESPONSE_HEADER_SIZE)
+        return -1;
+
+    unsigned char *stream = (unsigned char *)buffer + HISTORY_RESPONSE_HEADER_SIZE;
+    int stream_bits = (buffer_size - HISTORY_RESPONSE_HEADER_SIZE) * 8;
+    memset(stream, 0, (size_t)(buffer_size - HISTORY_RESPONSE_HEADER_SIZE));
+
+    // Samples, as many as fit
+    struct gorilla_state state;
+    int pos = 0;
+    unsigned int count = 0;
+    for (; count < resp->count; count++)
+    {
+        uint32_t value;
+        memcpy(&value, &resp->values[count], sizeof(float));
+
+        if (count == 0)
+        {
+            if (stream_bits < 32)
+                break;
+            pos = put_bits(stream, pos, value, 32);
+            state.timestamp = resp->timestamps[0];
+            state.delta = 0;
+            state.value = value;
+            state.leading = -1;
+            state.trailing = 0;
+            continue;
+        }
+
+        if (put_sample(NULL, pos, &state, resp->timestamps[count], value) > stream_bits)
+            break;
+        pos = put_sample(stream, pos, &state, resp->timestamps[count], value);
+    }
+
+    int offset = 0;
+
+    // Magic, version, status and type (1 byte each)
+    buffer[offset++] = (char)HISTORY_MAGIC;
+    buffer[offset++] = HISTORY_VERSION;
+    buffer[offset++] = (char)resp->status;
+    buffer[offset++] = resp->type;
+
+    // Count (2 bytes), next and first timestamp (4 bytes each), network byte order
+    uint16_t net_count = htons((uint16_t)count);
+    memcpy(buffer + offset, &net_count, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    uint32_t net_time = htonl((count < resp->count) ? resp->timestamps[count] : resp->next);
+    memcpy(buffer + offset, &net_time, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    net_time = htonl((count > 0) ? resp->timestamps[0] : 0);
+    memcpy(buffer + offset, &net_time, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    return offset + (pos + 7) / 8;
+}
+
+int deserialize_history_response(const char *buffer, int len, struct history_response *resp)
+{
+    int offset = 0;
+
+    if (!is_history_message(buffer, len) || len < HISTORY_RESPONSE_HEADER_SIZE)
+        return -1;
+    offset += 2; // magic and version
+
+    resp->status = (unsigned char)buffer[offset++];
+    resp->type = buffer[offset++];
+
+    uint16_t net_count;
+    memcpy(&net_count, buffer + offset, sizeof(uint16_t));
+    resp->count = ntohs(net_count);
+    offset += sizeof(uint16_t);
+
+    uint32_t net_time;
+    memcpy(&net_time, buffer + offset, sizeof(uint32_t));
+    resp->next = ntohl(net_time);
+    offset += sizeof(uint32_t);
+
+    memcpy(&net_time, buffer + offset, sizeof(uint32_t));
+    uint32_t first = ntohl(net_time);
+    offset += sizeof(uint32_t);
+
+    if (resp->count > HISTORY_MAX_SAMPLES)
+        return -1;
+    if (resp->count == 0)
+        return offset;
+
+    const unsigned char *stream = (const unsigned char *)buffer + offset;
+    int stream_bits = (len - offset) * 8;
+    int pos = 0;
+
+    struct gorilla_state state;
+    if (get_bits(stream, stream_bits, &pos, 32, &state.value) < 0)
+        return -1;
+    state.timestamp = first;
+    state.delta = 0;
+    state.leading = -1;
+    state.trailing = 0;
+
+    for (unsigned int i = 0; i < resp->count; i++)
+    {
+        if (i > 0 && get_sample(stream, stream_bits, &pos, &state) < 0)
+            return -1;
+        resp->timestamps[i] = state.timestamp;
+        memcpy(&resp->values[i], &state.value, sizeof(float));
+    }
+
+    return offset + (pos + 7) / 8;
+}
+
+/*
+ * ============================================================================
+ * COMPACT FORMAT
+ * ============================================================================
+ */
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    int exponent = (int)((bits >> 23) & 0xFF);
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    // Infinity stays infinity, NaN stays a (quiet) NaN
+    if (exponent == 0xFF)
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+
+    int half_exponent = exponent - 127 + 15;
+    if (half_exponent >= 31)
+        return sign | 0x7C00; // too large: infinity
+
+    uint32_t half;
+    uint32_t rest;
+    uint32_t halfway;
+    if (half_exponent <= 0)
+    {
+        // Subnormal half (or zero): the implicit 1 becomes explicit
+        if (half_exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - half_exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        half = ((uint32_t)half_exponent << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1FFF;
+        halfway = 0x1000;
+    }
+
+    // Round to nearest even; a carry into the exponent is still correct
+    if (rest > halfway || (rest == halfway && (half & 1)))
+        half++;
+    return sign | (uint16_t)half;
+}
+
+float half_to_float(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    int exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0x1F)
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if (exponent != 0)
+    {
+        bits = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    else if (mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // Subnormal half: normalize it
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | ((uint32_t)exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+// Unsigned LEB128: 7 bits per byte, least significant first, high bit set
+// on every byte but the last. Return the new offset, -1 if it does not fit
+// or is longer than a uint32_t.
+static int put_varint(char *buffer, int offset, int buffer_size, uint32_t value)
+{
+    do
+    {
+        if (offset >= buffer_size)
+            return -1;
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        buffer[offset++] = (char)(value ? byte | 0x80 : byte);
+    } while (value);
+    return offset;
+}
+
+static int get_varint(const char *buffer, int len, int offset, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (offset >= len)
+            return -1;
+        unsigned char byte = (unsigned char)buffer[offset++];
+        if (shift == 28 && byte > 0x0F)
+            return -1;
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return offset;
+    }
+    return -1;
+}
+
+static const char compact_types[4] = {REQ_TEMPERATURE, REQ_HUMIDITY, REQ_WIND, REQ_PRESSURE};
+
+int is_compact_message(const char *buffer, int len)
+{
+    return len >= 2 && len != (int)REQUEST_BUFFER_SIZE && len != (int)REQUEST_WITH_ID_SIZE &&
+           (unsigned char)buffer[0] == COMPACT_MAGIC;
+}
+
+int serialize_compact_request(const struct compact_request *req, char *buffer, int buffer_size)
+{
+    int offset = 0;
+    const struct batch_query *q = &req->query;
+
+    if ((req->flags & ~(unsigned int)(COMPACT_HALF | COMPACT_ID)) != 0 || buffer_size < 3)
+        return -1;
+
+    // Magic, flags and type (1 byte each)
+    buffer[offset++] = (char)COMPACT_MAGIC;
+    buffer[offset++] = (char)req->flags;
+    buffer[offset++] = q->type;
+
+    // City: ID, or length and name
+    if (q->city_id >= 0)
+    {
+        offset = put_varint(buffer, offset, buffer_size, (uint32_t)q->city_id << 1);
+    }
+    else
+    {
+        size_t len = strnlen(q->city, CITY_SIZE);
+        if (len == 0 || len >= CITY_SIZE)
+            return -1;
+        offset = put_varint(buffer, offset, buffer_size, (uint32_t)len << 1 | 1);
+        if (offset < 0 || offset + (int)len > buffer_size)
+            return -1;
+        memcpy(buffer + offset, q->city, len);
+        offset += (int)len;
+    }
+    if (offset < 0)
+        return -1;
+
+    if (req->flags & COMPACT_ID)
+    {
+        if (offset + (int)REQUEST_ID_SIZE > buffer_size)
+            return -1;
+        offset += serialize_request_id(req->id, buffer + offset);
+    }
+
+    // Never as long as a legacy request: pad with a byte the decoder skips
+    if (offset == (int)REQUEST_BUFFER_SIZE || offset == (int)REQUEST_WITH_ID_SIZE)
+    {
+        if (offset + 1 > buffer_size)
+            return -1;
+        buffer[offset++] = '\0';
+    }
+
+    return offset;
+}
+
+int deserialize_compact_request(const char *buffer, int len, struct compact_request *req)
+{
+    int offset = 0;
+    struct batch_query *q = &req->query;
+
+    if (len < 4 || !is_compact_message(buffer, len))
+        return -1;
+    offset++; // magic
+
+    req->flags = (unsigned char)buffer[offset++];
+    if ((req->flags & ~(unsigned int)(COMPACT_HALF | COMPACT_ID)) != 0)
+        return -1;
+    q->type = buffer[offset++];
+
+    uint32_t city;
+    offset = get_varint(buffer, len, offset, &city);
+    if (offset < 0)
+        return -1;
+    if (city & 1)
+    {
+        uint32_t name_len = city >> 1;
+        if (name_len == 0 || name_len >= CITY_SIZE || offset + (int)name_len > len)
+            return -1;
+        q->city_id = -1;
+        memset(q->city, 0, CITY_SIZE);
+        memcpy(q->city, buffer + offset, name_len);
+        offset += (int)name_len;
+    }
+    else
+    {
+        q->city_id = (int)(city >> 1);
+        q->city[0] = '\0';
+    }
+
+    req->id = 0;
+    if (req->flags & COMPACT_ID)
+    {
+        if (offset + (int)REQUEST_ID_SIZE > len)
+            return -1;
+        offset += deserialize_request_id(buffer + offset, &req->id);
+    }
+
+    return offset;
+}
+
+int serialize_compact_response(const struct compact_response *resp, char *buffer, int buffer_size)
+{
+    int offset = 0;
+    const struct response *r = &resp->resp;
+
+    if ((resp->flags & ~(unsigned int)(COMPACT_HALF | COMPACT_ID)) != 0 || r->status > 3 ||
+        buffer_size < (int)COMPACT_MAX_RESPONSE)
+        return -1;
+
+    // Magic, then status and type packed with the flags in one byte
+    unsigned int code = COMPACT_TYPE_OTHER;
+    for (unsigned int i = 0; i < sizeof(compact_types); i++)
+    {
+        if (compact_types[i] == r->type)
+            code = i;
+    }
+    buffer[offset++] = (char)COMPACT_MAGIC;
+    buffer[offset++] = (char)(code | r->status << 3 | resp->flags);
+
+    // Value, as a half or a single precision float (network byte order)
+    if (resp->flags & COMPACT_HALF)
+    {
+        uint16_t net_half = htons(float_to_half(r->value));
+        memcpy(buffer + offset, &net_half, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+    }
+    else
+    {
+        uint32_t temp;
+        memcpy(&temp, &r->value, sizeof(float));
+        temp = htonl(temp);
+        memcpy(buffer + offset, &temp, sizeof(float));
+        offset += sizeof(float);
+    }
+
+    if (resp->flags & COMPACT_ID)
+        offset += serialize_request_id(resp->id, buffer + offset);
+
+    return offset;
+}
+
+int deserialize_compact_response(const char *buffer, int len, struct compact_response *resp)
+{
+    int offset = 0;
+    struct response *r = &resp->resp;
+
+    if (!is_compact_message(buffer, len))
+        return -1;
+    offset++; // magic
+
+    unsigned char packed = (unsigned char)buffer[offset++];
+    if (packed & 0x80)
+        return -1;
+    unsigned int code = packed & 0x07;
+    r->type = (code < sizeof(compact_types)) ? compact_types[code] : '?';
+    r->status = (packed >> 3) & 0x03;
+    resp->flags = packed & (COMPACT_HALF | COMPACT_ID);
+
+    int value_size = (resp->flags & COMPACT_HALF) ? (int)sizeof(uint16_t) : (int)sizeof(float);
+    int id_size = (resp->flags & COMPACT_ID) ? (int)REQUEST_ID_SIZE : 0;
+    if (offset + value_size + id_size > len)
+        return -1;
+
+    if (resp->flags & COMPACT_HALF)
+    {
+        uint16_t net_half;
+        memcpy(&net_half, buffer + offset, sizeof(uint16_t));
+        r->value = half_to_float(ntohs(net_half));
+    }
+    else
+    {
+        uint32_t temp;
+        memcpy(&temp, buffer + offset, sizeof(float));
+        temp = ntohl(temp);
+        memcpy(&r->value, &temp, sizeof(float));
+    }
+    offset += value_size;
+
+    resp->id = 0;
+    if (id_size > 0)
+        offset += deserialize_request_id(buffer + offset, &resp->id);
+
+    return offset;
+}
+
+/*
+ * ============================================================================
+ * SUBSCRIPTIONS
+ * ============================================================================
+ */
+
+int subscribe_message_kind(const char *buffer, int len)
+{
+    if (len < 3 || len == (int)REQUEST_BUFFER_SIZE || len == (int)REQUEST_WITH_ID_SIZE ||
+        (unsigned char)buffer[0] != SUBSCRIBE_MAGIC || buffer[1] != SUBSCRIBE_VERSION)
+        return 0;
+
+    switch (buffer[2])
+    {
+    case SUBSCRIBE_REQUEST:
+        return (len >= SUBSCRIBE_REQUEST_HEADER_SIZE + 2) ? SUBSCRIBE_REQUEST : 0;
+    case SUBSCRIBE_ACK:
+        return (len >= SUBSCRIBE_ACK_SIZE) ? SUBSCRIBE_ACK : 0;
+    case SUBSCRIBE_UPDATE:
+        return (len >= SUBSCRIBE_UPDATE_HEADER_SIZE) ? SUBSCRIBE_UPDATE : 0;
+    default:
+        return 0;
+    }
+}
+
+// Magic, version and kind (1 byte each)
+static int put_subscribe_header(char *buffer, int kind)
+{
+    buffer[0] = (char)SUBSCRIBE_MAGIC;
+    buffer[1] = SUBSCRIBE_VERSION;
+    buffer[2] = (char)kind;
+    return 3;
+}
+
+static int put_u16(char *buffer, int offset, unsigned int value)
+{
+    uint16_t net = htons((uint16_t)value);
+    memcpy(buffer + offset, &net, sizeof(uint16_t));
+    return offset + (int)sizeof(uint16_t);
+}
+
+static int put_u32(char *buffer, int offset, uint32_t value)
+{
+    uint32_t net = htonl(value);
+    memcpy(buffer + offset, &net, sizeof(uint32_t));
+    return offset + (int)sizeof(uint32_t);
+}
+
+static unsigned int get_u16(const char *buffer, int offset)
+{
+    uint16_t net;
+    memcpy(&net, buffer + offset, sizeof(uint16_t));
+    return ntohs(net);
+}
+
+static uint32_t get_u32(const char *buffer, int offset)
+{
+    uint32_t net;
+    memcpy(&net, buffer + offset, sizeof(uint32_t));
+    return ntohl(net);
+}
+
+int serialize_subscribe_request(const struct subscribe_request *req, char *buffer, int buffer_size)
+{
+    int offset;
+
+    if (req->types == 0 || req->types >= (1u << SUBSCRIBE_MAX_TYPES) ||
+        req->interval > 0xFFFF || req->lease > 0xFFFF ||
+        buffer_size < SUBSCRIBE_REQUEST_HEADER_SIZE)
+        return -1;
+
+    offset = put_subscribe_header(buffer, SUBSCRIBE_REQUEST);
+    buffer[offset++] = (char)req->types;
+    offset = put_u16(buffer, offset, req->interval);
+    offset = put_u16(buffer, offset, req->lease);
+    offset = put_u32(buffer, offset, req->cookie);
+
+    // City, as in a batch query without the type
+    if (req->city_id >= 0)
+    {
+        if (req->city_id > 0xFFFF || offset + 3 > buffer_size)
+            return -1;
+        buffer[offset++] = (char)BATCH_CITY_BY_ID;
+        offset = put_u16(buffer, offset, (unsigned int)req->city_id);
+    }
+    else
+    {
+        size_t len = strnlen(req->city, CITY_SIZE);
+        if (len == 0 || len >= CITY_SIZE || offset + 1 + (int)len > buffer_size)
+            return -1;
+        buffer[offset++] = (char)len;
+        memcpy(buffer + offset, req->city, len);
+        offset += (int)len;
+    }
+
+    // Never as long as a legacy request: pad with a byte the decoder skips
+    if (offset == (int)REQUEST_BUFFER_SIZE || offset == (int)REQUEST_WITH_ID_SIZE)
+    {
+        if (offset + 1 > buffer_size)
+            return -1;
+        buffer[offset++] = '\0';
+    }
+
+    return offset;
+}
+
+int deserialize_subscribe_request(const char *buffer, int len, struct subscribe_request *req)
+{
+    int offset = 3; // magic, version and kind
+
+    if (subscribe_message_kind(buffer, len) != SUBSCRIBE_REQUEST)
+        return -1;
+
+    req->types = (unsigned char)buffer[offset++];
+    if (req->types == 0 || req->types >= (1u << SUBSCRIBE_MAX_TYPES))
+        return -1;
+    req->interval = get_u16(buffer, offset);
+    offset += sizeof(uint16_t);
+    req->lease = get_u16(buffer, offset);
+    offset += sizeof(uint16_t);
+    req->cookie = get_u32(buffer, offset);
+    offset += sizeof(uint32_t);
+
+    unsigned char marker = (unsigned char)buffer[offset++];
+    if (marker == BATCH_CITY_BY_ID)
+    {
+        if (offset + 2 > len)
+            return -1;
+        req->city_id = (int)get_u16(buffer, offset);
+        req->city[0] = '\0';
+        offset += sizeof(uint16_t);
+    }
+    else
+    {
+        if (marker == 0 || marker >= CITY_SIZE || offset + marker > len)
+            return -1;
+        req->city_id = -1;
+        memset(req->city, 0, CITY_SIZE);
+        memcpy(req->city, buffer + offset, marker);
+        offset += marker;
+    }
+
+    return offset;
+}
+
+int serialize_subscribe_ack(const struct subscribe_ack *ack, char *buffer, int buffer_size)
+{
+    int offset;
+
+    if (ack->status > 0xFF || ack->city_id > 0xFFFF || ack->interval > 0xFFFF ||
+        ack->lease > 0xFFFF || buffer_size < SUBSCRIBE_ACK_SIZE)
+        return -1;
+
+    offset = put_subscribe_header(buffer, SUBSCRIBE_ACK);
+    buffer[offset++] = (char)ack->status;
+    offset = put_u16(buffer, offset, (ack->city_id >= 0) ? (unsigned int)ack->city_id : SUBSCRIBE_NO_CITY);
+    offset = put_u16(buffer, offset, ack->interval);
+    offset = put_u16(buffer, offset, ack->lease);
+    offset = put_u32(buffer, offset, ack->cookie);
+
+    return offset;
+}
+
+int deserialize_subscribe_ack(const char *buffer, int len, struct subscribe_ack *ack)
+{
+    int offset = 3; // magic, version and kind
+
+    if (subscribe_message_kind(buffer, len) != SUBSCRIBE_ACK)
+        return -1;
+
+    ack->status = (unsigned char)buffer[offset++];
+    unsigned int city_id = get_u16(buffer, offset);
+    ack->city_id = (city_id == SUBSCRIBE_NO_CITY) ? -1 : (int)city_id;
+    offset += sizeof(uint16_t);
+    ack->interval = get_u16(buffer, offset);
+    offset += sizeof(uint16_t);
+    ack->lease = get_u16(buffer, offset);
+    offset += sizeof(uint16_t);
+    ack->cookie = get_u32(buffer, offset);
+    offset += sizeof(uint32_t);
+
+    return offset;
+}
+
+int serialize_subscribe_update(const struct subscribe_update *update, char *buffer, int buffer_size)
+{
+    int offset;
+
+    if (update->count > SUBSCRIBE_MAX_TYPES || update->city_id < 0 || update->city_id > 0xFFFF ||
+        SUBSCRIBE_UPDATE_HEADER_SIZE + (int)update->count * BATCH_RESULT_SIZE > buffer_size)
+        return -1;
+
+    offset = put_subscribe_header(buffer, SUBSCRIBE_UPDATE);
+    buffer[offset++] = (char)update->count;
+    offset = put_u16(buffer, offset, (unsigned int)update->city_id);
+    offset = put_u32(buffer, offset, update->timestamp);
+
+    // Results, as in a batch response
+    for (unsigned int i = 0; i < update->count; i++)
+    {
+        const struct batch_result *r = &update->results[i];
+        uint32_t temp;
+
+        buffer[offset++] = (char)r->status;
+        buffer[offset++] = r->type;
+        memcpy(&temp, &r->value, sizeof(float));
+        offset = put_u32(buffer, offset, temp);
+    }
+
+    return offset;
+}
+
+int deserialize_subscribe_update(const char *buffer, int len, struct subscribe_update *update)
+{
+    int offset = 3; // magic, version and kind
+
+    if (subscribe_message_kind(buffer, len) != SUBSCRIBE_UPDATE)
+        return -1;
+
+    update->count = (unsigned char)buffer[offset++];
+    update->city_id = (int)get_u16(buffer, offset);
+    offset += sizeof(uint16_t);
+    update->timestamp = get_u32(buffer, offset);
+    offset += sizeof(uint32_t);
+
+    if (update->count > SUBSCRIBE_MAX_TYPES ||
+        offset + (int)update->count * BATCH_RESULT_SIZE > len)
+        return -1;
+
+    for (unsigned int i = 0; i < update->count; i++)
+    {
+        struct batch_result *r = &update->results[i];
+
+        r->status = (unsigned char)buffer[offset++];
+        r->type = buffer[offset++];
+        uint32_t temp = get_u32(buffer, offset);
+        memcpy(&r->value, &temp, sizeof(float));
+        offset += sizeof(float);
+    }
+
+    return offset;
+}
@@ -0,0 +1,446 @@
+/*
+ * protocol.h
+ *
+ * Shared header file for UDP client and server
+ * Contains protocol definitions, data structures, constants and function prototypes
+ *
+ * Both projects include it through their src/protocol.h and build the codec
+ * in protocol.c through their src/protocol.c, so there is a single copy.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#if defined WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * PROTOCOL CONSTANTS
+ * ============================================================================
+ */
+
+#define DEFAULT_PORT 56700
+#define CITY_SIZE 64
+#define BUFFER_SIZE 512
+
+// Request types
+#define REQ_TEMPERATURE 't'
+#define REQ_HUMIDITY 'h'
+#define REQ_WIND 'w'
+#define REQ_PRESSURE 'p'
+
+// Response status codes
+#define STATUS_SUCCESS 0
+#define STATUS_CITY_NOT_FOUND 1
+#define STATUS_INVALID_REQUEST 2
+
+// Request buffer size: type (1 byte) + city (64 bytes)
+#define REQUEST_BUFFER_SIZE (sizeof(char) + CITY_SIZE)
+
+// Response buffer size: status (4 bytes) + type (1 byte) + value (4 bytes)
+#define RESPONSE_BUFFER_SIZE (sizeof(uint32_t) + sizeof(char) + sizeof(float))
+
+// Field offsets of the fixed-size messages: every field of a request or
+// response is a store or load at a constant offset
+#define REQUEST_TYPE_OFFSET 0
+#define REQUEST_CITY_OFFSET (REQUEST_TYPE_OFFSET + sizeof(char))
+#define RESPONSE_STATUS_OFFSET 0
+#define RESPONSE_TYPE_OFFSET (RESPONSE_STATUS_OFFSET + sizeof(uint32_t))
+#define RESPONSE_VALUE_OFFSET (RESPONSE_TYPE_OFFSET + sizeof(char))
+
+_Static_assert(REQUEST_CITY_OFFSET + CITY_SIZE == REQUEST_BUFFER_SIZE, "request layout");
+_Static_assert(RESPONSE_VALUE_OFFSET + sizeof(float) == RESPONSE_BUFFER_SIZE, "response layout");
+_Static_assert(sizeof(float) == sizeof(uint32_t), "values travel as 32-bit floats");
+
+/*
+ * Request ID extension: a request may carry a 4-byte ID (network byte order)
+ * after the city field. The server then appends the same ID to its response,
+ * so a client with many requests in flight can match each reply. Requests
+ * without ID keep receiving the plain 9-byte response.
+ */
+#define REQUEST_ID_SIZE sizeof(uint32_t)
+#define REQUEST_WITH_ID_SIZE (REQUEST_BUFFER_SIZE + REQUEST_ID_SIZE)
+#define RESPONSE_WITH_ID_SIZE (RESPONSE_BUFFER_SIZE + REQUEST_ID_SIZE)
+
+/*
+ * Batch extension (version 1): many queries in one datagram.
+ * A batch request starts with BATCH_MAGIC and is never REQUEST_BUFFER_SIZE
+ * bytes long, so a server tells it apart from a legacy request by size and
+ * first byte (the encoder pads such a request with one trailing byte, which
+ * the decoder ignores). All multi-byte fields are in network byte order.
+ *
+ * Request:  magic (1) | version (1) | count (2) | max response size (2) | queries
+ *   query by name: type (1) | length (1, 1..63) | city (length bytes)
+ *   query by ID:   type (1) | BATCH_CITY_BY_ID (1) | city ID (2)
+ * Response: magic (1) | version (1) | count (2) | results
+ *   result:        status (1) | type (1) | value (4, float as in struct response)
+ *
+ * The server answers at most as many results as fit in the smaller of the
+ * client's max response size and BATCH_MAX_DATAGRAM; the client re-sends
+ * the queries that were cut off.
+ */
+#define BATCH_MAGIC 0xB7
+#define BATCH_VERSION 1
+#define BATCH_CITY_BY_ID 0xFF
+#define BATCH_REQUEST_HEADER_SIZE 6
+#define BATCH_RESPONSE_HEADER_SIZE 4
+#define BATCH_RESULT_SIZE 6
+#define BATCH_MAX_DATAGRAM 1472    // Ethernet MTU - IPv4 and UDP headers
+#define BATCH_MAX_QUERIES ((BATCH_MAX_DATAGRAM - BATCH_RESPONSE_HEADER_SIZE) / BATCH_RESULT_SIZE)
+
+/*
+ * History extension (version 1): the values a server has recorded for one
+ * (city, type) pair over a time range. Fields in network byte order.
+ *
+ * Request:  magic (1) | version (1) | max response size (2) | from (4) | to (4) | query
+ *   from, to: Unix times in seconds, both included; to 0 means "now"
+ *   query:    as in a batch request (by name or by ID)
+ * Response: magic (1) | version (1) | status (1) | type (1) | count (2) |
+ *           next (4) | first timestamp (4) | samples (bit stream)
+ *   next:     timestamp to ask from for the rest of the range, 0 if none
+ *
+ * The samples are compressed as in Facebook's Gorilla time-series store.
+ * The bit stream, most significant bit first and zero-padded to a byte,
+ * holds the first value as its 32 bits, then for every further sample:
+ *   timestamp, as the change D of the delta from the previous one (the
+ *   delta before the first sample counts as 0), two's complement:
+ *     '0' if D == 0, '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits,
+ *     or '1111' + 32 bits
+ *   value, as its XOR X with the previous value:
+ *     '0' if X == 0; '10' + the bits of X inside the previous window of
+ *     leading and trailing zeros, if they fit in it; otherwise '11' +
+ *     leading zeros (5 bits) + window length - 1 (5 bits) + window bits
+ * With a regular step and a steady value a sample costs two bits. The
+ * server answers as many samples as fit in the smaller of the client's max
+ * response size and BATCH_MAX_DATAGRAM and sets next; the client asks again
+ * from there. A server without history answers with the legacy "invalid
+ * request" response.
+ */
+#define HISTORY_MAGIC 0xB8
+#define HISTORY_VERSION 1
+#define HISTORY_REQUEST_HEADER_SIZE 12
+#define HISTORY_RESPONSE_HEADER_SIZE 14
+#define HISTORY_MAX_SAMPLES \
+    (((BATCH_MAX_DATAGRAM - HISTORY_RESPONSE_HEADER_SIZE) * 8 - 32) / 2 + 1)
+
+/*
+ * Compact format (version 2): one query per datagram without the 64-byte
+ * city field. It is negotiated by trying it: a server that does not know it
+ * answers with the legacy "invalid request" response, and the client goes
+ * back to the legacy format for the rest of the run.
+ *
+ * Request:  magic (1) | flags (1) | type (1) | city (varint) | [name] | [request ID (4)]
+ *   city:   unsigned LEB128 varint of city ID << 1, or of name length << 1 | 1
+ *           followed by the name (1..63 bytes, no terminator)
+ *   flags:  COMPACT_HALF asks for the value as an IEEE 754 half-precision
+ *           float, COMPACT_ID says a request ID follows; other bits are 0
+ * Response: magic (1) | status+type (1) | value (4, or 2 with COMPACT_HALF) |
+ *           [request ID (4)]
+ *   status+type: type code (bits 0-2: 0..3 = t, h, w, p, 7 = any other) |
+ *           status (bits 3-4) | the request's COMPACT_HALF and COMPACT_ID
+ *
+ * A query by ID with a one-byte varint takes 4 bytes and its answer 6 (4
+ * with a half-precision value), against 65 and 9. A compact request is
+ * never REQUEST_BUFFER_SIZE or REQUEST_WITH_ID_SIZE bytes long: the encoder
+ * pads such a request with one byte, which the decoder ignores.
+ */
+#define COMPACT_MAGIC 0xB9
+#define COMPACT_HALF 0x20
+#define COMPACT_ID 0x40
+#define COMPACT_TYPE_OTHER 7
+#define COMPACT_MAX_REQUEST (3 + 5 + (CITY_SIZE - 1) + REQUEST_ID_SIZE + 1)
+#define COMPACT_MAX_RESPONSE (2 + sizeof(float) + REQUEST_ID_SIZE)
+
+/*
+ * Subscription extension (version 1): the server pushes the values of a
+ * city every interval seconds until the lease runs out. Fields in network
+ * byte order; every message starts with magic, version and kind (1 byte
+ * each).
+ *
+ * Request:  header | types (1) | interval (2) | lease (2) | cookie (4) | city
+ *   types:  bit i set for the i-th of t, h, w, p
+ *   lease:  seconds the subscription lasts unless renewed; 0 cancels it
+ *   cookie: 0 at first. The server answers with a cookie and starts pushing
+ *           once the same request comes back with it, so nothing is pushed
+ *           to an address that did not ask; renewals carry it too.
+ *   city:   as in a batch query without the type: length (1, 1..63) and
+ *           name, or BATCH_CITY_BY_ID (1) and city ID (2)
+ * Ack:      header | status (1) | city ID (2) | interval (2) | lease (2) | cookie (4)
+ *   status: a query status, SUBSCRIBE_FULL when the server has no room
+ *           left, or STATUS_INVALID_REQUEST when the cookie is wrong
+ *   interval and lease as granted by the server; the city ID (0xFFFF when
+ *   the city was not found) tags the updates
+ * Update:   header | count (1) | city ID (2) | timestamp (4) | results
+ *   timestamp: Unix time (s) of the values; results as in a batch response
+ *
+ * An ack is never larger than its request, so a forged source address
+ * gains nothing. A request is never REQUEST_BUFFER_SIZE or
+ * REQUEST_WITH_ID_SIZE bytes long (the encoder pads it with one byte). A
+ * server without the extension answers with the legacy "invalid request"
+ * response.
+ */
+#define SUBSCRIBE_MAGIC 0xBA
+#define SUBSCRIBE_VERSION 1
+#define SUBSCRIBE_REQUEST 1
+#define SUBSCRIBE_ACK 2
+#define SUBSCRIBE_UPDATE 3
+#define SUBSCRIBE_REQUEST_HEADER_SIZE 12
+#define SUBSCRIBE_ACK_SIZE 14
+#define SUBSCRIBE_UPDATE_HEADER_SIZE 10
+#define SUBSCRIBE_MAX_TYPES 4
+#define SUBSCRIBE_NO_CITY 0xFFFF
+#define SUBSCRIBE_FULL 3
+
+/*
+ * ============================================================================
+ * PROTOCOL DATA STRUCTURES
+ * ============================================================================
+ */
+
+// Weather request structure
+struct request {
+    char type;      // 't'=temperatura, 'h'=umidità, 'w'=vento, 'p'=pressione
+    char city[CITY_SIZE];  // nome città (null-terminated)
+};
+
+// Weather response structure
+struct response {
+    unsigned int status;  // 0=successo, 1=città non trovata, 2=richiesta invalida
+    char type;            // eco del tipo richiesto
+    float value;          // dato meteo generato
+};
+
+// One query of a batch request
+struct batch_query {
+    char type;
+    int city_id;              // catalog ID, or -1 when the city is given by name
+    char city[CITY_SIZE];     // null-terminated name when city_id == -1
+};
+
+// Batch request
+struct batch_request {
+    unsigned int count;
+    unsigned int max_response;    // largest response datagram the client accepts
+    struct batch_query queries[BATCH_MAX_QUERIES];
+};
+
+// One result of a batch response, in query order
+struct batch_result {
+    unsigned int status;
+    char type;
+    float value;
+};
+
+// Batch response
+struct batch_response {
+    unsigned int count;
+    struct batch_result results[BATCH_MAX_QUERIES];
+};
+
+// History request
+struct history_request {
+    unsigned int max_response;    // largest response datagram the client accepts
+    uint32_t from;                // Unix time (s) of the first sample wanted
+    uint32_t to;                  // Unix time (s) of the last one, 0 = now
+    struct batch_query query;
+};
+
+// Compact request
+struct compact_request {
+    unsigned int flags;           // COMPACT_HALF, COMPACT_ID
+    uint32_t id;                  // request ID, with COMPACT_ID
+    struct batch_query query;
+};
+
+// Compact response; a type outside t, h, w, p comes back as '?'
+struct compact_response {
+    unsigned int flags;           // as in the request
+    uint32_t id;
+    struct response resp;
+};
+
+// Subscription request
+struct subscribe_request {
+    unsigned int types;           // bit i for the i-th of t, h, w, p
+    unsigned int interval;        // seconds between updates
+    unsigned int lease;           // seconds, 0 = cancel
+    uint32_t cookie;              // 0, or the one of the server's ack
+    int city_id;                  // catalog ID, or -1 when the city is given by name
+    char city[CITY_SIZE];         // null-terminated name when city_id == -1
+};
+
+// Subscription acknowledgement
+struct subscribe_ack {
+    unsigned int status;
+    int city_id;                  // -1 when the city was not found
+    unsigned int interval;
+    unsigned int lease;
+    uint32_t cookie;
+};
+
+// Values pushed to a subscriber
+struct subscribe_update {
+    int city_id;
+    uint32_t timestamp;
+    unsigned int count;
+    struct batch_result results[SUBSCRIBE_MAX_TYPES];
+};
+
+// History response: samples oldest first
+struct history_response {
+    unsigned int status;
+    char type;
+    unsigned int count;
+    uint32_t next;                // where to continue, 0 when the range is complete
+    uint32_t timestamps[HISTORY_MAX_SAMPLES];
+    float values[HISTORY_MAX_SAMPLES];
+};
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES
+ * ============================================================================
+ */
+
+// Serialization functions (inline, below): return the bytes written or read
+static inline int serialize_request(const struct request *req, char *buffer);
+static inline int deserialize_request(const char *buffer, struct request *req);
+static inline int serialize_response(const struct response *resp, char *buffer);
+static inline int deserialize_response(const char *buffer, struct response *resp);
+
+// Request ID, written/read right after a serialized request or response
+static inline int serialize_request_id(uint32_t id, char *buffer);
+static inline int deserialize_request_id(const char *buffer, uint32_t *id);
+
+// Batch serialization: return the number of bytes written (or read), -1 if
+// the message does not fit in buffer_size bytes or is malformed
+int is_batch_message(const char *buffer, int len);
+int serialize_batch_request(const struct batch_request *req, char *buffer, int buffer_size);
+int deserialize_batch_request(const char *buffer, int len, struct batch_request *req);
+int serialize_batch_response(const struct batch_response *resp, char *buffer, int buffer_size);
+int deserialize_batch_response(const char *buffer, int len, struct batch_response *resp);
+
+// History serialization, with the same return values. The response
+// serializer encodes the first samples that fit and sets count and next in
+// the datagram accordingly.
+int is_history_message(const char *buffer, int len);
+int serialize_history_request(const struct history_request *req, char *buffer, int buffer_size);
+int deserialize_history_request(const char *buffer, int len, struct history_request *req);
+int serialize_history_response(const struct history_response *resp, char *buffer, int buffer_size);
+int deserialize_history_response(const char *buffer, int len, struct history_response *resp);
+
+// Subscription serialization, with the same return values.
+// subscribe_message_kind() returns SUBSCRIBE_REQUEST, _ACK or _UPDATE, 0 if
+// the datagram is not a subscription message.
+int subscribe_message_kind(const char *buffer, int len);
+int serialize_subscribe_request(const struct subscribe_request *req, char *buffer, int buffer_size);
+int deserialize_subscribe_request(const char *buffer, int len, struct subscribe_request *req);
+int serialize_subscribe_ack(const struct subscribe_ack *ack, char *buffer, int buffer_size);
+int deserialize_subscribe_ack(const char *buffer, int len, struct subscribe_ack *ack);
+int serialize_subscribe_update(const struct subscribe_update *update, char *buffer, int buffer_size);
+int deserialize_subscribe_update(const char *buffer, int len, struct subscribe_update *update);
+
+// Compact serialization, with the same return values
+int is_compact_message(const char *buffer, int len);
+int serialize_compact_request(const struct compact_request *req, char *buffer, int buffer_size);
+int deserialize_compact_request(const char *buffer, int len, struct compact_request *req);
+int serialize_compact_response(const struct compact_response *resp, char *buffer, int buffer_size);
+int deserialize_compact_response(const char *buffer, int len, struct compact_response *resp);
+
+// IEEE 754 half-precision conversion (round to nearest even)
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+// Validation functions, on top of a 256-entry character class table
+#define CHAR_INVALID 0x01        // not allowed in a city name
+#define CHAR_REQUEST_TYPE 0x02   // valid request type ('t', 'h', 'w', 'p')
+
+extern const unsigned char char_class[256];
+
+int is_valid_request_type(char type);
+int contains_invalid_chars(const char *str);
+
+// Utility functions
+void to_lowercase(char *str);
+void capitalize_city(char *city);
+
+/*
+ * ============================================================================
+ * FIXED-SIZE CODEC
+ * ============================================================================
+ */
+
+static inline int serialize_request(const struct request *req, char *buffer)
+{
+    // Type (1 byte, no conversion needed), city (64 bytes)
+    buffer[REQUEST_TYPE_OFFSET] = req->type;
+    memcpy(buffer + REQUEST_CITY_OFFSET, req->city, CITY_SIZE);
+    return REQUEST_BUFFER_SIZE;
+}
+
+static inline int deserialize_request(const char *buffer, struct request *req)
+{
+    req->type = buffer[REQUEST_TYPE_OFFSET];
+    memcpy(req->city, buffer + REQUEST_CITY_OFFSET, CITY_SIZE);
+    req->city[CITY_SIZE - 1] = '\0'; // Ensure null-termination
+    return REQUEST_BUFFER_SIZE;
+}
+
+static inline int serialize_response(const struct response *resp, char *buffer)
+{
+    // Status (4 bytes with network byte order)
+    uint32_t net_status = htonl(resp->status);
+    memcpy(buffer + RESPONSE_STATUS_OFFSET, &net_status, sizeof(uint32_t));
+
+    // Type (1 byte, no conversion needed)
+    buffer[RESPONSE_TYPE_OFFSET] = resp->type;
+
+    // Value (float with network byte order)
+    uint32_t temp;
+    memcpy(&temp, &resp->value, sizeof(float));
+    temp = htonl(temp);
+    memcpy(buffer + RESPONSE_VALUE_OFFSET, &temp, sizeof(float));
+
+    return RESPONSE_BUFFER_SIZE;
+}
+
+static inline int deserialize_response(const char *buffer, struct response *resp)
+{
+    uint32_t net_status;
+    memcpy(&net_status, buffer + RESPONSE_STATUS_OFFSET, sizeof(uint32_t));
+    resp->status = ntohl(net_status);
+
+    resp->type = buffer[RESPONSE_TYPE_OFFSET];
+
+    uint32_t temp;
+    memcpy(&temp, buffer + RESPONSE_VALUE_OFFSET, sizeof(float));
+    temp = ntohl(temp);
+    memcpy(&resp->value, &temp, sizeof(float));
+
+    return RESPONSE_BUFFER_SIZE;
+}
+
+static inline int serialize_request_id(uint32_t id, char *buffer)
+{
+    // ID (4 bytes with network byte order)
+    uint32_t net_id = htonl(id);
+    memcpy(buffer, &net_id, sizeof(uint32_t));
+    return REQUEST_ID_SIZE;
+}
+
+static inline int deserialize_request_id(const char *buffer, uint32_t *id)
+{
+    uint32_t net_id;
+    memcpy(&net_id, buffer, sizeof(uint32_t));
+    *id = ntohl(net_id);
+    return REQUEST_ID_SIZE;
+}
+
+#endif /* PROTOCOL_H_ */
@@ -0,0 +1,96 @@
+/*
+ * address.c
+ *
+ * Conversions between socket addresses and struct client_address.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <string.h>
+#include "address.h"
+
+// ::ffff:0:0/96
+static const unsigned char mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+void address_from_sockaddr(const struct sockaddr_storage *sa, struct client_address *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (sa->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6 *)sa;
+        out->ip = sa6->sin6_addr;
+        out->port = sa6->sin6_port;
+    }
+    else if (sa->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *sa4 = (const struct sockaddr_in *)sa;
+        memcpy(out->ip.s6_addr, mapped_prefix, sizeof(mapped_prefix));
+        memcpy(out->ip.s6_addr + sizeof(mapped_prefix), &sa4->sin_addr, sizeof(sa4->sin_addr));
+        out->port = sa4->sin_port;
+    }
+}
+
+int address_is_ipv4(const struct in6_addr *ip)
+{
+    return memcmp(ip->s6_addr, mapped_prefix, sizeof(mapped_prefix)) == 0;
+}
+
+void address_to_string(const struct in6_addr *ip, char *buf, size_t len)
+{
+    const char *text = address_is_ipv4(ip)
+                           ? inet_ntop(AF_INET, ip->s6_addr + sizeof(mapped_prefix), buf, len)
+                           : inet_ntop(AF_INET6, ip, buf, len);
+    if (text == NULL && len > 0)
+        buf[0] = '\0';
+}
+
+socklen_t address_to_sockaddr(const struct in6_addr *ip, struct sockaddr_storage *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+
+    if (address_is_ipv4(ip))
+    {
+        struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+        sa4->sin_family = AF_INET;
+        memcpy(&sa4->sin_addr, ip->s6_addr + sizeof(mapped_prefix), sizeof(sa4->sin_addr));
+        return sizeof(*sa4);
+    }
+
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_addr = *ip;
+    return sizeof(*sa6);
+}
+
+socklen_t address_to_peer(const struct client_address *addr, int family,
+                          struct sockaddr_storage *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+
+    if (family == AF_INET6)
+    {
+        struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_addr = addr->ip;
+        sa6->sin6_port = addr->port;
+        return sizeof(*sa6);
+    }
+
+    if (family != AF_INET || !address_is_ipv4(&addr->ip))
+        return 0;
+
+    struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+    sa4->sin_family = AF_INET;
+    memcpy(&sa4->sin_addr, addr->ip.s6_addr + sizeof(mapped_prefix), sizeof(sa4->sin_addr));
+    sa4->sin_port = addr->port;
+    return sizeof(*sa4);
+}
@@ -0,0 +1,54 @@
+/*
+ * address.h
+ *
+ * Client addresses in a single form for both IP versions.
+ * The server socket is dual-stack, so IPv4 clients arrive as IPv4-mapped
+ * IPv6 addresses (::ffff:a.b.c.d). Addresses from an IPv4-only socket are
+ * mapped the same way, and everything past the receive loop (limiter, log,
+ * reverse DNS) deals with one 16-byte type.
+ */
+
+#ifndef ADDRESS_H_
+#define ADDRESS_H_
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest text form, including '\0'
+#define ADDRESS_STRLEN INET6_ADDRSTRLEN
+
+struct client_address {
+    struct in6_addr ip;    // IPv6, or IPv4-mapped IPv6
+    uint16_t port;         // network byte order
+};
+
+// Converts a received AF_INET or AF_INET6 address
+void address_from_sockaddr(const struct sockaddr_storage *sa, struct client_address *out);
+
+// Whether ip is an IPv4-mapped address
+int address_is_ipv4(const struct in6_addr *ip);
+
+// Dotted quad for IPv4 clients, the usual IPv6 text otherwise
+void address_to_string(const struct in6_addr *ip, char *buf, size_t len);
+
+// Socket address for getnameinfo(): AF_INET for IPv4 clients, so their
+// reverse lookup goes to in-addr.arpa. Returns its length.
+socklen_t address_to_sockaddr(const struct in6_addr *ip, struct sockaddr_storage *sa);
+
+// Socket address of a client as seen from a socket of the given family:
+// the mapped address itself on a dual-stack socket, AF_INET for an IPv4
+// client of an IPv4-only socket. Returns its length, 0 if the client cannot
+// be reached from such a socket.
+socklen_t address_to_peer(const struct client_address *addr, int family,
+                          struct sockaddr_storage *sa);
+
+#endif /* ADDRESS_H_ */
@@ -0,0 +1,93 @@
+/*
+ * catalog_format.h
+ *
+ * On-disk layout of the binary city catalog loaded with -c.
+ * Shared by the server (city_catalog.c) and by tools/catalog_compile.c.
+ *
+ * Like the wire protocol, the file is written field by field: every integer
+ * is a big-endian uint32/uint16 and every float is its IEEE-754 bit pattern
+ * stored as a big-endian uint32. No struct is ever written as a whole.
+ *
+ *   header   CATALOG_HEADER_SIZE bytes at offset 0
+ *   cities   city_count records of CATALOG_CITY_SIZE bytes
+ *   names    name_count records of CATALOG_NAME_SIZE bytes (names and aliases)
+ *   strings  name bytes, not null-terminated
+ */
+
+#ifndef CATALOG_FORMAT_H_
+#define CATALOG_FORMAT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define CATALOG_MAGIC "CTYC"
+#define CATALOG_VERSION 1
+
+// Header fields
+#define CATALOG_HEADER_SIZE 32
+#define CATALOG_OFF_MAGIC 0           // 4 bytes
+#define CATALOG_OFF_VERSION 4
+#define CATALOG_OFF_CITY_COUNT 8
+#define CATALOG_OFF_NAME_COUNT 12
+#define CATALOG_OFF_CITIES 16         // offset of the city records
+#define CATALOG_OFF_NAMES 20          // offset of the name records
+#define CATALOG_OFF_STRINGS 24        // offset of the string area
+#define CATALOG_OFF_FILE_SIZE 28
+
+// City record: canonical name + climate ranges used to generate values
+#define CATALOG_CITY_SIZE 32
+#define CATALOG_CITY_NAME 0           // index of the canonical name record
+#define CATALOG_CITY_TEMP_MIN 4
+#define CATALOG_CITY_TEMP_MAX 8
+#define CATALOG_CITY_HUMIDITY_MIN 12
+#define CATALOG_CITY_HUMIDITY_MAX 16
+#define CATALOG_CITY_WIND_MAX 20
+#define CATALOG_CITY_PRESSURE_MIN 24
+#define CATALOG_CITY_PRESSURE_MAX 28
+
+// Name record: one spelling (canonical name or alias) of a city
+#define CATALOG_NAME_SIZE 12
+#define CATALOG_NAME_STRING 0         // offset inside the string area
+#define CATALOG_NAME_CITY 4           // city ID (index of the city record)
+#define CATALOG_NAME_LENGTH 8         // uint16, bytes
+
+static inline uint32_t catalog_get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t catalog_get_u16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline float catalog_get_float(const unsigned char *p)
+{
+    uint32_t bits = catalog_get_u32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+static inline void catalog_put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static inline void catalog_put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static inline void catalog_put_float(unsigned char *p, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    catalog_put_u32(p, bits);
+}
+
+#endif /* CATALOG_FORMAT_H_ */
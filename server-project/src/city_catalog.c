@@ -0,0 +1,272 @@
+/*
+ * city_catalog.c
+ *
+ * Loading of the binary city catalog.
+ *
+ * The file is mapped read-only with mmap (MAP_SHARED), so its pages come
+ * from the page cache and are shared by every process serving the same
+ * catalog; nothing is parsed up front except the name records, which are
+ * inserted into a city_index. Climate ranges are decoded from the mapping
+ * on demand. On Windows the file is read into memory instead.
+ */
+
+#if defined WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "city_catalog.h"
+#include "catalog_format.h"
+#include "city_index.h"
+
+struct city_catalog {
+    const unsigned char *data;     // mapped file, NULL for the built-in catalog
+    size_t size;
+    const unsigned char *cities;   // city records
+    const unsigned char *names;    // name records
+    const unsigned char *strings;  // name bytes
+    const char *const *builtin_names;
+    int city_count;
+    struct city_index *index;
+};
+
+static const unsigned char *map_file(const char *path, size_t *size)
+{
+#if defined WIN32
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    unsigned char *data = (len > 0) ? malloc((size_t)len) : NULL;
+    if (data == NULL || fread(data, 1, (size_t)len, f) != (size_t)len)
+    {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = (size_t)len;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+static void unmap_file(const unsigned char *data, size_t size)
+{
+#if defined WIN32
+    (void)size;
+    free((void *)data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+// Checks that [offset, offset + count * record) lies inside the file
+static int region_ok(size_t file_size, uint32_t offset, uint32_t count, uint32_t record)
+{
+    return offset <= file_size && (uint64_t)count * record <= file_size - offset;
+}
+
+struct city_catalog *catalog_open(const char *path)
+{
+    size_t size = 0;
+    const unsigned char *data = map_file(path, &size);
+    if (data == NULL)
+    {
+        printf("Errore nell'apertura del catalogo %s\n", path);
+        return NULL;
+    }
+
+    struct city_catalog *catalog = calloc(1, sizeof(struct city_catalog));
+    if (catalog == NULL)
+    {
+        unmap_file(data, size);
+        return NULL;
+    }
+    catalog->data = data;
+    catalog->size = size;
+
+    if (size < CATALOG_HEADER_SIZE ||
+        memcmp(data + CATALOG_OFF_MAGIC, CATALOG_MAGIC, 4) != 0 ||
+        catalog_get_u32(data + CATALOG_OFF_VERSION) != CATALOG_VERSION ||
+        catalog_get_u32(data + CATALOG_OFF_FILE_SIZE) != size)
+    {
+        printf("Catalogo %s non valido\n", path);
+        catalog_close(catalog);
+        return NULL;
+    }
+
+    uint32_t city_count = catalog_get_u32(data + CATALOG_OFF_CITY_COUNT);
+    uint32_t name_count = catalog_get_u32(data + CATALOG_OFF_NAME_COUNT);
+    uint32_t cities_off = catalog_get_u32(data + CATALOG_OFF_CITIES);
+    uint32_t names_off = catalog_get_u32(data + CATALOG_OFF_NAMES);
+    uint32_t strings_off = catalog_get_u32(data + CATALOG_OFF_STRINGS);
+
+    if (city_count == 0 || city_count > INT32_MAX || name_count > INT32_MAX ||
+        !region_ok(size, cities_off, city_count, CATALOG_CITY_SIZE) ||
+        !region_ok(size, names_off, name_count, CATALOG_NAME_SIZE) ||
+        strings_off > size)
+    {
+        printf("Catalogo %s non valido\n", path);
+        catalog_close(catalog);
+        return NULL;
+    }
+
+    catalog->cities = data + cities_off;
+    catalog->names = data + names_off;
+    catalog->strings = data + strings_off;
+    catalog->city_count = (int)city_count;
+    catalog->index = city_index_create((int)name_count);
+    if (catalog->index == NULL)
+    {
+        catalog_close(catalog);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < city_count; i++)
+    {
+        if (catalog_get_u32(catalog->cities + (size_t)i * CATALOG_CITY_SIZE + CATALOG_CITY_NAME) >= name_count)
+        {
+            printf("Catalogo %s: città %u senza nome\n", path, (unsigned int)i);
+            catalog_close(catalog);
+            return NULL;
+        }
+    }
+
+    const unsigned char *strings = data + strings_off;
+    size_t strings_len = size - strings_off;
+    for (uint32_t i = 0; i < name_count; i++)
+    {
+        const unsigned char *rec = data + names_off + (size_t)i * CATALOG_NAME_SIZE;
+        uint32_t str = catalog_get_u32(rec + CATALOG_NAME_STRING);
+        uint32_t city = catalog_get_u32(rec + CATALOG_NAME_CITY);
+        uint16_t len = catalog_get_u16(rec + CATALOG_NAME_LENGTH);
+
+        if (city >= city_count || str > strings_len || len > strings_len - str ||
+            city_index_add(catalog->index, (const char *)strings + str, len, (int)city) < 0)
+        {
+            printf("Catalogo %s: nome %u non valido\n", path, (unsigned int)i);
+            catalog_close(catalog);
+            return NULL;
+        }
+    }
+
+    return catalog;
+}
+
+struct city_catalog *catalog_builtin(const char *const *names, int count)
+{
+    struct city_catalog *catalog = calloc(1, sizeof(struct city_catalog));
+    if (catalog == NULL)
+        return NULL;
+
+    catalog->city_count = count;
+    catalog->builtin_names = names;
+    catalog->index = city_index_create(count);
+    if (catalog->index == NULL)
+    {
+        catalog_close(catalog);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (city_index_add(catalog->index, names[i], strlen(names[i]), i) < 0)
+        {
+            catalog_close(catalog);
+            return NULL;
+        }
+    }
+
+    return catalog;
+}
+
+void catalog_close(struct city_catalog *catalog)
+{
+    if (catalog == NULL)
+        return;
+    city_index_free(catalog->index);
+    if (catalog->data != NULL)
+        unmap_file(catalog->data, catalog->size);
+    free(catalog);
+}
+
+int catalog_city_count(const struct city_catalog *catalog)
+{
+    return catalog->city_count;
+}
+
+int catalog_find(const struct city_catalog *catalog, const char *name, size_t len)
+{
+    return city_index_find(catalog->index, name, len);
+}
+
+void catalog_city_name(const struct city_catalog *catalog, int city_id, char *name, size_t name_len)
+{
+    const char *src;
+    size_t len;
+
+    if (catalog->data == NULL)
+    {
+        src = catalog->builtin_names[city_id];
+        len = strlen(src);
+    }
+    else
+    {
+        // Name records were bounds-checked by catalog_open()
+        uint32_t record = catalog_get_u32(catalog->cities + (size_t)city_id * CATALOG_CITY_SIZE + CATALOG_CITY_NAME);
+        const unsigned char *rec = catalog->names + (size_t)record * CATALOG_NAME_SIZE;
+        src = (const char *)catalog->strings + catalog_get_u32(rec + CATALOG_NAME_STRING);
+        len = catalog_get_u16(rec + CATALOG_NAME_LENGTH);
+    }
+
+    if (len >= name_len)
+        len = name_len - 1;
+    memcpy(name, src, len);
+    memset(name + len, 0, name_len - len);
+}
+
+int catalog_climate(const struct city_catalog *catalog, int city_id, struct city_climate *climate)
+{
+    if (catalog->data == NULL)
+        return 0;
+
+    const unsigned char *rec = catalog->cities + (size_t)city_id * CATALOG_CITY_SIZE;
+    climate->temp_min = catalog_get_float(rec + CATALOG_CITY_TEMP_MIN);
+    climate->temp_max = catalog_get_float(rec + CATALOG_CITY_TEMP_MAX);
+    climate->humidity_min = catalog_get_float(rec + CATALOG_CITY_HUMIDITY_MIN);
+    climate->humidity_max = catalog_get_float(rec + CATALOG_CITY_HUMIDITY_MAX);
+    climate->wind_max = catalog_get_float(rec + CATALOG_CITY_WIND_MAX);
+    climate->pressure_min = catalog_get_float(rec + CATALOG_CITY_PRESSURE_MIN);
+    climate->pressure_max = catalog_get_float(rec + CATALOG_CITY_PRESSURE_MAX);
+    return 1;
+}
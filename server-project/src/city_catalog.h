@@ -0,0 +1,46 @@
+/*
+ * city_catalog.h
+ *
+ * City catalog: the set of supported cities, their aliases and the climate
+ * ranges used to generate weather values. Either the built-in list or a
+ * binary catalog file (see catalog_format.h) mapped into memory with -c.
+ */
+
+#ifndef CITY_CATALOG_H_
+#define CITY_CATALOG_H_
+
+#include <stddef.h>
+
+struct city_climate {
+    float temp_min;
+    float temp_max;
+    float humidity_min;
+    float humidity_max;
+    float wind_max;
+    float pressure_min;
+    float pressure_max;
+};
+
+struct city_catalog;
+
+// Maps a catalog file and indexes its names. Returns NULL on error (printed).
+struct city_catalog *catalog_open(const char *path);
+
+// Catalog of the given names without climate data, city ID = position
+struct city_catalog *catalog_builtin(const char *const *names, int count);
+
+void catalog_close(struct city_catalog *catalog);
+
+int catalog_city_count(const struct city_catalog *catalog);
+
+// City ID of name (len bytes, any case, aliases included), -1 if unknown
+int catalog_find(const struct city_catalog *catalog, const char *name, size_t len);
+
+// Copies the canonical name of a city into name (null-terminated)
+void catalog_city_name(const struct city_catalog *catalog, int city_id, char *name, size_t name_len);
+
+// Fills the climate ranges of a city; returns 0 if the catalog has none
+// (built-in catalog), 1 otherwise
+int catalog_climate(const struct city_catalog *catalog, int city_id, struct city_climate *climate);
+
+#endif /* CITY_CATALOG_H_ */
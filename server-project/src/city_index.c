@@ -0,0 +1,164 @@
+/*
+ * city_index.c
+ *
+ * Open-addressing hash table of case-folded city names.
+ *
+ * Names are processed 8 bytes at a time: each word is case-folded with a
+ * branch-free SWAR sequence (fold_word), mixed into the hash and, on lookup,
+ * compared against the pre-folded word stored for the candidate entry. The
+ * request string is read in place and never copied or lowercased into a
+ * temporary buffer. The table is kept at most half full, so a lookup
+ * inspects one or two entries whatever the catalog size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "city_index.h"
+#include "protocol.h"
+
+#define WORD_SIZE 8
+#define MAX_NAME_WORDS (CITY_SIZE / WORD_SIZE)
+
+struct city_entry {
+    uint32_t hash;
+    uint16_t len;         // 0 = empty slot
+    uint16_t words;       // folded name length in words
+    int32_t id;
+    uint32_t name_off;    // first word of the folded name in index->names
+};
+
+struct city_index {
+    struct city_entry *entries;
+    uint32_t mask;        // table size - 1
+    uint64_t *names;      // folded, zero-padded names
+    uint32_t names_used;
+    uint32_t names_cap;
+    int count;
+    int max_names;
+};
+
+// Loads the i-th word of name, zero-padding past len, and folds its case
+static inline uint64_t load_word(const char *name, size_t len, size_t i)
+{
+    uint64_t w = 0;
+    size_t off = i * WORD_SIZE;
+    size_t n = (len - off < WORD_SIZE) ? len - off : WORD_SIZE;
+    memcpy(&w, name + off, n);
+    return fold_word(w);
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t w)
+{
+    h ^= w;
+    h *= 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint64_t h = len;
+    size_t words = (len + WORD_SIZE - 1) / WORD_SIZE;
+    for (size_t i = 0; i < words; i++)
+        h = mix(h, load_word(name, len, i));
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+struct city_index *city_index_create(int max_names)
+{
+    if (max_names < 1)
+        max_names = 1;
+
+    uint32_t size = 16;
+    while (size < (uint32_t)max_names * 2)
+        size <<= 1;
+
+    struct city_index *index = calloc(1, sizeof(struct city_index));
+    if (index == NULL)
+        return NULL;
+
+    index->entries = calloc(size, sizeof(struct city_entry));
+    index->names_cap = (uint32_t)max_names * MAX_NAME_WORDS;
+    index->names = calloc(index->names_cap, sizeof(uint64_t));
+    if (index->entries == NULL || index->names == NULL)
+    {
+        city_index_free(index);
+        return NULL;
+    }
+
+    index->mask = size - 1;
+    index->max_names = max_names;
+    return index;
+}
+
+void city_index_free(struct city_index *index)
+{
+    if (index == NULL)
+        return;
+    free(index->entries);
+    free(index->names);
+    free(index);
+}
+
+int city_index_add(struct city_index *index, const char *name, size_t len, int id)
+{
+    if (len == 0 || len >= CITY_SIZE || index->count >= index->max_names)
+        return -1;
+
+    uint32_t hash = hash_name(name, len);
+    uint16_t words = (uint16_t)((len + WORD_SIZE - 1) / WORD_SIZE);
+
+    // A known spelling may be added again for the same city only: two
+    // cities sharing a name could not be told apart
+    uint32_t slot = hash & index->mask;
+    while (index->entries[slot].len != 0)
+    {
+        struct city_entry *e = &index->entries[slot];
+        if (e->hash == hash && e->len == len)
+        {
+            int same = 1;
+            for (size_t i = 0; i < words && same; i++)
+                same = index->names[e->name_off + i] == load_word(name, len, i);
+            if (same)
+                return (e->id == id) ? 0 : -1;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+
+    struct city_entry *e = &index->entries[slot];
+    e->hash = hash;
+    e->len = (uint16_t)len;
+    e->words = words;
+    e->id = id;
+    e->name_off = index->names_used;
+    for (size_t i = 0; i < words; i++)
+        index->names[index->names_used++] = load_word(name, len, i);
+
+    index->count++;
+    return 0;
+}
+
+int city_index_find(const struct city_index *index, const char *name, size_t len)
+{
+    if (len == 0 || len >= CITY_SIZE)
+        return -1;
+
+    uint32_t hash = hash_name(name, len);
+    uint32_t slot = hash & index->mask;
+
+    while (index->entries[slot].len != 0)
+    {
+        const struct city_entry *e = &index->entries[slot];
+        if (e->hash == hash && e->len == len)
+        {
+            const uint64_t *stored = &index->names[e->name_off];
+            uint64_t diff = 0;
+            for (size_t i = 0; i < e->words; i++)
+                diff |= stored[i] ^ load_word(name, len, i);
+            if (diff == 0)
+                return e->id;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+
+    return -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * city_index.h
+ *
+ * Case-insensitive city name index built once at startup.
+ * Maps a city name to a dense city ID (0..count-1) in constant time,
+ * independently of the number of cities.
+ */
+
+#ifndef CITY_INDEX_H_
+#define CITY_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct city_index;
+
+// Creates an empty index sized for up to max_names names (aliases included)
+struct city_index *city_index_create(int max_names);
+void city_index_free(struct city_index *index);
+
+// Adds name (len bytes, any case) as a spelling of city id.
+// Returns 0 on success, -1 if the name is too long, the index is full or
+// the name (in any case) is already a spelling of another city.
+int city_index_add(struct city_index *index, const char *name, size_t len, int id);
+
+// Returns the city ID of name (len bytes, any case), or -1 if unknown.
+// Reads the name in place: no copy, no lowercase buffer.
+int city_index_find(const struct city_index *index, const char *name, size_t len);
+
+// ASCII case folding of 8 bytes at once (bytes >= 0x80 are left untouched)
+static inline uint64_t fold_word(uint64_t w)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    uint64_t low7 = w & (0x7F * ones);
+    uint64_t ge_a = low7 + (0x80 - 'A') * ones;       // high bit set if byte >= 'A'
+    uint64_t gt_z = low7 + (0x80 - 'Z' - 1) * ones;   // high bit set if byte > 'Z'
+    uint64_t upper = ge_a & ~gt_z & ~w & (0x80 * ones);
+    return w | (upper >> 2);                          // 0x80 >> 2 == 0x20
+}
+
+#endif /* CITY_INDEX_H_ */
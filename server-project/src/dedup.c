@@ -0,0 +1,112 @@
+/*
+ * dedup.c
+ *
+ * Per-thread tables of recent responses.
+ *
+ * A table is allocated the first time a thread stores a response and is
+ * indexed by the fingerprint of the request: a 64-bit FNV-1a hash of its
+ * bytes, request ID included, mixed with the sender's address and port.
+ * A slot holds one response; a newer request hashing to the same slot
+ * replaces it, and the retry of the older one is then answered anew.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+struct dedup_entry {
+    uint64_t fingerprint;
+    uint64_t expires_ns;
+    struct client_address client;
+    uint8_t len;                      // 0 = empty slot
+    char response[DEDUP_MAX_RESPONSE];
+};
+
+static uint64_t window_ns;
+static _Thread_local struct dedup_entry *table;
+static _Thread_local int table_failed;
+
+void dedup_init(int window_ms)
+{
+    if (window_ms > DEDUP_MAX_WINDOW_MS)
+        window_ms = DEDUP_MAX_WINDOW_MS;
+    window_ns = (window_ms > 0) ? (uint64_t)window_ms * 1000000u : 0;
+}
+
+int dedup_enabled(void)
+{
+    return window_ns > 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t dedup_fingerprint(const struct client_address *client, const char *request, int len)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET, &client->ip, sizeof(client->ip));
+    hash = fnv1a(hash, &client->port, sizeof(client->port));
+    return fnv1a(hash, request, (size_t)len);
+}
+
+static inline struct dedup_entry *slot_of(uint64_t fingerprint)
+{
+    // The low bits went through the last multiplications: fold the high ones in
+    return &table[(fingerprint ^ (fingerprint >> 32)) & (DEDUP_SLOTS - 1)];
+}
+
+static inline int same_client(const struct client_address *a, const struct client_address *b)
+{
+    return a->port == b->port && memcmp(&a->ip, &b->ip, sizeof(a->ip)) == 0;
+}
+
+int dedup_lookup(const struct client_address *client, uint64_t fingerprint, uint64_t now_ns,
+                 char *response)
+{
+    if (table == NULL)
+        return 0;
+
+    const struct dedup_entry *entry = slot_of(fingerprint);
+    if (entry->len == 0 || entry->fingerprint != fingerprint || now_ns >= entry->expires_ns ||
+        !same_client(&entry->client, client))
+        return 0;
+
+    memcpy(response, entry->response, entry->len);
+    return entry->len;
+}
+
+void dedup_store(const struct client_address *client, uint64_t fingerprint, uint64_t now_ns,
+                 const char *response, int len)
+{
+    if (len <= 0 || len > DEDUP_MAX_RESPONSE)
+        return;
+
+    if (table == NULL)
+    {
+        if (table_failed)
+            return;
+        table = calloc(DEDUP_SLOTS, sizeof(struct dedup_entry));
+        if (table == NULL)
+        {
+            table_failed = 1;
+            return;
+        }
+    }
+
+    struct dedup_entry *entry = slot_of(fingerprint);
+    entry->fingerprint = fingerprint;
+    entry->expires_ns = now_ns + window_ns;
+    entry->client = *client;
+    entry->len = (uint8_t)len;
+    memcpy(entry->response, response, (size_t)len);
+}
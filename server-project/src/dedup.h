@@ -0,0 +1,46 @@
+/*
+ * dedup.h
+ *
+ * Replay of retransmitted requests (-D option).
+ * A request carrying a request ID that arrives again from the same address
+ * within the window gets the very bytes of the first response, without
+ * being validated, generated or logged again: a retry costs a table lookup
+ * and sees the same value as the original. Every thread serving a socket
+ * has its own direct-mapped table, so no lock is taken; with -w the kernel
+ * steers all datagrams of a client to the same worker, hence to one table.
+ */
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stdint.h>
+#include "address.h"
+#include "protocol.h"
+
+#define DEDUP_SLOTS 4096              // entries per thread (power of two)
+#define DEDUP_MAX_WINDOW_MS 60000     // upper bound for -D
+#define DEDUP_MAX_RESPONSE 16         // longest response kept: legacy or compact with ID
+
+_Static_assert(RESPONSE_WITH_ID_SIZE <= DEDUP_MAX_RESPONSE, "legacy response with ID fits");
+_Static_assert(COMPACT_MAX_RESPONSE <= DEDUP_MAX_RESPONSE, "compact response with ID fits");
+
+// Keeps responses for window_ms milliseconds. 0 disables the tables.
+void dedup_init(int window_ms);
+
+// Whether dedup_init() enabled the tables
+int dedup_enabled(void);
+
+// Identifies a request datagram (len bytes) from client
+uint64_t dedup_fingerprint(const struct client_address *client, const char *request, int len);
+
+// Copies the response kept for the request into response and returns its
+// length; 0 if there is none, or it is older than the window
+int dedup_lookup(const struct client_address *client, uint64_t fingerprint, uint64_t now_ns,
+                 char *response);
+
+// Keeps the response (len bytes) sent to the request, replacing whatever
+// occupied its slot; longer responses are not kept
+void dedup_store(const struct client_address *client, uint64_t fingerprint, uint64_t now_ns,
+                 const char *response, int len);
+
+#endif /* DEDUP_H_ */
@@ -0,0 +1,238 @@
+/*
+ * dns_cache.c
+ *
+ * Reverse-DNS cache with TTL and negative caching.
+ *
+ * The cache is a direct-mapped table indexed by a hash of the client address,
+ * protected by striped mutexes so concurrent workers rarely meet on the same
+ * lock. A miss marks the entry as pending and pushes the address on a bounded
+ * queue served by the resolver threads, which run the blocking getnameinfo()
+ * and store the result; the request path never waits for DNS.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "dns_cache.h"
+
+#define DNS_CACHE_STRIPES 64
+
+enum dns_entry_state {
+    DNS_EMPTY = 0,
+    DNS_PENDING,    // queued for a resolver, logged as IP meanwhile
+    DNS_RESOLVED,   // name available
+    DNS_NEGATIVE    // lookup failed, logged as IP until expiry
+};
+
+struct dns_entry {
+    struct in6_addr addr;
+    int state;
+    time_t expires;
+    char name[DNS_NAME_SIZE];
+};
+
+static struct dns_entry cache[DNS_CACHE_SIZE];
+static pthread_mutex_t stripes[DNS_CACHE_STRIPES];
+
+static struct in6_addr queue[DNS_QUEUE_SIZE];
+static unsigned int queue_head;
+static unsigned int queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static int enabled;
+
+static atomic_uint_fast64_t stat_hits;
+static atomic_uint_fast64_t stat_misses;
+static atomic_uint_fast64_t stat_resolved;
+static atomic_uint_fast64_t stat_failed;
+static atomic_uint_fast64_t stat_dropped;
+
+static unsigned int slot_of(const struct in6_addr *addr)
+{
+    // Fold the 16 bytes, then Fibonacci hashing: consecutive client
+    // addresses spread over the table
+    uint32_t words[4];
+    memcpy(words, addr->s6_addr, sizeof(words));
+    uint32_t folded = words[0] ^ words[1] ^ words[2] ^ words[3];
+    return ((uint32_t)(folded * 2654435761u) >> 20) & (DNS_CACHE_SIZE - 1);
+}
+
+static int same_address(const struct in6_addr *a, const struct in6_addr *b)
+{
+    return memcmp(a->s6_addr, b->s6_addr, sizeof(a->s6_addr)) == 0;
+}
+
+static pthread_mutex_t *stripe_of(unsigned int slot)
+{
+    return &stripes[slot % DNS_CACHE_STRIPES];
+}
+
+static void store_result(const struct in6_addr *addr, const char *name)
+{
+    unsigned int slot = slot_of(addr);
+    struct dns_entry *e = &cache[slot];
+
+    pthread_mutex_lock(stripe_of(slot));
+    // The slot may have been taken by another address meanwhile
+    if (same_address(&e->addr, addr) && e->state == DNS_PENDING)
+    {
+        if (name != NULL)
+        {
+            strncpy(e->name, name, DNS_NAME_SIZE - 1);
+            e->name[DNS_NAME_SIZE - 1] = '\0';
+            e->state = DNS_RESOLVED;
+            e->expires = time(NULL) + DNS_CACHE_TTL;
+        }
+        else
+        {
+            e->state = DNS_NEGATIVE;
+            e->expires = time(NULL) + DNS_CACHE_NEGATIVE_TTL;
+        }
+    }
+    pthread_mutex_unlock(stripe_of(slot));
+}
+
+static void *resolver_main(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_len == 0)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        struct in6_addr addr = queue[queue_head];
+        queue_head = (queue_head + 1) % DNS_QUEUE_SIZE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        struct sockaddr_storage sa;
+        socklen_t sa_len = address_to_sockaddr(&addr, &sa);
+
+        char name[DNS_NAME_SIZE];
+        if (getnameinfo((struct sockaddr *)&sa, sa_len, name, sizeof(name),
+                        NULL, 0, NI_NAMEREQD) == 0)
+        {
+            atomic_fetch_add_explicit(&stat_resolved, 1, memory_order_relaxed);
+            store_result(&addr, name);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&stat_failed, 1, memory_order_relaxed);
+            store_result(&addr, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static int enqueue(const struct in6_addr *addr)
+{
+    int queued = 0;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_len < DNS_QUEUE_SIZE)
+    {
+        queue[(queue_head + queue_len) % DNS_QUEUE_SIZE] = *addr;
+        queue_len++;
+        queued = 1;
+        pthread_cond_signal(&queue_ready);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return queued;
+}
+
+int dns_cache_init(int resolver_threads)
+{
+    if (resolver_threads > DNS_MAX_RESOLVERS)
+        resolver_threads = DNS_MAX_RESOLVERS;
+
+    for (int i = 0; i < DNS_CACHE_STRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+
+    int started = 0;
+    for (int i = 0; i < resolver_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_main, NULL) != 0)
+        {
+            printf("Errore nella creazione del resolver DNS %d\n", i);
+            break;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+
+    enabled = started > 0;
+    return (started == resolver_threads) ? 0 : -1;
+}
+
+int dns_cache_lookup(const struct in6_addr *addr, char *hostname, size_t hostname_len)
+{
+    if (!enabled)
+    {
+        atomic_fetch_add_explicit(&stat_misses, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    unsigned int slot = slot_of(addr);
+    struct dns_entry *e = &cache[slot];
+    time_t now = time(NULL);
+    int found = 0;
+    int queue_lookup = 0;
+
+    pthread_mutex_lock(stripe_of(slot));
+    if (e->state != DNS_EMPTY && same_address(&e->addr, addr) && now < e->expires)
+    {
+        if (e->state == DNS_RESOLVED)
+        {
+            strncpy(hostname, e->name, hostname_len - 1);
+            hostname[hostname_len - 1] = '\0';
+            found = 1;
+        }
+        if (e->state != DNS_PENDING)
+            atomic_fetch_add_explicit(&stat_hits, 1, memory_order_relaxed);
+        else
+            atomic_fetch_add_explicit(&stat_misses, 1, memory_order_relaxed);
+    }
+    else
+    {
+        // Claim the slot; a pending entry expires like a negative one, so a
+        // lookup lost to a full queue is retried later
+        e->addr = *addr;
+        e->state = DNS_PENDING;
+        e->expires = now + DNS_CACHE_NEGATIVE_TTL;
+        queue_lookup = 1;
+        atomic_fetch_add_explicit(&stat_misses, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(stripe_of(slot));
+
+    if (queue_lookup && !enqueue(addr))
+        atomic_fetch_add_explicit(&stat_dropped, 1, memory_order_relaxed);
+
+    return found;
+}
+
+void dns_cache_get_stats(struct dns_cache_stats *stats)
+{
+    stats->hits = atomic_load_explicit(&stat_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&stat_misses, memory_order_relaxed);
+    stats->resolved = atomic_load_explicit(&stat_resolved, memory_order_relaxed);
+    stats->failed = atomic_load_explicit(&stat_failed, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&stat_dropped, memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+/*
+ * dns_cache.h
+ *
+ * Asynchronous reverse-DNS cache used for request logging.
+ * Lookups never block: a miss queues the address for a pool of resolver
+ * threads and the caller logs the plain IP until the name is known.
+ */
+
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "address.h"
+
+#define DNS_CACHE_SIZE 4096          // cache entries (power of two)
+#define DNS_NAME_SIZE 256            // longest cached host name, including '\0'
+#define DNS_CACHE_TTL 300            // seconds a resolved name is kept
+#define DNS_CACHE_NEGATIVE_TTL 60    // seconds a failed lookup is kept
+#define DNS_QUEUE_SIZE 1024          // pending lookups waiting for a resolver
+#define DNS_DEFAULT_RESOLVERS 2      // default size of the resolver pool
+#define DNS_MAX_RESOLVERS 64
+
+struct dns_cache_stats {
+    uint64_t hits;       // answered from the cache (name or cached failure)
+    uint64_t misses;     // not cached, expired or still being resolved
+    uint64_t resolved;   // lookups completed by the resolver pool
+    uint64_t failed;     // lookups that returned no name
+    uint64_t dropped;    // lookups not queued because the queue was full
+};
+
+// Starts the resolver pool. With resolver_threads == 0 reverse lookups are
+// disabled and dns_cache_lookup() always reports a miss.
+int dns_cache_init(int resolver_threads);
+
+// Copies the cached name of addr into hostname and returns 1 when known;
+// returns 0 otherwise (hostname untouched).
+int dns_cache_lookup(const struct in6_addr *addr, char *hostname, size_t hostname_len);
+
+void dns_cache_get_stats(struct dns_cache_stats *stats);
+
+#endif /* DNS_CACHE_H_ */
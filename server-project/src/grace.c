@@ -0,0 +1,101 @@
+/*
+ * grace.c
+ *
+ * Epoch-based grace periods.
+ *
+ * Every reading thread owns a slot, allocated on first use and linked into
+ * a global list with a CAS like the metrics shards. Entering a section
+ * copies the global epoch into the slot, leaving it stores 0. The writer,
+ * having swapped the pointer, advances the epoch and waits for every slot
+ * to be either 0 or at the new epoch: a reader that entered later loaded
+ * the new epoch after the swap, so it can only see the new pointer.
+ *
+ * The seq_cst fence between the slot store and the reader's pointer load,
+ * paired with the writer's seq_cst swap and increment, guarantees that the
+ * writer sees the slot of any reader that got the old pointer.
+ */
+
+#if defined WIN32
+#include <windows.h>
+#endif
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "grace.h"
+
+struct grace_reader {
+    _Atomic uint64_t epoch;   // epoch at entry, 0 outside any section
+    struct grace_reader *next;
+};
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(struct grace_reader *) readers;
+static atomic_int untracked;   // readers that could not get a slot
+static _Thread_local struct grace_reader *my_reader;
+static _Thread_local int depth;
+
+static void sleep_ms(int ms)
+{
+#if defined WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = {0, (long)ms * 1000000};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static struct grace_reader *register_reader(void)
+{
+    struct grace_reader *reader = calloc(1, sizeof(struct grace_reader));
+    if (reader == NULL)
+    {
+        atomic_store(&untracked, 1);
+        return NULL;
+    }
+
+    struct grace_reader *first = atomic_load(&readers);
+    do
+    {
+        reader->next = first;
+    } while (!atomic_compare_exchange_weak(&readers, &first, reader));
+
+    return reader;
+}
+
+void grace_enter(void)
+{
+    if (depth++ > 0)
+        return;
+    if (my_reader == NULL && (my_reader = register_reader()) == NULL)
+        return;
+
+    atomic_store_explicit(&my_reader->epoch,
+                          atomic_load_explicit(&global_epoch, memory_order_acquire),
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void grace_exit(void)
+{
+    if (--depth > 0 || my_reader == NULL)
+        return;
+    atomic_store_explicit(&my_reader->epoch, 0, memory_order_release);
+}
+
+int grace_wait(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t target = atomic_fetch_add(&global_epoch, 1) + 1;
+
+    for (struct grace_reader *r = atomic_load(&readers); r != NULL; r = r->next)
+    {
+        uint64_t epoch;
+        while ((epoch = atomic_load_explicit(&r->epoch, memory_order_acquire)) != 0 &&
+               epoch < target)
+            sleep_ms(1);
+    }
+
+    return atomic_load(&untracked) ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * grace.h
+ *
+ * Grace periods for data swapped behind an atomic pointer (the city set,
+ * the observation tables). Readers wrap their use of the pointer in
+ * grace_enter() / grace_exit(); the writer swaps the pointer in and calls
+ * grace_wait() before freeing the old data, which returns once every
+ * reader that could still hold it has left. Readers never block.
+ */
+
+#ifndef GRACE_H_
+#define GRACE_H_
+
+// Starts a read-side section of the calling thread; sections nest. Call it
+// before loading the pointer.
+void grace_enter(void);
+
+// Ends the section started by the matching grace_enter()
+void grace_exit(void);
+
+// Waits until every section running when it was called has ended. Returns
+// -1 if a reader could not be tracked (out of memory): the old data must
+// then be leaked rather than freed.
+int grace_wait(void);
+
+#endif /* GRACE_H_ */
@@ -0,0 +1,289 @@
+/*
+ * handoff.c
+ *
+ * Socket handoff between the running server and its successor.
+ *
+ * The exchange runs on a stream Unix socket. The new server sends one
+ * request byte; the old one answers with one-byte messages, each holding
+ * the number of UDP sockets attached to it as SCM_RIGHTS, and a last one
+ * holding 0. The new server confirms with one more byte, and only then
+ * does the old one stop. Until it has drained, both processes read from
+ * the same sockets, and each datagram reaches exactly one of them.
+ */
+
+#if defined WIN32
+
+#include <stdio.h>
+#include "handoff.h"
+
+int handoff_receive(const char *path, int *socks, int max)
+{
+    (void)path;
+    (void)socks;
+    (void)max;
+    return 0;
+}
+
+int handoff_listen(const char *path, const int *socks, int count)
+{
+    (void)path;
+    (void)socks;
+    (void)count;
+    printf("Avviso: passaggio dei socket (-x) non disponibile su questa piattaforma\n");
+    return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "handoff.h"
+#include "server.h"
+#include "signals.h"
+
+#if !defined MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HANDOFF_REQUEST 'H'
+#define HANDOFF_CONFIRM 'K'
+#define HANDOFF_TIMEOUT_S 5   // longest wait for the other process
+
+// Sockets offered by this server, and the listening Unix socket
+static int handed_socks[MAX_WORKERS];
+static int handed_count;
+static int listen_sock = -1;
+
+static int unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        printf("Errore: percorso %s troppo lungo per un socket Unix\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void set_timeout(int sock)
+{
+    struct timeval timeout = {HANDOFF_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Sends one message with count sockets attached (none when count is 0)
+static int send_chunk(int conn, const int *socks, int count)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_CHUNK)];
+        struct cmsghdr align;
+    } control;
+    char byte = (char)count;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (count > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), socks, sizeof(int) * count);
+    }
+
+    return (sendmsg(conn, &msg, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+// Receives one message into socks (room sockets at most, the others are
+// closed). Returns the number stored, 0 for the last message, -1 on error.
+static int receive_chunk(int conn, int *socks, int room)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_CHUNK)];
+        struct cmsghdr align;
+    } control;
+    char byte;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(conn, &msg, 0) != 1)
+        return -1;
+
+    int stored = 0;
+    int attached = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < n; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            attached++;
+            if (stored < room)
+                socks[stored++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    if (attached != (unsigned char)byte || (msg.msg_flags & MSG_CTRUNC))
+    {
+        for (int i = 0; i < stored; i++)
+            close(socks[i]);
+        return -1;
+    }
+    return stored;
+}
+
+int handoff_receive(const char *path, int *socks, int max)
+{
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr) < 0)
+        return 0;
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0)
+        return 0;
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        // No server running there: a normal start
+        close(conn);
+        return 0;
+    }
+    set_timeout(conn);
+
+    char request = HANDOFF_REQUEST;
+    int count = 0;
+    int n = -1;
+    if (send(conn, &request, 1, MSG_NOSIGNAL) == 1)
+    {
+        while ((n = receive_chunk(conn, socks + count, max - count)) > 0)
+            count += n;
+    }
+
+    char confirm = HANDOFF_CONFIRM;
+    if (n < 0 || count == 0 || send(conn, &confirm, 1, MSG_NOSIGNAL) != 1)
+    {
+        printf("Errore nel passaggio dei socket da %s\n", path);
+        for (int i = 0; i < count; i++)
+            close(socks[i]);
+        count = 0;
+    }
+
+    close(conn);
+    return count;
+}
+
+// Hands the sockets over on conn. Returns 0 once the new server has them.
+static int send_sockets(int conn)
+{
+    char request;
+    if (recv(conn, &request, 1, 0) != 1 || request != HANDOFF_REQUEST)
+        return -1;
+
+    for (int sent = 0; sent < handed_count; sent += HANDOFF_CHUNK)
+    {
+        int n = (handed_count - sent < HANDOFF_CHUNK) ? handed_count - sent : HANDOFF_CHUNK;
+        if (send_chunk(conn, handed_socks + sent, n) < 0)
+            return -1;
+    }
+    if (send_chunk(conn, NULL, 0) < 0)
+        return -1;
+
+    char confirm;
+    return (recv(conn, &confirm, 1, 0) == 1 && confirm == HANDOFF_CONFIRM) ? 0 : -1;
+}
+
+static void *listener_main(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        int conn = accept(listen_sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Errore nell'attesa di un nuovo server\n");
+            break;
+        }
+        set_timeout(conn);
+
+        int handed = (send_sockets(conn) == 0);
+        close(conn);
+        if (handed)
+        {
+            printf("Socket passati al nuovo server, arresto in corso...\n");
+            server_stop();
+            break;
+        }
+    }
+
+    // The path now belongs to the new server: it is not removed
+    close(listen_sock);
+    return NULL;
+}
+
+int handoff_listen(const char *path, const int *socks, int count)
+{
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr) < 0)
+        return -1;
+    if (count > MAX_WORKERS)
+        count = MAX_WORKERS;
+    memcpy(handed_socks, socks, sizeof(int) * count);
+    handed_count = count;
+
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock < 0)
+    {
+        printf("Errore nella creazione del socket di passaggio\n");
+        return -1;
+    }
+
+    // Left behind by a server that has exited, or already handed over
+    unlink(path);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(listen_sock, 1) < 0)
+    {
+        printf("Errore nel bind del socket di passaggio %s\n", path);
+        close(listen_sock);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, listener_main, NULL) != 0)
+    {
+        printf("Errore nella creazione del thread di passaggio\n");
+        close(listen_sock);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
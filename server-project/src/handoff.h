@@ -0,0 +1,26 @@
+/*
+ * handoff.h
+ *
+ * Zero-downtime restart (-x option, POSIX only).
+ * A server started with -x listens on a Unix socket at that path. A new
+ * server started with the same -x asks it for its UDP sockets, receives
+ * them with SCM_RIGHTS and serves them right away, while the old one
+ * drains and exits. The UDP sockets are never closed in between, so the
+ * datagrams queued in them are answered by one process or the other.
+ */
+
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#define HANDOFF_CHUNK 64   // sockets per message (Linux takes 253 at most)
+
+// Asks the server listening on path for its UDP sockets and stores up to
+// max of them in socks. Returns how many were received, 0 if no server is
+// listening on path (or on error, printed).
+int handoff_receive(const char *path, int *socks, int max);
+
+// Listens on path and hands socks over to the first new server asking for
+// them, then stops this one (see signals.h). Returns -1 on error (printed).
+int handoff_listen(const char *path, const int *socks, int count);
+
+#endif /* HANDOFF_H_ */
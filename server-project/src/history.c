@@ -0,0 +1,204 @@
+/*
+ * history.c
+ *
+ * Columnar ring buffers of sampled values.
+ *
+ * All series are sampled at the same instants, so one timestamp column is
+ * shared and each (city, type) series is a column of floats indexed by
+ * city_id * HISTORY_TYPES + type: a range query reads two contiguous runs
+ * at most. Sample n lives in slot n % capacity.
+ *
+ * The sampling thread is the only writer: it fills slot n, overwriting
+ * sample n - capacity, and then publishes the sample count. A reader copies
+ * what it wants and checks the count again, as with a seqlock; if the
+ * writer has meanwhile reached the oldest sample it copied, it reads again.
+ */
+
+#if defined WIN32
+#include <windows.h>
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "history.h"
+
+struct history {
+    int series;                // cities * HISTORY_TYPES
+    uint64_t capacity;         // samples kept per series
+    int step;                  // seconds between samples
+    history_value_fn sample;
+    uint32_t *timestamps;      // capacity, shared by all series
+    float *values;             // series columns of capacity samples
+    _Atomic uint64_t written;  // samples taken since start
+};
+
+static const char series_types[HISTORY_TYPES] = {'t', 'h', 'w', 'p'};
+
+static int type_slot(char type)
+{
+    for (int i = 0; i < HISTORY_TYPES; i++)
+    {
+        if (series_types[i] == type)
+            return i;
+    }
+    return -1;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static void sleep_ms(uint64_t ms)
+{
+#if defined WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void take_sample(struct history *history, uint32_t timestamp)
+{
+    uint64_t n = atomic_load_explicit(&history->written, memory_order_relaxed);
+    uint64_t slot = n % history->capacity;
+
+    history->timestamps[slot] = timestamp;
+    for (int s = 0; s < history->series; s++)
+    {
+        history->values[(uint64_t)s * history->capacity + slot] =
+            history->sample(series_types[s % HISTORY_TYPES], s / HISTORY_TYPES);
+    }
+
+    atomic_store_explicit(&history->written, n + 1, memory_order_release);
+}
+
+static void *sampler_main(void *arg)
+{
+    struct history *history = arg;
+    uint64_t step_ms = (uint64_t)history->step * 1000u;
+    uint64_t last = now_ms() / step_ms;
+
+    while (1)
+    {
+        // Wake up at the next multiple of the step; timestamps stay aligned
+        // to it even if the thread runs late
+        uint64_t now = now_ms();
+        sleep_ms((now / step_ms + 1) * step_ms - now);
+
+        uint64_t current = now_ms() / step_ms;
+        if (current == last)
+            continue;
+        take_sample(history, (uint32_t)(current * history->step));
+        last = current;
+    }
+
+    return NULL;
+}
+
+struct history *history_create(int cities, int hours, int step_seconds, history_value_fn sample)
+{
+    if (cities <= 0 || hours <= 0 || step_seconds <= 0)
+        return NULL;
+
+    struct history *history = calloc(1, sizeof(struct history));
+    if (history == NULL)
+        return NULL;
+
+    history->series = cities * HISTORY_TYPES;
+    history->capacity = (uint64_t)hours * 3600u / (uint64_t)step_seconds;
+    if (history->capacity == 0)
+        history->capacity = 1;
+    history->step = step_seconds;
+    history->sample = sample;
+    history->timestamps = calloc(history->capacity, sizeof(uint32_t));
+    history->values = calloc((size_t)history->series * history->capacity, sizeof(float));
+    if (history->timestamps == NULL || history->values == NULL)
+    {
+        free(history->timestamps);
+        free(history->values);
+        free(history);
+        return NULL;
+    }
+    atomic_init(&history->written, 0);
+
+    // A first sample right away, so a query never finds the history empty
+    uint64_t step_ms = (uint64_t)step_seconds * 1000u;
+    take_sample(history, (uint32_t)(now_ms() / step_ms * (uint64_t)step_seconds));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sampler_main, history) != 0)
+    {
+        printf("Avviso: campionamento dello storico non disponibile\n");
+    }
+    else
+    {
+        pthread_detach(thread);
+    }
+
+    return history;
+}
+
+int history_range(struct history *history, int city_id, char type, uint32_t from, uint32_t to,
+                  uint32_t *timestamps, float *values, int max_samples, uint32_t *next)
+{
+    // Cities added by a catalog reload have no series
+    if (city_id < 0 || city_id >= history->series / HISTORY_TYPES)
+    {
+        *next = 0;
+        return 0;
+    }
+
+    uint64_t capacity = history->capacity;
+    const float *column = history->values +
+                          (uint64_t)(city_id * HISTORY_TYPES + type_slot(type)) * capacity;
+
+    while (1)
+    {
+        uint64_t written = atomic_load_explicit(&history->written, memory_order_acquire);
+        uint64_t oldest = (written > capacity) ? written - capacity : 0;
+
+        // First sample at or after from; timestamps grow with n
+        uint64_t lo = oldest;
+        uint64_t hi = written;
+        while (lo < hi)
+        {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (history->timestamps[mid % capacity] < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        int count = 0;
+        uint64_t n = lo;
+        *next = 0;
+        for (; n < written; n++)
+        {
+            uint32_t timestamp = history->timestamps[n % capacity];
+            if (timestamp > to)
+                break;
+            if (count == max_samples)
+            {
+                *next = timestamp;
+                break;
+            }
+            timestamps[count] = timestamp;
+            values[count] = column[n % capacity];
+            count++;
+        }
+
+        // The writer is filling sample "written" now, over sample
+        // written - capacity: anything older than that is intact
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t now_written = atomic_load_explicit(&history->written, memory_order_relaxed);
+        if (count == 0 || now_written + 1 <= capacity || lo >= now_written + 1 - capacity)
+            return count;
+    }
+}
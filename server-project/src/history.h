@@ -0,0 +1,35 @@
+/*
+ * history.h
+ *
+ * Recent values of every (city, type) pair, for range queries.
+ * A background thread samples all pairs at a fixed step and appends the
+ * values to ring buffers holding the last few hours; readers copy a time
+ * range without any lock.
+ */
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+
+#define HISTORY_DEFAULT_STEP 1   // seconds between samples (-S)
+#define HISTORY_TYPES 4          // t, h, w, p
+
+struct history;
+
+// Value of a (city, type) pair at sampling time
+typedef float (*history_value_fn)(char type, int city_id);
+
+// Keeps hours hours of samples of city IDs 0 .. cities - 1, one every
+// step_seconds, and starts the sampling thread. Returns NULL on failure.
+struct history *history_create(int cities, int hours, int step_seconds, history_value_fn sample);
+
+// Copies the samples of a supported city and a valid type whose timestamps
+// (Unix time in seconds) are in [from, to], oldest first, up to max_samples
+// of them; none for a city ID beyond those given to history_create().
+// Returns the number copied; *next receives the timestamp of the first
+// sample in the range that did not fit, 0 if none was left out.
+int history_range(struct history *history, int city_id, char type, uint32_t from, uint32_t to,
+                  uint32_t *timestamps, float *values, int max_samples, uint32_t *next);
+
+#endif /* HISTORY_H_ */
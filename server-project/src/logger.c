@@ -0,0 +1,210 @@
+/*
+ * logger.c
+ *
+ * Asynchronous request logger.
+ *
+ * Each thread that logs gets its own single-producer/single-consumer ring,
+ * allocated on first use and linked into a global list with a CAS. The
+ * producer only writes records and publishes its tail; the writer thread is
+ * the only consumer of every ring. Host names are looked up in the reverse
+ * DNS cache at format time, so they are resolved off the request path too.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logger.h"
+#include "dns_cache.h"
+
+#define CACHE_LINE 64
+
+struct log_ring {
+    _Alignas(CACHE_LINE) atomic_size_t head;    // next record to consume
+    _Alignas(CACHE_LINE) atomic_size_t tail;    // next free slot
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+static _Atomic(struct log_ring *) rings;
+static _Thread_local struct log_ring *my_ring;
+
+static enum log_policy log_policy;
+static atomic_uint_fast64_t dropped;
+static atomic_uint idle_passes;   // writer passes that found every ring empty
+
+static void idle_wait(void)
+{
+#if defined WIN32
+    Sleep(1);
+#else
+    struct timespec ts = {0, 1000000}; // 1 ms
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static struct log_ring *register_ring(void)
+{
+#if defined WIN32
+    struct log_ring *ring = _aligned_malloc(sizeof(struct log_ring), CACHE_LINE);
+#else
+    struct log_ring *ring = aligned_alloc(CACHE_LINE, sizeof(struct log_ring));
+#endif
+    if (ring == NULL)
+        return NULL;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    struct log_ring *first = atomic_load(&rings);
+    do
+    {
+        ring->next = first;
+    } while (!atomic_compare_exchange_weak(&rings, &first, ring));
+
+    return ring;
+}
+
+static size_t format_record(const struct log_record *rec, char *out, size_t out_len)
+{
+    char client_ip[ADDRESS_STRLEN];
+    char client_hostname[DNS_NAME_SIZE];
+    address_to_string(&rec->client.ip, client_ip, sizeof(client_ip));
+
+    if (!dns_cache_lookup(&rec->client.ip, client_hostname, sizeof(client_hostname)))
+    {
+        strncpy(client_hostname, client_ip, sizeof(client_hostname) - 1);
+        client_hostname[sizeof(client_hostname) - 1] = '\0';
+    }
+
+    int len = snprintf(out, out_len, "Richiesta ricevuta da %s (ip %s): type='%c', city='%s'\n",
+                       client_hostname, client_ip, rec->type, rec->city);
+    if (len < 0)
+        return 0;
+    return ((size_t)len < out_len) ? (size_t)len : out_len - 1;
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    static char out[LOG_WRITE_BUFFER];
+    size_t used = 0;
+
+    while (1)
+    {
+        int drained = 0;
+
+        for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+        {
+            size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+            for (; head != tail; head++)
+            {
+                // Longest line: prefix + 255-char host + IP + 63-char city
+                if (LOG_WRITE_BUFFER - used < 512)
+                {
+                    fwrite(out, 1, used, stdout);
+                    used = 0;
+                }
+                used += format_record(&ring->records[head & (LOG_RING_SIZE - 1)],
+                                      out + used, LOG_WRITE_BUFFER - used);
+                drained++;
+            }
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
+
+        if (drained == 0)
+        {
+            if (used > 0)
+            {
+                fwrite(out, 1, used, stdout);
+                fflush(stdout);
+                used = 0;
+            }
+            atomic_fetch_add_explicit(&idle_passes, 1, memory_order_release);
+            idle_wait();
+        }
+    }
+
+    return NULL;
+}
+
+int logger_init(enum log_policy policy)
+{
+    log_policy = policy;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_main, NULL) != 0)
+    {
+        printf("Errore nella creazione del thread di log\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void log_request(const struct client_address *client, char type, const char *city)
+{
+    if (my_ring == NULL)
+    {
+        my_ring = register_ring();
+        if (my_ring == NULL)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    size_t tail = atomic_load_explicit(&my_ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&my_ring->head, memory_order_acquire) >= LOG_RING_SIZE)
+    {
+        if (log_policy == LOG_DROP)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        idle_wait();
+    }
+
+    struct log_record *rec = &my_ring->records[tail & (LOG_RING_SIZE - 1)];
+    rec->client = *client;
+    rec->type = type;
+    // Only the name: byte CITY_SIZE - 1 always ends it, as in deserialize_request()
+    size_t city_len = strnlen(city, CITY_SIZE - 1);
+    memcpy(rec->city, city, city_len);
+    rec->city[city_len] = '\0';
+
+    atomic_store_explicit(&my_ring->tail, tail + 1, memory_order_release);
+}
+
+uint64_t logger_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void logger_flush(void)
+{
+    // The first idle pass may have started before the last records were
+    // queued; the second one surely saw them
+    unsigned int target = atomic_load_explicit(&idle_passes, memory_order_acquire) + 2;
+    for (int waited = 0; waited < LOG_FLUSH_MS; waited++)
+    {
+        if ((int)(atomic_load_explicit(&idle_passes, memory_order_acquire) - target) >= 0)
+            return;
+        idle_wait();
+    }
+}
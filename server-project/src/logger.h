@@ -0,0 +1,46 @@
+/*
+ * logger.h
+ *
+ * Asynchronous request logger.
+ * The request path pushes fixed-size binary records into a lock-free ring
+ * owned by the calling thread; a background thread formats them into the
+ * usual "Richiesta ricevuta da ..." lines and writes them in large batches.
+ */
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdint.h>
+#include "protocol.h"
+#include "address.h"
+
+#define LOG_RING_SIZE 4096          // records per thread ring (power of two)
+#define LOG_WRITE_BUFFER 65536      // bytes formatted before each fwrite
+#define LOG_FLUSH_MS 1000           // longest wait of logger_flush()
+
+// What to do when the calling thread's ring is full
+enum log_policy {
+    LOG_DROP = 0,   // discard the record and count it
+    LOG_BLOCK       // wait for the writer thread to make room
+};
+
+struct log_record {
+    struct client_address client;
+    char type;
+    char city[CITY_SIZE];
+};
+
+// Starts the writer thread
+int logger_init(enum log_policy policy);
+
+// Queues one request line; never formats or writes on the caller's thread
+void log_request(const struct client_address *client, char type, const char *city);
+
+// Waits until the records queued so far are written out, LOG_FLUSH_MS at
+// most; call it once the threads logging have stopped
+void logger_flush(void);
+
+// Records lost because a ring was full (LOG_DROP policy)
+uint64_t logger_dropped(void);
+
+#endif /* LOGGER_H_ */
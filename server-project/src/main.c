@@ -21,11 +21,27 @@
 #define closesocket close
 #endif
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <ctype.h>
 #include "protocol.h"
+#include "server.h"
+#include "dns_cache.h"
+#include "logger.h"
+#include "city_catalog.h"
+#include "validate.h"
+#include "weather_provider.h"
+#include "response_cache.h"
+#include "history.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "subscriptions.h"
+#include "address.h"
+#include "signals.h"
+#include "handoff.h"
+#include "dedup.h"
+#include "grace.h"
 
 #define NO_ERROR 0
 #define NUM_CITIES 10
@@ -34,6 +50,31 @@ static const char *supported_cities[NUM_CITIES] = {
     "bari", "roma", "milano", "napoli", "torino",
     "palermo", "genova", "bologna", "firenze", "venezia"};
 
+// Supported cities and what is sized after them, swapped as a whole when
+// the catalog is reloaded (SIGHUP)
+struct city_set {
+    // supported_cities, or the catalog file given with -c
+    struct city_catalog *catalog;
+    // Values shared within a time bucket (-C), NULL when disabled
+    struct response_cache *response_cache;
+    // Source of weather values: random, or observations (-o) indexed by the
+    // IDs of this catalog and backed by random
+    struct weather_provider *provider;
+};
+
+static _Atomic(struct city_set *) current_cities;
+
+// Set of the request (or sample) being handled by the calling thread: one
+// load per request, so a reload never splits a request across two catalogs.
+// It is loaded and used within a grace section (see grace.h), so a reload
+// frees the old set only once no thread is using it.
+static _Thread_local struct city_set *cities;
+
+// Recorded values for range queries (-H), NULL when disabled
+static struct history *history;
+
+static struct server_config config;
+
 void clearwinsock()
 {
 #if defined WIN32
@@ -41,208 +82,825 @@ void clearwinsock()
 #endif
 }
 
-void to_lowercase(char *str)
+// Returns the dense ID of a supported city (len bytes), -1 if unknown
+int find_city_id(const char *city, size_t len)
+{
+    return catalog_find(cities->catalog, city, len);
+}
+
+int is_city_supported(const char *city)
+{
+    return find_city_id(city, strnlen(city, CITY_SIZE)) >= 0;
+}
+
+// Weather value for a city from the configured providers, using the
+// city's climate ranges when the catalog has them
+float get_city_value(char type, int city_id)
+{
+    struct city_climate climate;
+    int has_climate = catalog_climate(cities->catalog, city_id, &climate);
+    return provider_value(cities->provider, city_id, type, has_climate ? &climate : NULL);
+}
+
+// Value of a city of the current set: the one clients are being served,
+// when the response cache fixes it for the current bucket
+static float current_value(char type, int city_id)
 {
-    for (int i = 0; str[i]; i++)
+    if (cities->response_cache != NULL)
+        return response_cache_get(cities->response_cache, city_id, type, NULL);
+    return get_city_value(type, city_id);
+}
+
+// Value recorded in the history. The history keeps the cities it was
+// created with; those dropped by a reload are recorded as 0.
+static float history_sample(char type, int city_id)
+{
+    grace_enter();
+    cities = atomic_load_explicit(&current_cities, memory_order_acquire);
+    float value = 0.0f;
+    if (city_id < catalog_city_count(cities->catalog))
+        value = current_value(type, city_id);
+    grace_exit();
+    return value;
+}
+
+// Value pushed to subscribers, with a status
+static unsigned int subscription_value(char type, int city_id, float *value)
+{
+    grace_enter();
+    cities = atomic_load_explicit(&current_cities, memory_order_acquire);
+    unsigned int status = STATUS_CITY_NOT_FOUND;
+    if (city_id < catalog_city_count(cities->catalog))
     {
-        str[i] = tolower((unsigned char)str[i]);
+        *value = current_value(type, city_id);
+        status = STATUS_SUCCESS;
     }
+    grace_exit();
+    return status;
 }
 
-void capitalize_city(char *city)
+// Validates the type and city of a query and counts it in the metrics.
+// city is a CITY_SIZE null-padded field; it is ignored when city_id >= 0
+// (query by ID). Returns the status and stores the city ID in *found.
+unsigned int check_query(char type, const char *city, int city_id, int *found)
 {
-    int capitalize_next = 1;
-    for (int i = 0; city[i]; i++)
+    unsigned int status = STATUS_SUCCESS;
+
+    if (!is_valid_request_type(type))
     {
-        if (city[i] == ' ')
-        {
-            capitalize_next = 1;
-        }
-        else if (capitalize_next)
-        {
-            city[i] = toupper((unsigned char)city[i]);
-            capitalize_next = 0;
-        }
+        status = STATUS_INVALID_REQUEST;
+    }
+    else if (city_id < 0)
+    {
+        // One pass over the city: terminator, length and invalid characters
+        int city_len = validate_city_field(city);
+        if (city_len < 0)
+            status = STATUS_INVALID_REQUEST;
         else
-        {
-            city[i] = tolower((unsigned char)city[i]);
-        }
+            city_id = find_city_id(city, (size_t)city_len);
+    }
+
+    if (status == STATUS_SUCCESS &&
+        (city_id < 0 || city_id >= catalog_city_count(cities->catalog)))
+        status = STATUS_CITY_NOT_FOUND;
+
+    metrics_query(type, status, (status == STATUS_SUCCESS) ? city_id : -1);
+    *found = city_id;
+    return status;
+}
+
+// Validates one query and fills in the response (see check_query()).
+// When serialized is not NULL the serialized response is written there too
+// and its length returned; a response cache hit is copied as is.
+int answer_query(char type, const char *city, int city_id, struct response *resp,
+                 char *serialized)
+{
+    resp->type = type;
+    resp->value = 0.0f;
+    resp->status = check_query(type, city, city_id, &city_id);
+
+    if (resp->status != STATUS_SUCCESS)
+        return serialized ? serialize_response(resp, serialized) : 0;
+
+    // Generate weather data
+    if (cities->response_cache != NULL)
+    {
+        resp->value = response_cache_get(cities->response_cache, city_id, type, serialized);
+        return serialized ? RESPONSE_BUFFER_SIZE : 0;
     }
+    resp->value = get_city_value(type, city_id);
+    return serialized ? serialize_response(resp, serialized) : 0;
 }
 
-int is_valid_request_type(char type)
+// Logs a query of a batch, history or compact request. Queries by ID are
+// logged with the city name, or "#<id>" if unknown; q->city is overwritten.
+static void log_query(const struct client_address *client, struct batch_query *q)
 {
-    return (type == REQ_TEMPERATURE || type == REQ_HUMIDITY ||
-            type == REQ_WIND || type == REQ_PRESSURE);
+    if (q->city_id >= 0 && q->city_id < catalog_city_count(cities->catalog))
+        catalog_city_name(cities->catalog, q->city_id, q->city, CITY_SIZE);
+    else if (q->city_id >= 0)
+        snprintf(q->city, CITY_SIZE, "#%d", q->city_id);
+    log_request(client, q->type, q->city);
 }
 
-int contains_invalid_chars(const char *str)
+// Answers a batch request with one batch response. A malformed batch gets
+// the legacy "invalid request" response, as an old server would send.
+int process_batch(const char *recv_buffer, int recv_len,
+                  const struct client_address *client, char *send_buffer)
 {
-    for (int i = 0; str[i]; i++)
+    static _Thread_local struct batch_request breq;
+    static _Thread_local struct batch_response bresp;
+
+    if (deserialize_batch_request(recv_buffer, recv_len, &breq) < 0)
     {
-        char c = str[i];
-        // Allow letters, digits, spaces, accented characters (negative values in signed char)
-        if (c == '\t')
-            return 1; // Tab not allowed
-        if (c == '@' || c == '#' || c == '$' || c == '%' || c == '^' ||
-            c == '&' || c == '*' || c == '(' || c == ')' || c == '!' ||
-            c == '~' || c == '`' || c == '+' || c == '=' || c == '[' ||
-            c == ']' || c == '{' || c == '}' || c == '|' || c == '\\' ||
-            c == '<' || c == '>' || c == '?' || c == '/' || c == ';' ||
-            c == ':' || c == '"')
-        {
-            return 1;
-        }
+        struct response resp;
+        resp.status = STATUS_INVALID_REQUEST;
+        resp.type = recv_buffer[0];
+        resp.value = 0.0f;
+        return serialize_response(&resp, send_buffer);
     }
-    return 0;
+
+    // Only as many results as fit in what the client can receive
+    unsigned int limit = breq.max_response;
+    if (limit == 0 || limit > BATCH_MAX_DATAGRAM)
+        limit = BATCH_MAX_DATAGRAM;
+    unsigned int fit = (limit > BATCH_RESPONSE_HEADER_SIZE)
+                           ? (limit - BATCH_RESPONSE_HEADER_SIZE) / BATCH_RESULT_SIZE
+                           : 0;
+    bresp.count = (breq.count < fit) ? breq.count : fit;
+
+    for (unsigned int i = 0; i < bresp.count; i++)
+    {
+        struct batch_query *q = &breq.queries[i];
+        struct response resp;
+        answer_query(q->type, q->city, q->city_id, &resp, NULL);
+
+        bresp.results[i].status = resp.status;
+        bresp.results[i].type = resp.type;
+        bresp.results[i].value = resp.value;
+
+        log_query(client, q);
+    }
+
+    return serialize_batch_response(&bresp, send_buffer, (int)limit);
 }
 
-int is_city_supported(const char *city)
+// Answers a history request with the first samples of the range that fit
+// in one datagram. Without history (or with a malformed request) the reply
+// is the legacy "invalid request" response, as an old server would send.
+int process_history(const char *recv_buffer, int recv_len,
+                    const struct client_address *client, char *send_buffer)
 {
-    char city_lower[CITY_SIZE];
-    strncpy(city_lower, city, CITY_SIZE - 1);
-    city_lower[CITY_SIZE - 1] = '\0';
-    to_lowercase(city_lower);
+    static _Thread_local struct history_request hreq;
+    static _Thread_local struct history_response hresp;
 
-    for (int i = 0; i < NUM_CITIES; i++)
+    if (history == NULL || deserialize_history_request(recv_buffer, recv_len, &hreq) < 0)
     {
-        if (strcmp(city_lower, supported_cities[i]) == 0)
-        {
-            return 1;
-        }
+        struct response resp;
+        resp.status = STATUS_INVALID_REQUEST;
+        resp.type = recv_buffer[0];
+        resp.value = 0.0f;
+        return serialize_response(&resp, send_buffer);
+    }
+
+    struct batch_query *q = &hreq.query;
+    int city_id;
+    hresp.status = check_query(q->type, q->city, q->city_id, &city_id);
+    hresp.type = q->type;
+    hresp.count = 0;
+    hresp.next = 0;
+    if (hresp.status == STATUS_SUCCESS)
+    {
+        uint32_t to = (hreq.to != 0) ? hreq.to : UINT32_MAX;
+        hresp.count = (unsigned int)history_range(history, city_id, q->type, hreq.from, to,
+                                                  hresp.timestamps, hresp.values,
+                                                  HISTORY_MAX_SAMPLES, &hresp.next);
     }
-    return 0;
+
+    log_query(client, q);
+
+    unsigned int limit = hreq.max_response;
+    if (limit == 0 || limit > BATCH_MAX_DATAGRAM)
+        limit = BATCH_MAX_DATAGRAM;
+    return serialize_history_response(&hresp, send_buffer, (int)limit);
 }
 
-float get_temperature()
+// Answers a compact request with a compact response, in the precision and
+// with the request ID it asks for. A malformed one gets the legacy "invalid
+// request" response, as an old server would send.
+int process_compact(const char *recv_buffer, int recv_len,
+                    const struct client_address *client, char *send_buffer)
 {
-    return -10.0f + ((float)rand() / RAND_MAX) * 50.0f;
+    struct compact_request creq;
+    struct compact_response cresp;
+
+    if (deserialize_compact_request(recv_buffer, recv_len, &creq) < 0)
+    {
+        cresp.resp.status = STATUS_INVALID_REQUEST;
+        cresp.resp.type = recv_buffer[0];
+        cresp.resp.value = 0.0f;
+        return serialize_response(&cresp.resp, send_buffer);
+    }
+
+    struct batch_query *q = &creq.query;
+    answer_query(q->type, q->city, q->city_id, &cresp.resp, NULL);
+    cresp.flags = creq.flags;
+    cresp.id = creq.id;
+
+    log_query(client, q);
+    return serialize_compact_response(&cresp, send_buffer, COMPACT_MAX_RESPONSE);
+}
+
+// Answers a subscription request with an ack; the updates follow from the
+// subscriptions thread. Without subscriptions (or with a malformed request)
+// the reply is the legacy "invalid request" response, as an old server
+// would send. Every type subscribed to is validated and logged as a query.
+int process_subscribe(const char *recv_buffer, int recv_len,
+                      const struct client_address *client, char *send_buffer)
+{
+    struct subscribe_request sreq;
+    struct subscribe_ack ack;
+
+    if (!subscriptions_enabled() || deserialize_subscribe_request(recv_buffer, recv_len, &sreq) < 0)
+    {
+        struct response resp;
+        resp.status = STATUS_INVALID_REQUEST;
+        resp.type = recv_buffer[0];
+        resp.value = 0.0f;
+        return serialize_response(&resp, send_buffer);
+    }
+
+    static const char types[SUBSCRIBE_MAX_TYPES] = {REQ_TEMPERATURE, REQ_HUMIDITY, REQ_WIND,
+                                                    REQ_PRESSURE};
+    unsigned int status = STATUS_SUCCESS;
+    int city_id = -1;
+    for (int t = 0; t < SUBSCRIBE_MAX_TYPES; t++)
+    {
+        if (!(sreq.types & (1u << t)))
+            continue;
+        struct batch_query q;
+        q.type = types[t];
+        q.city_id = sreq.city_id;
+        memcpy(q.city, sreq.city, CITY_SIZE);
+        unsigned int type_status = check_query(q.type, q.city, q.city_id, &city_id);
+        log_query(client, &q);
+        if (status == STATUS_SUCCESS)
+            status = type_status;
+    }
+
+    if (status == STATUS_SUCCESS)
+    {
+        subscriptions_request(client, city_id, &sreq, &ack);
+    }
+    else
+    {
+        ack.status = status;
+        ack.city_id = -1;
+        ack.interval = 0;
+        ack.lease = 0;
+        ack.cookie = 0;
+    }
+    return serialize_subscribe_ack(&ack, send_buffer, SUBSCRIBE_ACK_SIZE);
 }
 
-float get_humidity()
+// Answers a legacy request, with or without request ID.
+// The request is read in place: the type and the city field are used
+// straight from the receive buffer (SERVER_DATAGRAM_SIZE bytes, so the
+// whole field is readable even in a short datagram) and the response is
+// written straight into the send buffer. No struct request is filled in.
+int process_single(const char *recv_buffer, int recv_len,
+                   const struct client_address *client, char *send_buffer)
 {
-    return 20.0f + ((float)rand() / RAND_MAX) * 80.0f;
+    char type = recv_buffer[0];
+    const char *city = recv_buffer + sizeof(char);
+
+    struct response resp;
+    int send_len = answer_query(type, city, -1, &resp, send_buffer);
+
+    // Formatted and written by the logger thread
+    log_request(client, type, city);
+
+    // Echo the optional request ID
+    if (recv_len == (int)REQUEST_WITH_ID_SIZE)
+    {
+        uint32_t id;
+        deserialize_request_id(recv_buffer + REQUEST_BUFFER_SIZE, &id);
+        send_len += serialize_request_id(id, send_buffer + send_len);
+    }
+
+    return send_len;
 }
 
-float get_wind()
+// Queries carried by a datagram, read from the batch header without
+// deserializing anything: what the rate limiter charges for it
+static unsigned int datagram_queries(const char *recv_buffer, int recv_len)
 {
-    return ((float)rand() / RAND_MAX) * 100.0f;
+    if (!is_batch_message(recv_buffer, recv_len) || recv_len < BATCH_REQUEST_HEADER_SIZE)
+        return 1;
+
+    uint16_t net_count;
+    memcpy(&net_count, recv_buffer + 2, sizeof(uint16_t));
+    unsigned int count = ntohs(net_count);
+    return (count > 0) ? count : 1;
 }
 
-float get_pressure()
+// Whether a datagram carries a request ID, as process_request() dispatches
+// it: a legacy request with ID or a compact one with COMPACT_ID. Only these
+// are replayed from the dedup table.
+static int datagram_has_id(const char *recv_buffer, int recv_len)
 {
-    return 950.0f + ((float)rand() / RAND_MAX) * 100.0f;
+    if (is_compact_message(recv_buffer, recv_len))
+        return ((unsigned char)recv_buffer[1] & COMPACT_ID) != 0;
+    return recv_len == (int)REQUEST_WITH_ID_SIZE && !is_batch_message(recv_buffer, recv_len) &&
+           !is_history_message(recv_buffer, recv_len) &&
+           subscribe_message_kind(recv_buffer, recv_len) == 0;
 }
 
-int serialize_request(const struct request *req, char *buffer)
+int process_request(const char *recv_buffer, int recv_len,
+                    const struct sockaddr_storage *client_addr, char *send_buffer)
 {
-    int offset = 0;
+    uint64_t start = metrics_now_ns();
 
-    // Type (1 byte, no conversion needed)
-    memcpy(buffer + offset, &req->type, sizeof(char));
-    offset += sizeof(char);
+    struct client_address client;
+    address_from_sockaddr(client_addr, &client);
 
-    // City (64 bytes)
-    memcpy(buffer + offset, req->city, CITY_SIZE);
-    offset += CITY_SIZE;
+    // Over-limit sources are dropped before parsing, logging or DNS
+    unsigned int queries = datagram_queries(recv_buffer, recv_len);
+    if (!rate_limiter_allow(rate_limiter_key(&client.ip), queries, start))
+    {
+        metrics_rate_limited(queries);
+        return 0;
+    }
 
-    return offset;
+    // A retransmission gets the bytes sent the first time
+    uint64_t fingerprint = 0;
+    int replayable = dedup_enabled() && datagram_has_id(recv_buffer, recv_len);
+    if (replayable)
+    {
+        fingerprint = dedup_fingerprint(&client, recv_buffer, recv_len);
+        int replay_len = dedup_lookup(&client, fingerprint, start, send_buffer);
+        if (replay_len > 0)
+        {
+            metrics_replayed();
+            return replay_len;
+        }
+    }
+
+    grace_enter();
+    cities = atomic_load_explicit(&current_cities, memory_order_acquire);
+
+    int send_len;
+    enum metrics_message kind;
+    if (is_batch_message(recv_buffer, recv_len))
+    {
+        kind = METRICS_BATCH;
+        send_len = process_batch(recv_buffer, recv_len, &client, send_buffer);
+    }
+    else if (is_history_message(recv_buffer, recv_len))
+    {
+        kind = METRICS_HISTORY;
+        send_len = process_history(recv_buffer, recv_len, &client, send_buffer);
+    }
+    else if (is_compact_message(recv_buffer, recv_len))
+    {
+        kind = METRICS_COMPACT;
+        send_len = process_compact(recv_buffer, recv_len, &client, send_buffer);
+    }
+    else if (subscribe_message_kind(recv_buffer, recv_len) == SUBSCRIBE_REQUEST)
+    {
+        kind = METRICS_SUBSCRIBE;
+        send_len = process_subscribe(recv_buffer, recv_len, &client, send_buffer);
+    }
+    else
+    {
+        kind = METRICS_LEGACY;
+        send_len = process_single(recv_buffer, recv_len, &client, send_buffer);
+    }
+
+    grace_exit();
+
+    if (replayable)
+        dedup_store(&client, fingerprint, start, send_buffer, send_len);
+
+    metrics_datagram(kind, metrics_now_ns() - start);
+    return send_len;
 }
 
-int deserialize_request(const char *buffer, struct request *req)
+// Sets one socket buffer size: the *FORCE option ignores the system limit
+// but needs CAP_NET_ADMIN, so it is tried first
+static void set_buffer_size(int sock, int option, int force_option, int size, const char *name)
 {
-    int offset = 0;
+    if (size <= 0)
+        return;
 
-    // Type (1 byte)
-    memcpy(&req->type, buffer + offset, sizeof(char));
-    offset += sizeof(char);
+    if (force_option < 0 ||
+        setsockopt(sock, SOL_SOCKET, force_option, (const char *)&size, sizeof(size)) < 0)
+    {
+        if (setsockopt(sock, SOL_SOCKET, option, (const char *)&size, sizeof(size)) < 0)
+        {
+            printf("Avviso: impossibile impostare il buffer di %s\n", name);
+            return;
+        }
+    }
 
-    // City (64 bytes)
-    memcpy(req->city, buffer + offset, CITY_SIZE);
-    req->city[CITY_SIZE - 1] = '\0'; // Ensure null-termination
-    offset += CITY_SIZE;
+    int actual = 0;
+    socklen_t len = sizeof(actual);
+    if (getsockopt(sock, SOL_SOCKET, option, (char *)&actual, &len) == 0)
+    {
+#if defined __linux__
+        actual /= 2; // Linux reports twice the size, counting its bookkeeping
+#endif
+        if (actual < size)
+            printf("Avviso: buffer di %s limitato a %d byte dal sistema\n", name, actual);
+    }
+}
 
-    return offset;
+// Applies the -r, -s and -B options, and turns on the kernel drop counter
+static void tune_server_socket(int sock, const struct server_config *config)
+{
+#if defined SO_RCVBUFFORCE
+    set_buffer_size(sock, SO_RCVBUF, SO_RCVBUFFORCE, config->recv_buffer, "ricezione");
+    set_buffer_size(sock, SO_SNDBUF, SO_SNDBUFFORCE, config->send_buffer, "invio");
+#else
+    set_buffer_size(sock, SO_RCVBUF, -1, config->recv_buffer, "ricezione");
+    set_buffer_size(sock, SO_SNDBUF, -1, config->send_buffer, "invio");
+#endif
+
+#if defined SO_RXQ_OVFL
+    // Each recvmsg() then carries the count of datagrams dropped by the kernel
+    int enable = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0)
+    {
+        printf("Avviso: conteggio dei datagrammi scartati dal kernel non disponibile\n");
+    }
+#endif
+
+    if (config->busy_poll_us > 0)
+    {
+#if defined SO_BUSY_POLL
+        if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &config->busy_poll_us,
+                       sizeof(config->busy_poll_us)) < 0)
+        {
+            printf("Avviso: impossibile impostare SO_BUSY_POLL (serve CAP_NET_ADMIN)\n");
+        }
+#else
+        printf("Avviso: SO_BUSY_POLL non disponibile su questa piattaforma\n");
+#endif
+    }
 }
 
-int serialize_response(const struct response *resp, char *buffer)
+int create_server_socket(const struct server_config *config, int reuse_port)
 {
-    int offset = 0;
+    // Dual-stack when the system has IPv6: IPv4 clients arrive as
+    // IPv4-mapped addresses on the same socket
+    int family = AF_INET6;
+    int my_socket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (my_socket >= 0)
+    {
+        int v6only = 0;
+        if (setsockopt(my_socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only)) < 0)
+        {
+            closesocket(my_socket);
+            my_socket = -1;
+        }
+    }
+    if (my_socket < 0)
+    {
+        family = AF_INET;
+        my_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (my_socket >= 0)
+            printf("Avviso: IPv6 non disponibile, il server accetta solo IPv4\n");
+    }
+    if (my_socket < 0)
+    {
+        printf("Errore nella creazione del socket\n");
+        return -1;
+    }
 
-    // Status (4 bytes with network byte order)
-    uint32_t net_status = htonl(resp->status);
-    memcpy(buffer + offset, &net_status, sizeof(uint32_t));
-    offset += sizeof(uint32_t);
+#if defined SO_REUSEPORT
+    // Every worker binds its own socket to the same port; the kernel
+    // spreads incoming datagrams across them
+    if (reuse_port)
+    {
+        int enable = 1;
+        if (setsockopt(my_socket, SOL_SOCKET, SO_REUSEPORT, (const char *)&enable, sizeof(enable)) < 0)
+        {
+            printf("Errore nell'impostazione di SO_REUSEPORT\n");
+            closesocket(my_socket);
+            return -1;
+        }
+    }
+#else
+    (void)reuse_port;
+#endif
 
-    // Type (1 byte, no conversion needed)
-    memcpy(buffer + offset, &resp->type, sizeof(char));
-    offset += sizeof(char);
+    tune_server_socket(my_socket, config);
 
-    // Value (float with network byte order)
-    uint32_t temp;
-    memcpy(&temp, &resp->value, sizeof(float));
-    temp = htonl(temp);
-    memcpy(buffer + offset, &temp, sizeof(float));
-    offset += sizeof(float);
+    // Configure server address
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len;
+    memset(&server_addr, 0, sizeof(server_addr));
+    if (family == AF_INET6)
+    {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&server_addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(config->port);
+        server_addr_len = sizeof(*addr6);
+    }
+    else
+    {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&server_addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = INADDR_ANY;
+        addr4->sin_port = htons(config->port);
+        server_addr_len = sizeof(*addr4);
+    }
+
+    // Bind socket
+    if (bind(my_socket, (struct sockaddr *)&server_addr, server_addr_len) < 0)
+    {
+        printf("Errore nel bind del socket\n");
+        closesocket(my_socket);
+        return -1;
+    }
 
-    return offset;
+    return my_socket;
 }
 
-int deserialize_response(const char *buffer, struct response *resp)
+// Builds the set of catalog, which it takes over. Returns NULL on failure.
+// Observations that cannot be read fail the set at startup; after a reload
+// the set falls back to random values.
+static struct city_set *create_city_set(struct city_catalog *catalog, int startup)
 {
-    int offset = 0;
-
-    // Status (4 bytes)
-    uint32_t net_status;
-    memcpy(&net_status, buffer + offset, sizeof(uint32_t));
-    resp->status = ntohl(net_status);
-    offset += sizeof(uint32_t);
-
-    // Type (1 byte)
-    memcpy(&resp->type, buffer + offset, sizeof(char));
-    offset += sizeof(char);
-
-    // Value (float)
-    uint32_t temp;
-    memcpy(&temp, buffer + offset, sizeof(float));
-    temp = ntohl(temp);
-    memcpy(&resp->value, &temp, sizeof(float));
-    offset += sizeof(float);
-
-    return offset;
+    struct city_set *set = calloc(1, sizeof(struct city_set));
+    if (set == NULL)
+    {
+        catalog_close(catalog);
+        return NULL;
+    }
+    set->catalog = catalog;
+
+    set->provider = provider_random();
+    if (config.observations_path != NULL)
+    {
+        struct weather_provider *observations =
+            provider_observations(config.observations_path, config.observations_refresh,
+                                  catalog, set->provider);
+        if (observations != NULL)
+        {
+            set->provider = observations;
+        }
+        else if (startup)
+        {
+            free(set);
+            catalog_close(catalog);
+            return NULL;
+        }
+        else
+        {
+            printf("Avviso: valori casuali fino al prossimo ricaricamento del catalogo\n");
+        }
+    }
+
+    if (config.cache_bucket_ms > 0)
+    {
+        set->response_cache = response_cache_create(catalog_city_count(catalog),
+                                                    config.cache_bucket_ms, get_city_value);
+        if (set->response_cache == NULL)
+        {
+            printf("Avviso: cache delle risposte non disponibile\n");
+        }
+    }
+    return set;
 }
 
-void get_hostname_from_ip(struct sockaddr_in *addr, char *hostname, size_t hostname_len, char *ip_str, size_t ip_len)
+static void free_city_set(struct city_set *set)
 {
-    // Get IP string
-    inet_ntop(AF_INET, &(addr->sin_addr), ip_str, ip_len);
+    if (set == NULL)
+        return;
+    provider_close(set->provider);
+    response_cache_free(set->response_cache);
+    catalog_close(set->catalog);
+    free(set);
+}
 
-    // Reverse DNS lookup
-    struct hostent *host = gethostbyaddr((const char *)&(addr->sin_addr), sizeof(addr->sin_addr), AF_INET);
-    if (host != NULL && host->h_name != NULL)
+// SIGHUP: maps the -c catalog again and swaps it in while the receive
+// loops keep going. The new set comes with its own observations, so a
+// request always reads them with the IDs of the catalog it looked the city
+// up in. City IDs stay valid as long as the new catalog only adds cities
+// after the existing ones; the history and the per-city metrics keep the
+// cities the server started with.
+static void reload_catalog(void)
+{
+    if (config.catalog_path == NULL)
     {
-        strncpy(hostname, host->h_name, hostname_len - 1);
-        hostname[hostname_len - 1] = '\0';
+        printf("Avviso: nessun catalogo da ricaricare (manca -c)\n");
+        return;
     }
-    else
+
+    // Signals are handled from before the first set is published
+    if (atomic_load(&current_cities) == NULL)
     {
-        strncpy(hostname, ip_str, hostname_len - 1);
-        hostname[hostname_len - 1] = '\0';
+        printf("Avviso: server in avvio, catalogo non ricaricato\n");
+        return;
     }
+
+    struct city_catalog *catalog = catalog_open(config.catalog_path);
+    struct city_set *set = (catalog != NULL) ? create_city_set(catalog, 0) : NULL;
+    if (set == NULL)
+    {
+        printf("Avviso: catalogo non ricaricato, restano le città attuali\n");
+        return;
+    }
+
+    struct city_set *old = atomic_exchange(&current_cities, set);
+    metrics_set_catalog(catalog);
+
+    // Requests, samples, pushes and stats scrapes still on the old set
+    // finish first
+    if (grace_wait() == 0)
+        free_city_set(old);
+
+    printf("Catalogo ricaricato: %d città\n", catalog_city_count(catalog));
+}
+
+// Port a bound socket is listening on, -1 if unknown
+static int socket_port(int sock)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0)
+        return -1;
+    if (addr.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    if (addr.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    return -1;
+}
+
+// Takes over the sockets of the server listening on the -x path, if any,
+// or opens config->workers new ones (with SO_REUSEPORT when more than one).
+// Every socket is bound before any thread starts, so a bind failure does
+// not leave a partially started server behind. Returns how many sockets
+// there are, and sets config->workers to that; 0 on failure.
+static int open_server_sockets(struct server_config *config, int *socks)
+{
+    int count = 0;
+    if (config->handoff_path != NULL)
+        count = handoff_receive(config->handoff_path, socks, MAX_WORKERS);
+
+    if (count > 0 && socket_port(socks[0]) != config->port)
+    {
+        printf("Avviso: i socket ricevuti sono su un'altra porta, ne apro di nuovi\n");
+        for (int i = 0; i < count; i++)
+            closesocket(socks[i]);
+        count = 0;
+    }
+    if (count > 0)
+    {
+        printf("Presi in carico %d socket dal server precedente\n", count);
+        for (int i = 0; i < count; i++)
+            tune_server_socket(socks[i], config);
+        config->workers = count;
+        return count;
+    }
+
+    for (; count < config->workers; count++)
+    {
+        socks[count] = create_server_socket(config, config->workers > 1);
+        if (socks[count] < 0)
+        {
+            for (int i = 0; i < count; i++)
+                closesocket(socks[i]);
+            return 0;
+        }
+    }
+    return count;
 }
 
 int main(int argc, char *argv[])
 {
-    int port = DEFAULT_PORT;
+    config.port = DEFAULT_PORT;
+    config.batch_size = 1;
+    config.workers = 1;
+    config.pin_cpus = 0;
+    config.resolvers = DNS_DEFAULT_RESOLVERS;
+    config.log_policy = LOG_BLOCK;
+    config.catalog_path = NULL;
+    config.observations_path = NULL;
+    config.observations_refresh = OBSERVATION_REFRESH_DEFAULT;
+    config.cache_bucket_ms = 0;
+    config.stats_port = 0;
+    config.recv_buffer = 0;
+    config.send_buffer = 0;
+    config.busy_poll_us = 0;
+    config.use_uring = 0;
+    config.rate_limit = 0;
+    config.rate_burst = 0;
+    config.history_hours = 0;
+    config.history_step = HISTORY_DEFAULT_STEP;
+    config.subscriptions = 0;
+    config.handoff_path = NULL;
+    config.dedup_ms = 0;
 
     for (int i = 1; i < argc; i++)
     {
         if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
         {
-            port = atoi(argv[++i]);
+            config.port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            config.batch_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            config.workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-a") == 0)
+        {
+            config.pin_cpus = 1;
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            config.resolvers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            config.catalog_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            config.observations_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-O") == 0 && i + 1 < argc)
+        {
+            config.observations_refresh = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+        {
+            config.cache_bucket_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            config.stats_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            config.recv_buffer = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            config.send_buffer = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc)
+        {
+            config.busy_poll_us = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-u") == 0)
+        {
+            config.use_uring = 1;
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+        {
+            config.rate_limit = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+        {
+            config.rate_burst = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+        {
+            config.history_hours = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+        {
+            config.history_step = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-U") == 0 && i + 1 < argc)
+        {
+            config.subscriptions = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc)
+        {
+            config.dedup_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            config.handoff_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            config.log_policy = (strcmp(argv[++i], "drop") == 0) ? LOG_DROP : LOG_BLOCK;
         }
     }
 
+    if (config.workers < 1)
+        config.workers = 1;
+    if (config.workers > MAX_WORKERS)
+        config.workers = MAX_WORKERS;
+
 #if defined WIN32
     // Initialize Winsock
     WSADATA wsa_data;
@@ -254,108 +912,109 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    // Seed random number generator
-    srand((unsigned int)time(NULL));
-
-    int my_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (my_socket < 0)
+    struct city_catalog *catalog;
+    if (config.catalog_path != NULL)
+        catalog = catalog_open(config.catalog_path);
+    else
+        catalog = catalog_builtin(supported_cities, NUM_CITIES);
+    if (catalog == NULL)
     {
-        printf("Errore nella creazione del socket\n");
+        printf("Errore nel caricamento delle città\n");
         clearwinsock();
         return 1;
     }
 
-    // Configure server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    // Before any other thread starts, so that all of them leave the
+    // signals to the signal thread
+    if (signals_init(reload_catalog) < 0)
+    {
+        printf("Avviso: gestione dei segnali non disponibile\n");
+    }
 
-    // Bind socket
-    if (bind(my_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (metrics_init(catalog, config.stats_port) < 0)
     {
-        printf("Errore nel bind del socket\n");
-        closesocket(my_socket);
         clearwinsock();
         return 1;
     }
 
-    printf("Server UDP in ascolto sulla porta %d...\n", port);
-
-    while (1)
+    // Starts the observation refresh thread, hence after signals_init()
+    struct city_set *set = create_city_set(catalog, 1);
+    if (set == NULL)
     {
-        char recv_buffer[BUFFER_SIZE];
-        char send_buffer[BUFFER_SIZE];
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-
-        int recv_len = recvfrom(my_socket, recv_buffer, sizeof(recv_buffer), 0,
-                                (struct sockaddr *)&client_addr, &client_addr_len);
+        clearwinsock();
+        return 1;
+    }
+    atomic_store(&current_cities, set);
 
-        if (recv_len < 0)
+    if (config.history_hours > 0)
+    {
+        if (config.history_step < 1)
+            config.history_step = HISTORY_DEFAULT_STEP;
+        history = history_create(catalog_city_count(catalog), config.history_hours,
+                                 config.history_step, history_sample);
+        if (history == NULL)
         {
-            printf("Errore nella ricezione\n");
-            continue;
+            printf("Avviso: storico dei valori non disponibile\n");
         }
+    }
 
-        // Get client hostname and IP for logging
-        char client_hostname[256];
-        char client_ip[INET_ADDRSTRLEN];
-        get_hostname_from_ip(&client_addr, client_hostname, sizeof(client_hostname),
-                             client_ip, sizeof(client_ip));
+    if (subscriptions_init(config.subscriptions, subscription_value) < 0)
+    {
+        clearwinsock();
+        return 1;
+    }
 
-        struct request req;
-        deserialize_request(recv_buffer, &req);
+    dedup_init(config.dedup_ms);
 
-        printf("Richiesta ricevuta da %s (ip %s): type='%c', city='%s'\n",
-               client_hostname, client_ip, req.type, req.city);
+    if (config.rate_limit > 0 &&
+        rate_limiter_init((unsigned int)config.rate_limit,
+                          config.rate_burst > 0 ? (unsigned int)config.rate_burst : 0) < 0)
+    {
+        clearwinsock();
+        return 1;
+    }
 
-        struct response resp;
-        resp.type = req.type;
-        resp.value = 0.0f;
+    if (dns_cache_init(config.resolvers) < 0)
+    {
+        printf("Avviso: pool di resolver DNS incompleto\n");
+    }
 
-        if (!is_valid_request_type(req.type))
-        {
-            resp.status = STATUS_INVALID_REQUEST;
-        }
-        else if (contains_invalid_chars(req.city))
-        {
-            resp.status = STATUS_INVALID_REQUEST;
-        }
-        else if (!is_city_supported(req.city))
-        {
-            resp.status = STATUS_CITY_NOT_FOUND;
-        }
-        // Generate weather data
-        else
-        {
-            resp.status = STATUS_SUCCESS;
-            switch (req.type)
-            {
-            case REQ_TEMPERATURE:
-                resp.value = get_temperature();
-                break;
-            case REQ_HUMIDITY:
-                resp.value = get_humidity();
-                break;
-            case REQ_WIND:
-                resp.value = get_wind();
-                break;
-            case REQ_PRESSURE:
-                resp.value = get_pressure();
-                break;
-            }
-        }
-
-        int send_len = serialize_response(&resp, send_buffer);
-        sendto(my_socket, send_buffer, send_len, 0,
-               (struct sockaddr *)&client_addr, client_addr_len);
+    if (logger_init(config.log_policy) < 0)
+    {
+        clearwinsock();
+        return 1;
+    }
+
+    static int socks[MAX_WORKERS];
+    int count = open_server_sockets(&config, socks);
+    if (count == 0)
+    {
+        clearwinsock();
+        return 1;
+    }
+
+    if (config.handoff_path != NULL)
+        handoff_listen(config.handoff_path, socks, count);
+
+    int ret = 0;
+    if (count > 1)
+    {
+        printf("Server UDP in ascolto sulla porta %d (%d worker)...\n", config.port, count);
+        ret = run_workers(&config, socks);
+    }
+    else
+    {
+        printf("Server UDP in ascolto sulla porta %d...\n", config.port);
+        subscriptions_start(socks[0]);
+        serve(socks[0], &config);
+        subscriptions_stop();
+        closesocket(socks[0]);
     }
 
+    // Every loop has returned: what they logged is written out before exiting
+    logger_flush();
     printf("Server terminated.\n");
 
-    closesocket(my_socket);
     clearwinsock();
-    return 0;
+    return ret;
 }
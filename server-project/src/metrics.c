@@ -0,0 +1,572 @@
+/*
+ * metrics.c
+ *
+ * Per-thread counters and the stats endpoints.
+ *
+ * A shard is owned by one thread, so counters are bumped with a relaxed
+ * load and store instead of an atomic read-modify-write: no lock prefix, no
+ * line bouncing between cores. Readers may see a shard a few increments
+ * behind, which is fine for statistics. Shards are pushed onto a lock-free
+ * list the first time a thread records something and live until exit.
+ */
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#define closesocket close
+#endif
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "protocol.h"
+#include "dns_cache.h"
+#include "logger.h"
+#include "rate_limiter.h"
+#include "subscriptions.h"
+#include "grace.h"
+
+#define CACHE_LINE 64
+
+struct metrics_shard {
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t types[METRICS_TYPES];
+    atomic_uint_fast64_t statuses[METRICS_STATUSES];
+    atomic_uint_fast64_t datagrams[METRICS_MESSAGE_KINDS];
+    atomic_uint_fast64_t latency[METRICS_LATENCY_BUCKETS];
+    atomic_uint_fast64_t latency_sum_ns;
+    atomic_uint_fast64_t kernel_drops;          // of the thread's socket
+    atomic_uint_fast64_t limited[2];            // datagrams, queries
+    atomic_uint_fast64_t replayed;              // retries answered from the dedup table
+    atomic_uint_fast64_t *cities;               // one counter per catalog city
+    struct metrics_shard *next;
+};
+
+// Totals over every shard
+struct metrics_totals {
+    uint64_t types[METRICS_TYPES];
+    uint64_t statuses[METRICS_STATUSES];
+    uint64_t datagrams[METRICS_MESSAGE_KINDS];
+    uint64_t latency[METRICS_LATENCY_BUCKETS];
+    uint64_t latency_sum_ns;
+    uint64_t kernel_drops;
+    uint64_t limited[2];
+    uint64_t replayed;
+    uint64_t *cities;
+};
+
+static _Atomic(struct metrics_shard *) shards;
+static _Thread_local struct metrics_shard *local_shard;
+static _Atomic(const struct city_catalog *) metrics_catalog;
+static int city_count;   // counters per shard, fixed at metrics_init()
+
+static const char type_names[METRICS_TYPES] = {
+    REQ_TEMPERATURE, REQ_HUMIDITY, REQ_WIND, REQ_PRESSURE, '?'};
+static const char *status_names[METRICS_STATUSES] = {
+    "success", "city_not_found", "invalid_request"};
+static const char *message_names[METRICS_MESSAGE_KINDS] = {
+    "legacy", "batch", "compact", "history", "subscribe"};
+
+static inline void bump(atomic_uint_fast64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static struct metrics_shard *register_shard(void)
+{
+    size_t size = (sizeof(struct metrics_shard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+#if defined WIN32
+    struct metrics_shard *shard = _aligned_malloc(size, CACHE_LINE);
+#else
+    struct metrics_shard *shard = aligned_alloc(CACHE_LINE, size);
+#endif
+    if (shard == NULL)
+        return NULL;
+    memset(shard, 0, size);
+
+    shard->cities = calloc((size_t)city_count + 1, sizeof(atomic_uint_fast64_t));
+    if (shard->cities == NULL)
+    {
+#if defined WIN32
+        _aligned_free(shard);
+#else
+        free(shard);
+#endif
+        return NULL;
+    }
+
+    struct metrics_shard *first = atomic_load(&shards);
+    do
+    {
+        shard->next = first;
+    } while (!atomic_compare_exchange_weak(&shards, &first, shard));
+
+    return shard;
+}
+
+static inline struct metrics_shard *get_shard(void)
+{
+    if (local_shard == NULL)
+        local_shard = register_shard();
+    return local_shard;
+}
+
+static int type_index(char type)
+{
+    for (int i = 0; i < METRICS_TYPES - 1; i++)
+    {
+        if (type_names[i] == type)
+            return i;
+    }
+    return METRICS_TYPES - 1;
+}
+
+void metrics_query(char type, unsigned int status, int city_id)
+{
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL)
+        return;
+
+    bump(&shard->types[type_index(type)], 1);
+    if (status < METRICS_STATUSES)
+        bump(&shard->statuses[status], 1);
+    if (city_id >= 0 && city_id < city_count)
+        bump(&shard->cities[city_id], 1);
+}
+
+void metrics_datagram(enum metrics_message kind, uint64_t elapsed_ns)
+{
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL)
+        return;
+
+    // Bucket i counts latencies up to 2^i microseconds
+    uint64_t us = (elapsed_ns + 999) / 1000;
+    int bucket = (us <= 1) ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > METRICS_LATENCY_BUCKETS - 1)
+        bucket = METRICS_LATENCY_BUCKETS - 1;
+
+    if (kind < METRICS_MESSAGE_KINDS)
+        bump(&shard->datagrams[kind], 1);
+    bump(&shard->latency[bucket], 1);
+    bump(&shard->latency_sum_ns, elapsed_ns);
+}
+
+void metrics_kernel_drops(uint32_t total)
+{
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL)
+        return;
+
+    // The kernel counter is cumulative: keep the latest value
+    atomic_store_explicit(&shard->kernel_drops, total, memory_order_relaxed);
+}
+
+void metrics_rate_limited(unsigned int queries)
+{
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL)
+        return;
+
+    bump(&shard->limited[0], 1);
+    bump(&shard->limited[1], queries);
+}
+
+void metrics_replayed(void)
+{
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL)
+        return;
+
+    bump(&shard->replayed, 1);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+#if defined CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int collect(struct metrics_totals *totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    totals->cities = calloc((size_t)city_count + 1, sizeof(uint64_t));
+    if (totals->cities == NULL)
+        return -1;
+
+    for (struct metrics_shard *s = atomic_load(&shards); s != NULL; s = s->next)
+    {
+        for (int i = 0; i < METRICS_TYPES; i++)
+            totals->types[i] += atomic_load_explicit(&s->types[i], memory_order_relaxed);
+        for (int i = 0; i < METRICS_STATUSES; i++)
+            totals->statuses[i] += atomic_load_explicit(&s->statuses[i], memory_order_relaxed);
+        for (int i = 0; i < METRICS_MESSAGE_KINDS; i++)
+            totals->datagrams[i] += atomic_load_explicit(&s->datagrams[i], memory_order_relaxed);
+        for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+            totals->latency[i] += atomic_load_explicit(&s->latency[i], memory_order_relaxed);
+        totals->latency_sum_ns += atomic_load_explicit(&s->latency_sum_ns, memory_order_relaxed);
+        totals->kernel_drops += atomic_load_explicit(&s->kernel_drops, memory_order_relaxed);
+        for (int i = 0; i < 2; i++)
+            totals->limited[i] += atomic_load_explicit(&s->limited[i], memory_order_relaxed);
+        totals->replayed += atomic_load_explicit(&s->replayed, memory_order_relaxed);
+        for (int i = 0; i < city_count; i++)
+            totals->cities[i] += atomic_load_explicit(&s->cities[i], memory_order_relaxed);
+    }
+    return 0;
+}
+
+/*
+ * Prometheus text
+ */
+
+struct text {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static void appendf(struct text *t, const char *fmt, ...)
+{
+    if (t->failed)
+        return;
+
+    while (1)
+    {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, args);
+        va_end(args);
+        if (n < 0)
+        {
+            t->failed = 1;
+            return;
+        }
+        if ((size_t)n < t->cap - t->len)
+        {
+            t->len += (size_t)n;
+            return;
+        }
+
+        char *grown = realloc(t->buf, t->cap * 2 + (size_t)n);
+        if (grown == NULL)
+        {
+            t->failed = 1;
+            return;
+        }
+        t->buf = grown;
+        t->cap = t->cap * 2 + (size_t)n;
+    }
+}
+
+char *metrics_snapshot(size_t *len)
+{
+    struct metrics_totals totals;
+    if (collect(&totals) < 0)
+        return NULL;
+
+    struct text t = {malloc(4096), 0, 4096, 0};
+    if (t.buf == NULL)
+    {
+        free(totals.cities);
+        return NULL;
+    }
+
+    appendf(&t, "# HELP meteo_requests_total Queries received, by request type.\n");
+    appendf(&t, "# TYPE meteo_requests_total counter\n");
+    for (int i = 0; i < METRICS_TYPES; i++)
+    {
+        if (i < METRICS_TYPES - 1)
+            appendf(&t, "meteo_requests_total{type=\"%c\"} %llu\n", type_names[i],
+                    (unsigned long long)totals.types[i]);
+        else
+            appendf(&t, "meteo_requests_total{type=\"other\"} %llu\n",
+                    (unsigned long long)totals.types[i]);
+    }
+
+    appendf(&t, "# HELP meteo_responses_total Query results, by status.\n");
+    appendf(&t, "# TYPE meteo_responses_total counter\n");
+    for (int i = 0; i < METRICS_STATUSES; i++)
+        appendf(&t, "meteo_responses_total{status=\"%s\"} %llu\n", status_names[i],
+                (unsigned long long)totals.statuses[i]);
+
+    appendf(&t, "# HELP meteo_city_requests_total Successful queries, by city.\n");
+    appendf(&t, "# TYPE meteo_city_requests_total counter\n");
+    // A reload frees the old catalog only after this section
+    grace_enter();
+    const struct city_catalog *catalog = atomic_load(&metrics_catalog);
+    int named = catalog_city_count(catalog);
+    for (int i = 0; i < city_count && i < named; i++)
+    {
+        if (totals.cities[i] == 0)
+            continue;
+        char name[CITY_SIZE];
+        catalog_city_name(catalog, i, name, sizeof(name));
+        appendf(&t, "meteo_city_requests_total{city=\"%s\"} %llu\n", name,
+                (unsigned long long)totals.cities[i]);
+    }
+    grace_exit();
+
+    appendf(&t, "# HELP meteo_datagrams_total Request datagrams processed, by format.\n");
+    appendf(&t, "# TYPE meteo_datagrams_total counter\n");
+    for (int i = 0; i < METRICS_MESSAGE_KINDS; i++)
+        appendf(&t, "meteo_datagrams_total{format=\"%s\"} %llu\n", message_names[i],
+                (unsigned long long)totals.datagrams[i]);
+
+    appendf(&t, "# HELP meteo_processing_seconds Time spent processing one datagram.\n");
+    appendf(&t, "# TYPE meteo_processing_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++)
+    {
+        cumulative += totals.latency[i];
+        appendf(&t, "meteo_processing_seconds_bucket{le=\"%g\"} %llu\n",
+                (double)(1ull << i) / 1e6, (unsigned long long)cumulative);
+    }
+    cumulative += totals.latency[METRICS_LATENCY_BUCKETS - 1];
+    appendf(&t, "meteo_processing_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    appendf(&t, "meteo_processing_seconds_sum %.9f\n", totals.latency_sum_ns / 1e9);
+    appendf(&t, "meteo_processing_seconds_count %llu\n", (unsigned long long)cumulative);
+
+    appendf(&t, "# HELP meteo_kernel_drops_total Datagrams dropped by the kernel, receive buffer full.\n");
+    appendf(&t, "# TYPE meteo_kernel_drops_total counter\n");
+    appendf(&t, "meteo_kernel_drops_total %llu\n", (unsigned long long)totals.kernel_drops);
+
+    appendf(&t, "# HELP meteo_replayed_total Retransmitted requests answered with the response already sent.\n");
+    appendf(&t, "# TYPE meteo_replayed_total counter\n");
+    appendf(&t, "meteo_replayed_total %llu\n", (unsigned long long)totals.replayed);
+
+    struct rate_limiter_stats limiter;
+    rate_limiter_get_stats(&limiter);
+    appendf(&t, "# HELP meteo_rate_limited_datagrams_total Datagrams dropped by the per-source rate limiter.\n");
+    appendf(&t, "# TYPE meteo_rate_limited_datagrams_total counter\n");
+    appendf(&t, "meteo_rate_limited_datagrams_total %llu\n", (unsigned long long)totals.limited[0]);
+    appendf(&t, "# HELP meteo_rate_limited_queries_total Queries in the datagrams dropped by the rate limiter.\n");
+    appendf(&t, "# TYPE meteo_rate_limited_queries_total counter\n");
+    appendf(&t, "meteo_rate_limited_queries_total %llu\n", (unsigned long long)totals.limited[1]);
+    appendf(&t, "# HELP meteo_rate_limiter_sources_total Sources given a rate limiter entry.\n");
+    appendf(&t, "# TYPE meteo_rate_limiter_sources_total counter\n");
+    appendf(&t, "meteo_rate_limiter_sources_total{entry=\"new\"} %llu\n", (unsigned long long)limiter.tracked);
+    appendf(&t, "meteo_rate_limiter_sources_total{entry=\"evicted\"} %llu\n", (unsigned long long)limiter.evicted);
+
+    struct subscriptions_stats subs;
+    subscriptions_get_stats(&subs);
+    appendf(&t, "# HELP meteo_subscriptions Subscriptions held, by state.\n");
+    appendf(&t, "# TYPE meteo_subscriptions gauge\n");
+    appendf(&t, "meteo_subscriptions{state=\"active\"} %llu\n", (unsigned long long)subs.active);
+    appendf(&t, "meteo_subscriptions{state=\"pending\"} %llu\n", (unsigned long long)subs.pending);
+    appendf(&t, "# HELP meteo_subscription_events_total Subscription lifecycle events.\n");
+    appendf(&t, "# TYPE meteo_subscription_events_total counter\n");
+    appendf(&t, "meteo_subscription_events_total{event=\"created\"} %llu\n", (unsigned long long)subs.created);
+    appendf(&t, "meteo_subscription_events_total{event=\"expired\"} %llu\n", (unsigned long long)subs.expired);
+    appendf(&t, "meteo_subscription_events_total{event=\"cancelled\"} %llu\n", (unsigned long long)subs.cancelled);
+    appendf(&t, "meteo_subscription_events_total{event=\"rejected\"} %llu\n", (unsigned long long)subs.rejected);
+    appendf(&t, "# HELP meteo_subscription_updates_total Update datagrams pushed to subscribers.\n");
+    appendf(&t, "# TYPE meteo_subscription_updates_total counter\n");
+    appendf(&t, "meteo_subscription_updates_total %llu\n", (unsigned long long)subs.updates);
+
+    appendf(&t, "# HELP meteo_log_dropped_total Log records dropped because a ring was full.\n");
+    appendf(&t, "# TYPE meteo_log_dropped_total counter\n");
+    appendf(&t, "meteo_log_dropped_total %llu\n", (unsigned long long)logger_dropped());
+
+    struct dns_cache_stats dns;
+    dns_cache_get_stats(&dns);
+    appendf(&t, "# HELP meteo_dns_cache_total Reverse DNS cache events used by the log.\n");
+    appendf(&t, "# TYPE meteo_dns_cache_total counter\n");
+    appendf(&t, "meteo_dns_cache_total{event=\"hit\"} %llu\n", (unsigned long long)dns.hits);
+    appendf(&t, "meteo_dns_cache_total{event=\"miss\"} %llu\n", (unsigned long long)dns.misses);
+    appendf(&t, "meteo_dns_cache_total{event=\"resolved\"} %llu\n", (unsigned long long)dns.resolved);
+    appendf(&t, "meteo_dns_cache_total{event=\"failed\"} %llu\n", (unsigned long long)dns.failed);
+    appendf(&t, "meteo_dns_cache_total{event=\"dropped\"} %llu\n", (unsigned long long)dns.dropped);
+
+    free(totals.cities);
+    if (t.failed)
+    {
+        free(t.buf);
+        return NULL;
+    }
+    *len = t.len;
+    return t.buf;
+}
+
+// Upper bound, in microseconds, of the bucket holding the given percentile
+static uint64_t latency_percentile_us(const struct metrics_totals *totals, double percentile)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+        count += totals->latency[i];
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++)
+    {
+        seen += totals->latency[i];
+        if (seen >= rank)
+            return 1ull << i;
+    }
+    return 1ull << (METRICS_LATENCY_BUCKETS - 1);
+}
+
+void metrics_print_summary(void)
+{
+    struct metrics_totals totals;
+    if (collect(&totals) < 0)
+        return;
+
+    uint64_t queries = 0;
+    for (int i = 0; i < METRICS_TYPES; i++)
+        queries += totals.types[i];
+    uint64_t datagrams = 0;
+    for (int i = 0; i < METRICS_MESSAGE_KINDS; i++)
+        datagrams += totals.datagrams[i];
+
+    printf("Statistiche: %llu richieste (t %llu, h %llu, w %llu, p %llu, altro %llu)\n",
+           (unsigned long long)queries, (unsigned long long)totals.types[0],
+           (unsigned long long)totals.types[1], (unsigned long long)totals.types[2],
+           (unsigned long long)totals.types[3], (unsigned long long)totals.types[4]);
+    printf("  esiti: successo %llu, città non trovata %llu, non valide %llu\n",
+           (unsigned long long)totals.statuses[STATUS_SUCCESS],
+           (unsigned long long)totals.statuses[STATUS_CITY_NOT_FOUND],
+           (unsigned long long)totals.statuses[STATUS_INVALID_REQUEST]);
+    printf("  datagrammi: %llu (classici %llu, batch %llu, compatti %llu, storico %llu, sottoscrizioni %llu)\n",
+           (unsigned long long)datagrams, (unsigned long long)totals.datagrams[METRICS_LEGACY],
+           (unsigned long long)totals.datagrams[METRICS_BATCH],
+           (unsigned long long)totals.datagrams[METRICS_COMPACT],
+           (unsigned long long)totals.datagrams[METRICS_HISTORY],
+           (unsigned long long)totals.datagrams[METRICS_SUBSCRIBE]);
+    printf("  elaborazione media %.2f us, p50 <= %llu us, p99 <= %llu us\n",
+           datagrams ? totals.latency_sum_ns / 1e3 / datagrams : 0.0,
+           (unsigned long long)latency_percentile_us(&totals, 50.0),
+           (unsigned long long)latency_percentile_us(&totals, 99.0));
+    printf("  scartati dal kernel: %llu, log scartati: %llu\n",
+           (unsigned long long)totals.kernel_drops, (unsigned long long)logger_dropped());
+    printf("  limitati: %llu datagrammi (%llu richieste), ritrasmissioni ripetute: %llu\n",
+           (unsigned long long)totals.limited[0], (unsigned long long)totals.limited[1],
+           (unsigned long long)totals.replayed);
+    if (subscriptions_enabled())
+    {
+        struct subscriptions_stats subs;
+        subscriptions_get_stats(&subs);
+        printf("  sottoscrizioni: %llu attive, %llu in attesa, %llu aggiornamenti inviati\n",
+               (unsigned long long)subs.active, (unsigned long long)subs.pending,
+               (unsigned long long)subs.updates);
+    }
+    fflush(stdout);
+
+    free(totals.cities);
+}
+
+/*
+ * Endpoints
+ */
+
+static void *stats_main(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+
+    while (1)
+    {
+        char query[64];
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        if (recvfrom(sock, query, sizeof(query), 0,
+                     (struct sockaddr *)&client_addr, &client_addr_len) < 0)
+            continue;
+
+        size_t len;
+        char *text = metrics_snapshot(&len);
+        if (text == NULL)
+            continue;
+
+        // One datagram per chunk of whole lines
+        size_t sent = 0;
+        while (sent < len)
+        {
+            size_t chunk = len - sent;
+            if (chunk > METRICS_MAX_DATAGRAM)
+            {
+                chunk = METRICS_MAX_DATAGRAM;
+                while (chunk > 1 && text[sent + chunk - 1] != '\n')
+                    chunk--;
+            }
+            sendto(sock, text + sent, (int)chunk, 0,
+                   (struct sockaddr *)&client_addr, client_addr_len);
+            sent += chunk;
+        }
+        free(text);
+    }
+
+    return NULL;
+}
+
+static int start_stats_port(int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        printf("Errore nella creazione del socket delle statistiche\n");
+        return -1;
+    }
+
+#if defined SO_REUSEPORT
+    // A new server taking over (-x) binds the port while this one drains
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&enable, sizeof(enable));
+#endif
+
+    // Only reachable from the local host
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf("Errore nel bind della porta delle statistiche %d\n", port);
+        closesocket(sock);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_main, (void *)(intptr_t)sock) != 0)
+    {
+        printf("Errore nella creazione del thread delle statistiche\n");
+        closesocket(sock);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int metrics_init(const struct city_catalog *catalog, int stats_port)
+{
+    atomic_init(&metrics_catalog, catalog);
+    city_count = catalog_city_count(catalog);
+
+    if (stats_port > 0)
+        return start_stats_port(stats_port);
+    return 0;
+}
+
+void metrics_set_catalog(const struct city_catalog *catalog)
+{
+    atomic_store(&metrics_catalog, catalog);
+}
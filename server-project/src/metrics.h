@@ -0,0 +1,68 @@
+/*
+ * metrics.h
+ *
+ * Server statistics.
+ * Every thread that answers requests updates its own cache-line-aligned
+ * block of counters with plain loads and stores; a snapshot sums the blocks
+ * of all threads. Snapshots are served as Prometheus text on a side UDP
+ * port and printed as a summary on SIGUSR1 (see signals.h).
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include "city_catalog.h"
+
+#define METRICS_TYPES 5             // t, h, w, p, anything else
+#define METRICS_STATUSES 3          // STATUS_SUCCESS .. STATUS_INVALID_REQUEST
+#define METRICS_LATENCY_BUCKETS 20  // <= 1 us, <= 2 us, ... <= 2^18 us, more
+#define METRICS_MAX_DATAGRAM 65000  // bytes of Prometheus text per reply datagram
+
+// Kind of a processed request datagram, as process_request() dispatches it
+enum metrics_message {
+    METRICS_LEGACY = 0,   // classic fixed-size request (anything unrecognized too)
+    METRICS_BATCH,
+    METRICS_COMPACT,      // negotiated format, version 2
+    METRICS_HISTORY,
+    METRICS_SUBSCRIBE,
+    METRICS_MESSAGE_KINDS
+};
+
+// Sizes the per-city counters and, unless stats_port is 0, starts the
+// thread answering stats queries on 127.0.0.1:stats_port
+int metrics_init(const struct city_catalog *catalog, int stats_port);
+
+// Names the cities after a catalog reload. The per-city counters keep the
+// size given to metrics_init(): cities past it are not counted. The old
+// catalog is read within a grace section (see grace.h): the caller frees it
+// after grace_wait().
+void metrics_set_catalog(const struct city_catalog *catalog);
+
+// One answered query: city_id is -1 unless the city was found
+void metrics_query(char type, unsigned int status, int city_id);
+
+// One processed datagram of the given kind and the time spent on it
+void metrics_datagram(enum metrics_message kind, uint64_t elapsed_ns);
+
+// Latest SO_RXQ_OVFL counter of the calling thread's socket: datagrams the
+// kernel dropped because the receive buffer was full
+void metrics_kernel_drops(uint32_t total);
+
+// One datagram dropped by the rate limiter, carrying the given queries
+void metrics_rate_limited(unsigned int queries);
+
+// One retransmitted request answered from the dedup table
+void metrics_replayed(void);
+
+// Monotonic clock for metrics_datagram()
+uint64_t metrics_now_ns(void);
+
+// Prometheus text exposition of the current totals. Returns a malloc'd
+// string (the caller frees it) or NULL.
+char *metrics_snapshot(size_t *len);
+
+// Prints a one-screen summary to stdout
+void metrics_print_summary(void);
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,8 @@
+/*
+ * protocol.c
+ *
+ * Builds the codec shared with the client (common/protocol.c) as part of
+ * this project.
+ */
+
+#include "../../common/protocol.c"
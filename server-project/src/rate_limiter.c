@@ -0,0 +1,154 @@
+/*
+ * rate_limiter.c
+ *
+ * Token buckets in a lock-free hash table.
+ *
+ * A bucket is stored as the single time at which it will be full again
+ * ("theoretical arrival time", as in the GCRA formulation of a token
+ * bucket): a query costs one interval, and it is allowed as long as that
+ * time stays within burst intervals of now. One 64-bit word per bucket means
+ * one compare-and-swap per datagram and no lock.
+ *
+ * Entries are never deleted. A source probes RATE_LIMITER_PROBE entries from
+ * its hash; if none is its own or empty, it takes over the one with the
+ * oldest full time, i.e. the source idle longest. A bucket whose time has
+ * passed is full, so reusing it forgets nothing.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rate_limiter.h"
+
+struct limiter_entry {
+    _Atomic uint64_t key;    // source, 0 when the entry is empty
+    _Atomic uint64_t full;   // time (ns) at which the bucket is full again
+};
+
+static struct limiter_entry *table;
+static unsigned int burst_queries;
+static uint64_t interval_ns;   // time to earn one query back
+static uint64_t window_ns;     // burst_queries intervals
+
+static atomic_uint_fast64_t stat_tracked;
+static atomic_uint_fast64_t stat_evicted;
+
+int rate_limiter_init(unsigned int rate, unsigned int burst)
+{
+    if (rate == 0)
+        return 0;
+    if (rate > 1000000000u)
+        rate = 1000000000u;
+
+    table = calloc(RATE_LIMITER_SIZE, sizeof(struct limiter_entry));
+    if (table == NULL)
+    {
+        printf("Errore nell'allocazione del limitatore di richieste\n");
+        return -1;
+    }
+
+    burst_queries = (burst > 0) ? burst : rate;
+    interval_ns = 1000000000u / rate;
+    window_ns = (uint64_t)burst_queries * interval_ns;
+    return 0;
+}
+
+// Spreads keys that differ only in a few low bits over the table. The
+// function is a bijection, so distinct inputs give distinct keys.
+static inline uint64_t hash_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+uint64_t rate_limiter_key(const struct in6_addr *addr)
+{
+    uint64_t prefix;
+    uint64_t interface_id;
+    memcpy(&prefix, addr->s6_addr, sizeof(prefix));
+    memcpy(&interface_id, addr->s6_addr + 8, sizeof(interface_id));
+
+    // The low half of an IPv4-mapped address holds ffff:a.b.c.d; the /64
+    // prefixes are tagged to keep the two key spaces apart
+    uint64_t key = address_is_ipv4(addr) ? hash_key(interface_id)
+                                         : hash_key(prefix ^ 0x5bd1e9955bd1e995ull);
+    return (key != 0) ? key : 1;
+}
+
+static struct limiter_entry *find_entry(uint64_t key)
+{
+    size_t home = (size_t)hash_key(key);
+    struct limiter_entry *oldest = NULL;
+    uint64_t oldest_full = UINT64_MAX;
+
+    for (size_t i = 0; i < RATE_LIMITER_PROBE; i++)
+    {
+        struct limiter_entry *entry = &table[(home + i) & (RATE_LIMITER_SIZE - 1)];
+        uint64_t current = atomic_load_explicit(&entry->key, memory_order_acquire);
+
+        if (current == 0)
+        {
+            if (atomic_compare_exchange_strong(&entry->key, &current, key))
+            {
+                atomic_fetch_add_explicit(&stat_tracked, 1, memory_order_relaxed);
+                return entry;
+            }
+            // Claimed meanwhile, maybe by another datagram of the same source
+        }
+        if (current == key)
+            return entry;
+
+        uint64_t full = atomic_load_explicit(&entry->full, memory_order_relaxed);
+        if (full < oldest_full)
+        {
+            oldest = entry;
+            oldest_full = full;
+        }
+    }
+
+    // Window full: reuse the entry idle longest. If another thread swaps it
+    // first the datagram is charged to that source, a rare and harmless
+    // inaccuracy.
+    uint64_t current = atomic_load_explicit(&oldest->key, memory_order_relaxed);
+    if (atomic_compare_exchange_strong(&oldest->key, &current, key))
+    {
+        atomic_store_explicit(&oldest->full, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_evicted, 1, memory_order_relaxed);
+    }
+    return oldest;
+}
+
+int rate_limiter_allow(uint64_t key, unsigned int cost, uint64_t now_ns)
+{
+    if (table == NULL)
+        return 1;
+
+    // A batch larger than the burst passes when the bucket is full
+    if (cost == 0)
+        cost = 1;
+    if (cost > burst_queries)
+        cost = burst_queries;
+
+    struct limiter_entry *entry = find_entry(key);
+    uint64_t full = atomic_load_explicit(&entry->full, memory_order_relaxed);
+    while (1)
+    {
+        uint64_t next = ((full > now_ns) ? full : now_ns) + cost * interval_ns;
+        if (next - now_ns > window_ns)
+            return 0;
+        if (atomic_compare_exchange_weak_explicit(&entry->full, &full, next,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return 1;
+    }
+}
+
+void rate_limiter_get_stats(struct rate_limiter_stats *stats)
+{
+    stats->tracked = atomic_load_explicit(&stat_tracked, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&stat_evicted, memory_order_relaxed);
+}
@@ -0,0 +1,39 @@
+/*
+ * rate_limiter.h
+ *
+ * Per-source token buckets that keep a single host from flooding the
+ * server. Buckets live in a fixed-size open-addressing table shared by all
+ * workers and updated with compare-and-swap only; when the probe window of
+ * a new source is full, the bucket that has been idle longest is reused.
+ */
+
+#ifndef RATE_LIMITER_H_
+#define RATE_LIMITER_H_
+
+#include <stdint.h>
+#include "address.h"
+
+#define RATE_LIMITER_SIZE 65536   // table entries (power of two), 16 bytes each
+#define RATE_LIMITER_PROBE 8      // entries looked at for one source
+
+struct rate_limiter_stats {
+    uint64_t tracked;    // sources given an empty entry
+    uint64_t evicted;    // sources that took over another source's entry
+};
+
+// Allows rate queries per second from each source, with bursts of up to
+// burst queries (burst 0 means one second's worth). rate 0 disables the
+// limiter.
+int rate_limiter_init(unsigned int rate, unsigned int burst);
+
+// Charges cost queries to the bucket of key, a non-zero identifier of the
+// source. Returns 1 if they are allowed, 0 if the datagram must be dropped.
+int rate_limiter_allow(uint64_t key, unsigned int cost, uint64_t now_ns);
+
+// Key of a source: one per IPv4 address, one per IPv6 /64 (the block a
+// single host is usually given)
+uint64_t rate_limiter_key(const struct in6_addr *addr);
+
+void rate_limiter_get_stats(struct rate_limiter_stats *stats);
+
+#endif /* RATE_LIMITER_H_ */
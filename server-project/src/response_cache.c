@@ -0,0 +1,159 @@
+/*
+ * response_cache.c
+ *
+ * Flat array of cache-line-aligned entries indexed by
+ * city_id * RESPONSE_CACHE_TYPES + type, so a lookup is one multiply and
+ * one line, and workers filling different entries never share a line.
+ *
+ * Each entry is a seqlock: the sequence is odd while a writer is updating
+ * it. A reader copies the entry and accepts the copy only if the sequence
+ * was even and unchanged around it. On a miss the first worker to take the
+ * lock fills the entry; the others retry and read its value, so all of
+ * them answer the same within a bucket.
+ */
+
+#if defined WIN32
+#include <malloc.h>
+#endif
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "response_cache.h"
+
+#define CACHE_LINE 64
+
+struct cache_entry {
+    _Alignas(CACHE_LINE) atomic_uint seq;
+    uint32_t bucket;                 // time bucket the value belongs to
+    int valid;
+    float value;
+    char response[RESPONSE_BUFFER_SIZE];
+};
+
+struct response_cache {
+    struct cache_entry *entries;
+    int cities;
+    uint64_t bucket_ms;
+    response_value_fn compute;
+};
+
+static int type_slot(char type)
+{
+    switch (type)
+    {
+    case REQ_TEMPERATURE:
+        return 0;
+    case REQ_HUMIDITY:
+        return 1;
+    case REQ_WIND:
+        return 2;
+    case REQ_PRESSURE:
+        return 3;
+    }
+    return -1;
+}
+
+static uint32_t current_bucket(const struct response_cache *cache)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    uint64_t ms = (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+    return (uint32_t)(ms / cache->bucket_ms);
+}
+
+struct response_cache *response_cache_create(int cities, int bucket_ms, response_value_fn compute)
+{
+    if (cities <= 0 || bucket_ms <= 0)
+        return NULL;
+
+    struct response_cache *cache = calloc(1, sizeof(struct response_cache));
+    if (cache == NULL)
+        return NULL;
+
+    size_t size = (size_t)cities * RESPONSE_CACHE_TYPES * sizeof(struct cache_entry);
+#if defined WIN32
+    cache->entries = _aligned_malloc(size, CACHE_LINE);
+#else
+    cache->entries = aligned_alloc(CACHE_LINE, size);
+#endif
+    if (cache->entries == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->entries, 0, size);
+
+    cache->cities = cities;
+    cache->bucket_ms = (uint64_t)bucket_ms;
+    cache->compute = compute;
+    return cache;
+}
+
+void response_cache_free(struct response_cache *cache)
+{
+    if (cache == NULL)
+        return;
+#if defined WIN32
+    _aligned_free(cache->entries);
+#else
+    free(cache->entries);
+#endif
+    free(cache);
+}
+
+float response_cache_get(struct response_cache *cache, int city_id, char type, char *serialized)
+{
+    struct cache_entry *e = &cache->entries[city_id * RESPONSE_CACHE_TYPES + type_slot(type)];
+    uint32_t bucket = current_bucket(cache);
+
+    while (1)
+    {
+        unsigned int seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if ((seq & 1) == 0)
+        {
+            int valid = e->valid;
+            uint32_t entry_bucket = e->bucket;
+            float value = e->value;
+            char response[RESPONSE_BUFFER_SIZE];
+            memcpy(response, e->response, RESPONSE_BUFFER_SIZE);
+
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&e->seq, memory_order_relaxed) == seq)
+            {
+                if (valid && entry_bucket == bucket)
+                {
+                    if (serialized != NULL)
+                        memcpy(serialized, response, RESPONSE_BUFFER_SIZE);
+                    return value;
+                }
+
+                // Miss: fill the entry if no other worker is doing it
+                if (atomic_compare_exchange_strong_explicit(&e->seq, &seq, seq + 1,
+                                                            memory_order_acquire,
+                                                            memory_order_relaxed))
+                {
+                    // Readers must not see the new fields with the old sequence
+                    atomic_thread_fence(memory_order_release);
+
+                    struct response resp;
+                    resp.status = STATUS_SUCCESS;
+                    resp.type = type;
+                    resp.value = cache->compute(type, city_id);
+
+                    e->value = resp.value;
+                    e->bucket = bucket;
+                    e->valid = 1;
+                    serialize_response(&resp, e->response);
+                    if (serialized != NULL)
+                        memcpy(serialized, e->response, RESPONSE_BUFFER_SIZE);
+
+                    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+                    return resp.value;
+                }
+            }
+        }
+        // A writer is busy on this entry: read it again
+    }
+}
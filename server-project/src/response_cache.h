@@ -0,0 +1,33 @@
+/*
+ * response_cache.h
+ *
+ * Cache of successful responses, one entry per (city ID, type).
+ * An entry holds the value generated for the current time bucket together
+ * with its serialized 9-byte response, so every client asking for the same
+ * city and type within a bucket gets the same answer and a hit skips both
+ * the provider and serialize_response().
+ */
+
+#ifndef RESPONSE_CACHE_H_
+#define RESPONSE_CACHE_H_
+
+#include "protocol.h"
+
+#define RESPONSE_CACHE_TYPES 4   // t, h, w, p
+
+struct response_cache;
+
+// Generates the value of a (city, type) pair on a miss
+typedef float (*response_value_fn)(char type, int city_id);
+
+// Creates a cache for city IDs 0 .. cities - 1 with buckets of bucket_ms
+// milliseconds. Returns NULL on failure.
+struct response_cache *response_cache_create(int cities, int bucket_ms, response_value_fn compute);
+void response_cache_free(struct response_cache *cache);
+
+// Value of a supported city and a valid type in the current bucket. When
+// serialized is not NULL the RESPONSE_BUFFER_SIZE-byte response is copied
+// there as well.
+float response_cache_get(struct response_cache *cache, int city_id, char type, char *serialized);
+
+#endif /* RESPONSE_CACHE_H_ */
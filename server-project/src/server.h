@@ -0,0 +1,81 @@
+/*
+ * server.h
+ *
+ * Server-side declarations shared between the request pipeline (main.c)
+ * and the socket receive/send loops (server_loop.c)
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "protocol.h"
+
+// Size of every receive and send buffer: a legacy request or a full batch
+#define SERVER_DATAGRAM_SIZE BATCH_MAX_DATAGRAM
+
+// Upper bound for the -b option (datagrams drained by one batched receive)
+#define MAX_BATCH_SIZE 1024
+
+// Upper bound for the -w option (worker threads)
+#define MAX_WORKERS 256
+
+// Command line configuration of the server
+struct server_config {
+    int port;        // -p: UDP port
+    int batch_size;  // -b: datagrams per recvmmsg/sendmmsg (1 = classic loop)
+    int workers;     // -w: worker threads, each with its own SO_REUSEPORT socket
+    int pin_cpus;    // -a: pin worker i to CPU i (Linux only)
+    int resolvers;   // -d: reverse-DNS resolver threads (0 = log IPs only)
+    int log_policy;  // -q: drop or block when a log ring is full (enum log_policy)
+    const char *catalog_path;  // -c: binary city catalog (NULL = built-in cities)
+    const char *observations_path;  // -o: CSV of observed values (NULL = random only)
+    int observations_refresh;       // -O: seconds between observation reloads
+    int cache_bucket_ms;            // -C: response cache time bucket (0 = no cache)
+    int stats_port;                 // -m: UDP port of the stats endpoint on 127.0.0.1 (0 = none)
+    int recv_buffer;                // -r: SO_RCVBUF bytes (0 = system default)
+    int send_buffer;                // -s: SO_SNDBUF bytes (0 = system default)
+    int busy_poll_us;               // -B: SO_BUSY_POLL microseconds (0 = off)
+    int use_uring;                  // -u: io_uring loop (Linux only)
+    int rate_limit;                 // -l: queries per second from one source (0 = no limit)
+    int rate_burst;                 // -L: queries one source may send at once (0 = one second's worth)
+    int history_hours;              // -H: hours of values kept for range queries (0 = no history)
+    int history_step;               // -S: seconds between history samples
+    int subscriptions;              // -U: subscriptions held at most (0 = no subscriptions)
+    const char *handoff_path;       // -x: Unix socket to hand the UDP sockets over on (NULL = none)
+    int dedup_ms;                   // -D: milliseconds a response is replayed to retries (0 = off)
+};
+
+// Request pipeline: deserialize, validate, generate and serialize the reply
+// (legacy, batch, history, compact or subscription). send_buffer holds
+// SERVER_DATAGRAM_SIZE bytes.
+// Returns the number of bytes written into send_buffer, 0 when the datagram
+// is dropped without a reply.
+int process_request(const char *recv_buffer, int recv_len,
+                    const struct sockaddr_storage *client_addr, char *send_buffer);
+
+// Creates, tunes and binds the UDP socket: dual-stack IPv6, or IPv4 only
+// where IPv6 is missing, with SO_REUSEPORT when reuse_port is set.
+// Returns -1 on failure (the error is already printed).
+int create_server_socket(const struct server_config *config, int reuse_port);
+
+// Receive/send loops: they return once a stop has been requested (see
+// signals.h) and the datagrams already queued have been answered
+void serve_single(int sock);
+int serve_batched(int sock, int batch_size);
+int serve_uring(int sock);
+void serve(int sock, const struct server_config *config);
+
+// Starts config->workers threads, each serving its own socket of socks
+// (bound to the same port with SO_REUSEPORT), and waits for them
+int run_workers(const struct server_config *config, const int *socks);
+
+#endif /* SERVER_H_ */
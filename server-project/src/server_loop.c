@@ -0,0 +1,286 @@
+/*
+ * server_loop.c
+ *
+ * Receive/send loops of the UDP server.
+ *
+ * serve_single() is the classic one recvfrom + one sendto per datagram loop.
+ * serve_batched() drains up to batch_size datagrams per recvmmsg() into a
+ * preallocated ring of receive slots and flushes all the replies with
+ * sendmmsg(). It is only available on Linux; elsewhere it returns -1 and the
+ * caller falls back to serve_single().
+ *
+ * The io_uring loop lives in uring_loop.c; serve() tries it first when
+ * asked to.
+ *
+ * Outside Windows datagrams are read with recvmsg()/recvmmsg(), so that
+ * the SO_RXQ_OVFL drop counter attached to them reaches the metrics.
+ *
+ * Receives time out every SERVER_POLL_MS, so every loop returns once a stop
+ * was requested (see signals.h) and the queued datagrams have been answered.
+ */
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "server.h"
+#include "metrics.h"
+#include "signals.h"
+
+#if defined SO_RXQ_OVFL
+#define DROP_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+#else
+#define DROP_CONTROL_SIZE 1
+#endif
+
+#if !defined WIN32
+
+// Passes the kernel drop counter, if the datagram carries one, to the metrics
+static void account_drops(struct msghdr *msg)
+{
+#if defined SO_RXQ_OVFL
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            metrics_kernel_drops(drops);
+        }
+    }
+#else
+    (void)msg;
+#endif
+}
+
+#endif
+
+// Whether a failed receive only ran into the SERVER_POLL_MS timeout
+static int receive_timed_out(void)
+{
+#if defined WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// recvfrom() that also collects the kernel drop counter where possible
+static int receive_datagram(int sock, char *buffer, int size,
+                            struct sockaddr_storage *client_addr, socklen_t *client_addr_len)
+{
+#if defined WIN32
+    return recvfrom(sock, buffer, size, 0, (struct sockaddr *)client_addr, client_addr_len);
+#else
+    char control[DROP_CONTROL_SIZE];
+    struct iovec iov = {buffer, (size_t)size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = client_addr;
+    msg.msg_namelen = *client_addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int recv_len = (int)recvmsg(sock, &msg, 0);
+    if (recv_len >= 0)
+    {
+        *client_addr_len = msg.msg_namelen;
+        account_drops(&msg);
+    }
+    return recv_len;
+#endif
+}
+
+void serve_single(int sock)
+{
+    while (!server_should_exit(0))
+    {
+        char recv_buffer[SERVER_DATAGRAM_SIZE];
+        char send_buffer[SERVER_DATAGRAM_SIZE];
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int recv_len = receive_datagram(sock, recv_buffer, sizeof(recv_buffer),
+                                        &client_addr, &client_addr_len);
+
+        if (recv_len < 0)
+        {
+            if (!receive_timed_out())
+                printf("Errore nella ricezione\n");
+            else if (server_should_exit(1))
+                break;
+            continue;
+        }
+
+        int send_len = process_request(recv_buffer, recv_len, &client_addr, send_buffer);
+        if (send_len > 0)
+            sendto(sock, send_buffer, send_len, 0,
+                   (struct sockaddr *)&client_addr, client_addr_len);
+    }
+}
+
+#if defined __linux__
+
+// One slot of the batch ring: the datagram, its sender and the reply
+struct batch_slot {
+    char recv_buffer[SERVER_DATAGRAM_SIZE];
+    char send_buffer[SERVER_DATAGRAM_SIZE];
+    struct sockaddr_storage client_addr;
+    struct iovec recv_iov;
+    struct iovec send_iov;
+    char control[DROP_CONTROL_SIZE];
+};
+
+int serve_batched(int sock, int batch_size)
+{
+    if (batch_size < 1)
+        batch_size = 1;
+    if (batch_size > MAX_BATCH_SIZE)
+        batch_size = MAX_BATCH_SIZE;
+
+    struct batch_slot *slots = calloc(batch_size, sizeof(struct batch_slot));
+    struct mmsghdr *recv_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    struct mmsghdr *send_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    if (slots == NULL || recv_msgs == NULL || send_msgs == NULL)
+    {
+        printf("Errore nell'allocazione dei buffer batch\n");
+        free(slots);
+        free(recv_msgs);
+        free(send_msgs);
+        return -1;
+    }
+
+    // The iovecs never move: only the lengths and address sizes are reset
+    for (int i = 0; i < batch_size; i++)
+    {
+        slots[i].recv_iov.iov_base = slots[i].recv_buffer;
+        slots[i].recv_iov.iov_len = sizeof(slots[i].recv_buffer);
+        slots[i].send_iov.iov_base = slots[i].send_buffer;
+    }
+
+    while (!server_should_exit(0))
+    {
+        for (int i = 0; i < batch_size; i++)
+        {
+            memset(&recv_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            recv_msgs[i].msg_hdr.msg_name = &slots[i].client_addr;
+            recv_msgs[i].msg_hdr.msg_namelen = sizeof(slots[i].client_addr);
+            recv_msgs[i].msg_hdr.msg_iov = &slots[i].recv_iov;
+            recv_msgs[i].msg_hdr.msg_iovlen = 1;
+            recv_msgs[i].msg_hdr.msg_control = slots[i].control;
+            recv_msgs[i].msg_hdr.msg_controllen = sizeof(slots[i].control);
+        }
+
+        // Block for the first datagram, then take whatever is already queued
+        int received = recvmmsg(sock, recv_msgs, batch_size, MSG_WAITFORONE, NULL);
+        if (received < 0)
+        {
+            if (!receive_timed_out())
+                printf("Errore nella ricezione\n");
+            else if (server_should_exit(1))
+                break;
+            continue;
+        }
+
+        // Replies are packed at the front of send_msgs: dropped datagrams get none
+        int replies = 0;
+        for (int i = 0; i < received; i++)
+        {
+            account_drops(&recv_msgs[i].msg_hdr);
+
+            int send_len = process_request(slots[i].recv_buffer, (int)recv_msgs[i].msg_len,
+                                           &slots[i].client_addr, slots[i].send_buffer);
+            if (send_len == 0)
+                continue;
+
+            slots[i].send_iov.iov_len = send_len;
+            memset(&send_msgs[replies].msg_hdr, 0, sizeof(struct msghdr));
+            send_msgs[replies].msg_hdr.msg_name = &slots[i].client_addr;
+            send_msgs[replies].msg_hdr.msg_namelen = recv_msgs[i].msg_hdr.msg_namelen;
+            send_msgs[replies].msg_hdr.msg_iov = &slots[i].send_iov;
+            send_msgs[replies].msg_hdr.msg_iovlen = 1;
+            replies++;
+        }
+
+        // sendmmsg may stop early: resend the tail, skipping a failing datagram
+        int sent = 0;
+        while (sent < replies)
+        {
+            int n = sendmmsg(sock, send_msgs + sent, replies - sent, 0);
+            sent += (n > 0) ? n : 1;
+        }
+    }
+
+    free(slots);
+    free(recv_msgs);
+    free(send_msgs);
+    return 0;
+}
+
+#else
+
+int serve_batched(int sock, int batch_size)
+{
+    (void)sock;
+    (void)batch_size;
+    return -1; // recvmmsg/sendmmsg not available on this platform
+}
+
+#endif
+
+// Makes blocking receives return every SERVER_POLL_MS, to check for a stop
+static void set_receive_timeout(int sock)
+{
+#if defined WIN32
+    DWORD timeout = SERVER_POLL_MS;
+#else
+    struct timeval timeout = {SERVER_POLL_MS / 1000, (SERVER_POLL_MS % 1000) * 1000};
+#endif
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
+    {
+        printf("Avviso: timeout di ricezione non impostato, l'arresto attende un datagramma\n");
+    }
+}
+
+void serve(int sock, const struct server_config *config)
+{
+    set_receive_timeout(sock);
+
+    if (config->use_uring)
+    {
+        if (serve_uring(sock) == 0)
+            return;
+        printf("io_uring non disponibile, uso del ciclo standard\n");
+    }
+
+    if (config->batch_size > 1)
+    {
+        if (serve_batched(sock, config->batch_size) < 0)
+        {
+            printf("I/O batch non disponibile, uso del ciclo standard\n");
+            serve_single(sock);
+        }
+    }
+    else
+    {
+        serve_single(sock);
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * signals.c
+ *
+ * Stop flag and signal thread of the server.
+ *
+ * The receive loops check the flag with a relaxed load after each datagram
+ * or batch, and again when a receive times out (SERVER_POLL_MS), so a stop
+ * costs nothing on the hot path and is noticed within one poll period even
+ * on an idle socket. A second SIGINT or SIGTERM exits at once.
+ */
+
+#if defined WIN32
+#include <windows.h>
+#include <signal.h>
+#else
+#include <signal.h>
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "signals.h"
+#include "metrics.h"
+
+static atomic_int stopping;
+static _Atomic uint64_t drain_deadline_ms;
+
+static uint64_t now_ms(void)
+{
+#if defined WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+void server_stop(void)
+{
+    if (atomic_load(&stopping))
+        return;
+    atomic_store(&drain_deadline_ms, now_ms() + SERVER_DRAIN_MS);
+    atomic_store(&stopping, 1);
+}
+
+int server_stopping(void)
+{
+    return atomic_load_explicit(&stopping, memory_order_relaxed);
+}
+
+int server_should_exit(int idle)
+{
+    if (!atomic_load_explicit(&stopping, memory_order_relaxed))
+        return 0;
+    return idle || now_ms() >= atomic_load(&drain_deadline_ms);
+}
+
+#if defined WIN32
+
+// Runs on a thread of its own, created by the console
+static void console_stop(int sig)
+{
+    (void)sig;
+    if (server_stopping())
+        exit(1);
+    server_stop();
+    signal(SIGINT, console_stop);
+}
+
+int signals_init(reload_fn reload)
+{
+    (void)reload;
+    signal(SIGINT, console_stop);
+    return 0;
+}
+
+#else
+
+static reload_fn reload_catalog;
+
+static void *signal_main(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0)
+    {
+        switch (sig)
+        {
+        case SIGUSR1:
+            metrics_print_summary();
+            break;
+        case SIGHUP:
+            if (reload_catalog != NULL)
+                reload_catalog();
+            break;
+        default:
+            if (server_stopping())
+            {
+                printf("Arresto immediato\n");
+                exit(1);
+            }
+            printf("Arresto in corso...\n");
+            server_stop();
+            break;
+        }
+    }
+    return NULL;
+}
+
+int signals_init(reload_fn reload)
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+
+    reload_catalog = reload;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signal_main, &set) != 0)
+    {
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
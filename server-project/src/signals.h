@@ -0,0 +1,35 @@
+/*
+ * signals.h
+ *
+ * Server lifecycle driven by signals.
+ * SIGINT and SIGTERM stop the server gracefully: the receive loops answer
+ * what is already queued and return once the socket is idle, or after
+ * SERVER_DRAIN_MS at most. SIGHUP reloads the city catalog and SIGUSR1
+ * prints the metrics summary. All of them are handled by one thread with
+ * sigwait(), outside any signal handler; on Windows only Ctrl-C is caught.
+ */
+
+#ifndef SIGNALS_H_
+#define SIGNALS_H_
+
+#define SERVER_POLL_MS 200     // receive timeout, so idle loops notice a stop
+#define SERVER_DRAIN_MS 2000   // longest drain after a stop
+
+// Called on SIGHUP from the signal thread
+typedef void (*reload_fn)(void);
+
+// Blocks the signals above and starts the thread handling them; call it
+// before starting any other thread, so that all of them block the signals
+int signals_init(reload_fn reload);
+
+// Starts the drain, as SIGTERM does
+void server_stop(void);
+
+// Whether a stop was requested
+int server_stopping(void);
+
+// Whether a receive loop should return now: a stop was requested and the
+// last receive found the socket idle, or the drain has run out of time
+int server_should_exit(int idle);
+
+#endif /* SIGNALS_H_ */
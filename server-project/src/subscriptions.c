@@ -0,0 +1,533 @@
+/*
+ * subscriptions.c
+ *
+ * Subscription pool, index and timer wheel.
+ *
+ * Entries live in one array allocated up front and are linked by index:
+ * free entries on a free list, used ones on a hash chain keyed by (client,
+ * city) and on the list of the wheel slot of the second their next update
+ * is due. The wheel has more slots than the longest interval, so a slot
+ * only ever holds entries due in that very second: the pusher thread takes
+ * a slot, sends its updates and relinks each entry interval slots ahead,
+ * all in constant time per entry, however many subscriptions there are.
+ *
+ * One mutex guards everything; it is held only to move entries around.
+ * The updates of a slot are taken SUBSCRIPTIONS_SEND_BATCH at a time,
+ * built and sent with the mutex released.
+ */
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "subscriptions.h"
+
+#define NONE UINT32_MAX
+#define UPDATE_MAX_SIZE (SUBSCRIBE_UPDATE_HEADER_SIZE + SUBSCRIBE_MAX_TYPES * BATCH_RESULT_SIZE)
+
+enum { SUB_FREE, SUB_PENDING, SUB_ACTIVE };
+
+struct subscription {
+    struct client_address client;
+    uint16_t city_id;
+    uint8_t types;        // bit i for the i-th of t, h, w, p
+    uint8_t state;        // SUB_FREE, SUB_PENDING or SUB_ACTIVE
+    uint16_t interval;    // seconds
+    uint32_t cookie;
+    uint32_t expires;     // second the lease (or the confirmation window) ends
+    uint32_t due;         // second the entry is scheduled for
+    uint32_t hash_next;   // hash chain
+    uint32_t prev;        // wheel slot list
+    uint32_t next;        // wheel slot list, or free list
+};
+
+// What the pusher needs to send one update, copied under the mutex
+struct due_update {
+    struct client_address client;
+    int city_id;
+    unsigned int types;
+};
+
+static const char subscription_types[SUBSCRIBE_MAX_TYPES] = {
+    REQ_TEMPERATURE, REQ_HUMIDITY, REQ_WIND, REQ_PRESSURE};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct subscription *entries;
+static uint32_t capacity;
+static uint32_t *buckets;         // hash chain heads
+static uint32_t bucket_mask;
+static uint32_t wheel[SUBSCRIPTIONS_WHEEL_SLOTS];
+static uint32_t free_list;
+static uint32_t cursor;           // next second the pusher will process
+static uint64_t cookie_state;
+static subscription_value_fn value_of;
+static struct subscriptions_stats stats;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // signalled to stop the pusher
+static int stopping;
+static pthread_t pusher_thread;
+static int pusher_running;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Same finalizer as the rate limiter's
+static inline uint64_t hash_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+static uint32_t bucket_of(const struct client_address *client, int city_id)
+{
+    uint64_t high;
+    uint64_t low;
+    memcpy(&high, client->ip.s6_addr, sizeof(high));
+    memcpy(&low, client->ip.s6_addr + 8, sizeof(low));
+    uint64_t key = hash_key(high) ^ low ^ ((uint64_t)client->port << 16 | (uint64_t)city_id);
+    return (uint32_t)hash_key(key) & bucket_mask;
+}
+
+// Unpredictable, non-zero cookies: splitmix64 over a seed taken at start
+static uint32_t new_cookie(void)
+{
+    uint32_t cookie;
+    do
+    {
+        uint64_t z = (cookie_state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        cookie = (uint32_t)(z ^ (z >> 31));
+    } while (cookie == 0);
+    return cookie;
+}
+
+static uint32_t find(const struct client_address *client, int city_id)
+{
+    for (uint32_t i = buckets[bucket_of(client, city_id)]; i != NONE; i = entries[i].hash_next)
+    {
+        const struct subscription *s = &entries[i];
+        if (s->city_id == city_id && s->client.port == client->port &&
+            memcmp(&s->client.ip, &client->ip, sizeof(client->ip)) == 0)
+            return i;
+    }
+    return NONE;
+}
+
+static void schedule(uint32_t i, uint32_t due)
+{
+    struct subscription *s = &entries[i];
+    uint32_t *head = &wheel[due & (SUBSCRIPTIONS_WHEEL_SLOTS - 1)];
+
+    s->due = due;
+    s->prev = NONE;
+    s->next = *head;
+    if (*head != NONE)
+        entries[*head].prev = i;
+    *head = i;
+}
+
+static void unschedule(uint32_t i)
+{
+    struct subscription *s = &entries[i];
+
+    if (s->prev != NONE)
+        entries[s->prev].next = s->next;
+    else
+        wheel[s->due & (SUBSCRIPTIONS_WHEEL_SLOTS - 1)] = s->next;
+    if (s->next != NONE)
+        entries[s->next].prev = s->prev;
+}
+
+// Takes an entry off its hash chain and the wheel and frees it
+static void release(uint32_t i)
+{
+    struct subscription *s = &entries[i];
+
+    uint32_t *link = &buckets[bucket_of(&s->client, s->city_id)];
+    while (*link != i)
+        link = &entries[*link].hash_next;
+    *link = s->hash_next;
+
+    unschedule(i);
+    if (s->state == SUB_ACTIVE)
+        stats.active--;
+    else
+        stats.pending--;
+
+    s->state = SUB_FREE;
+    s->next = free_list;
+    free_list = i;
+}
+
+int subscriptions_init(int max_subscriptions, subscription_value_fn value)
+{
+    if (max_subscriptions <= 0)
+        return 0;
+
+    uint32_t size = 1;
+    while (size < (uint32_t)max_subscriptions)
+        size <<= 1;
+
+    entries = calloc((size_t)max_subscriptions, sizeof(struct subscription));
+    buckets = malloc((size_t)size * sizeof(uint32_t));
+    if (entries == NULL || buckets == NULL)
+    {
+        printf("Errore nell'allocazione delle sottoscrizioni\n");
+        free(entries);
+        free(buckets);
+        entries = NULL;
+        return -1;
+    }
+
+    capacity = (uint32_t)max_subscriptions;
+    bucket_mask = size - 1;
+    memset(buckets, 0xFF, (size_t)size * sizeof(uint32_t));
+    memset(wheel, 0xFF, sizeof(wheel));
+    for (uint32_t i = 0; i < capacity; i++)
+        entries[i].next = (i + 1 < capacity) ? i + 1 : NONE;
+    free_list = 0;
+
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    cookie_state = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    cookie_state ^= (uint64_t)(uintptr_t)entries;
+
+    cursor = (uint32_t)(now_ms() / 1000);
+    value_of = value;
+    return 0;
+}
+
+int subscriptions_enabled(void)
+{
+    return entries != NULL;
+}
+
+void subscriptions_request(const struct client_address *client, int city_id,
+                           const struct subscribe_request *req, struct subscribe_ack *ack)
+{
+    uint32_t now = (uint32_t)(now_ms() / 1000);
+
+    unsigned int interval = req->interval;
+    if (interval < 1)
+        interval = 1;
+    if (interval > SUBSCRIPTIONS_MAX_INTERVAL)
+        interval = SUBSCRIPTIONS_MAX_INTERVAL;
+    unsigned int lease = req->lease;
+    if (lease > SUBSCRIPTIONS_MAX_LEASE)
+        lease = SUBSCRIPTIONS_MAX_LEASE;
+    if (lease > 0 && lease < interval)
+        lease = interval;
+
+    ack->status = STATUS_SUCCESS;
+    ack->city_id = city_id;
+    ack->interval = interval;
+    ack->lease = lease;
+    ack->cookie = req->cookie;
+
+    pthread_mutex_lock(&lock);
+
+    uint32_t i = find(client, city_id);
+    struct subscription *s = (i != NONE) ? &entries[i] : NULL;
+
+    if (s != NULL && req->cookie != s->cookie)
+    {
+        // A repeated first request gets the same cookie; anything else
+        // with a wrong cookie changes nothing
+        if (s->state == SUB_PENDING && req->cookie == 0)
+            ack->cookie = s->cookie;
+        else
+            ack->status = STATUS_INVALID_REQUEST;
+    }
+    else if (lease == 0)
+    {
+        // Cancelling an unknown subscription is not an error: it is gone
+        if (s != NULL)
+        {
+            release(i);
+            stats.cancelled++;
+        }
+    }
+    else if (s == NULL)
+    {
+        // New subscription, or one this server no longer knows (expired,
+        // or a restart): nothing is pushed until the new cookie comes back
+        if (free_list == NONE)
+        {
+            ack->status = SUBSCRIBE_FULL;
+            ack->cookie = 0;
+            stats.rejected++;
+        }
+        else
+        {
+            i = free_list;
+            s = &entries[i];
+            free_list = s->next;
+
+            s->client = *client;
+            s->city_id = (uint16_t)city_id;
+            s->types = (uint8_t)req->types;
+            s->state = SUB_PENDING;
+            s->interval = (uint16_t)interval;
+            s->cookie = new_cookie();
+            s->expires = now + SUBSCRIPTIONS_CONFIRM;
+            uint32_t *head = &buckets[bucket_of(client, city_id)];
+            s->hash_next = *head;
+            *head = i;
+            schedule(i, s->expires);
+            stats.pending++;
+
+            ack->cookie = s->cookie;
+        }
+    }
+    else
+    {
+        // Confirmation or renewal: the first update of a confirmed
+        // subscription goes out at the pusher's next tick
+        if (s->state == SUB_PENDING)
+        {
+            s->state = SUB_ACTIVE;
+            stats.pending--;
+            stats.active++;
+            stats.created++;
+            unschedule(i);
+            schedule(i, cursor);
+        }
+        else if (s->interval != interval)
+        {
+            unschedule(i);
+            schedule(i, (now + interval > cursor) ? now + interval : cursor);
+        }
+        s->types = (uint8_t)req->types;
+        s->interval = (uint16_t)interval;
+        s->expires = now + lease;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+// Moves up to max updates out of the wheel slot of tick, dropping the
+// entries that have expired by now (the current second; later than tick
+// when the pusher catches up) and scheduling the others an interval after
+// now. Returns the number of updates copied.
+static int take_due(uint32_t tick, uint32_t now, struct due_update *due, int max)
+{
+    int count = 0;
+    uint32_t *head = &wheel[tick & (SUBSCRIPTIONS_WHEEL_SLOTS - 1)];
+
+    pthread_mutex_lock(&lock);
+    uint32_t i = *head;
+    while (i != NONE && count < max)
+    {
+        struct subscription *s = &entries[i];
+        uint32_t next = s->next;
+
+        if (s->state == SUB_PENDING || s->expires <= now)
+        {
+            release(i);
+            stats.expired++;
+        }
+        else
+        {
+            due[count].client = s->client;
+            due[count].city_id = s->city_id;
+            due[count].types = s->types;
+            count++;
+            unschedule(i);
+            schedule(i, now + s->interval);
+        }
+        i = next;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+// Serializes the update of one subscription at timestamp
+static int build_update(const struct due_update *due, uint32_t timestamp, char *buffer)
+{
+    struct subscribe_update update;
+    update.city_id = due->city_id;
+    update.timestamp = timestamp;
+    update.count = 0;
+
+    for (int t = 0; t < SUBSCRIBE_MAX_TYPES; t++)
+    {
+        if (!(due->types & (1u << t)))
+            continue;
+        struct batch_result *r = &update.results[update.count++];
+        r->type = subscription_types[t];
+        r->value = 0.0f;
+        r->status = value_of(r->type, due->city_id, &r->value);
+    }
+
+    return serialize_subscribe_update(&update, buffer, UPDATE_MAX_SIZE);
+}
+
+struct pusher {
+    int sock;
+    int family;   // of sock
+};
+
+static void *pusher_main(void *arg)
+{
+    struct pusher *pusher = arg;
+    struct due_update *due = calloc(SUBSCRIPTIONS_SEND_BATCH, sizeof(struct due_update));
+    char (*buffers)[UPDATE_MAX_SIZE] = calloc(SUBSCRIPTIONS_SEND_BATCH, UPDATE_MAX_SIZE);
+    struct sockaddr_storage *peers = calloc(SUBSCRIPTIONS_SEND_BATCH, sizeof(struct sockaddr_storage));
+    int failed = (due == NULL || buffers == NULL || peers == NULL);
+#if defined __linux__
+    struct iovec *iovs = calloc(SUBSCRIPTIONS_SEND_BATCH, sizeof(struct iovec));
+    struct mmsghdr *msgs = calloc(SUBSCRIPTIONS_SEND_BATCH, sizeof(struct mmsghdr));
+    failed = failed || iovs == NULL || msgs == NULL;
+#endif
+    if (failed)
+    {
+        // Subscribers stop getting updates and their leases run out
+        printf("Avviso: invio degli aggiornamenti non disponibile\n");
+    }
+
+    while (!failed)
+    {
+        // Wake up at the next second, then catch up on every second since
+        // the last pass; a slot never holds more than one second's entries
+        uint64_t next = (now_ms() / 1000 + 1) * 1000;
+        struct timespec deadline = {(time_t)(next / 1000), 0};
+        pthread_mutex_lock(&lock);
+        while (!stopping && now_ms() < next)
+            pthread_cond_timedwait(&wake, &lock, &deadline);
+        if (stopping)
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        uint32_t second = (uint32_t)(now_ms() / 1000);
+        uint32_t from = cursor;
+        if (second - from >= SUBSCRIPTIONS_WHEEL_SLOTS)
+            from = second - (SUBSCRIPTIONS_WHEEL_SLOTS - 1);
+        cursor = second + 1;
+        pthread_mutex_unlock(&lock);
+
+        for (uint32_t tick = from; tick != second + 1; tick++)
+        {
+            int count;
+            while ((count = take_due(tick, second, due, SUBSCRIPTIONS_SEND_BATCH)) > 0)
+            {
+                int ready = 0;
+                for (int i = 0; i < count; i++)
+                {
+                    socklen_t peer_len = address_to_peer(&due[i].client, pusher->family, &peers[ready]);
+                    int len = build_update(&due[i], second, buffers[ready]);
+                    if (peer_len == 0 || len < 0)
+                        continue;
+#if defined __linux__
+                    iovs[ready].iov_base = buffers[ready];
+                    iovs[ready].iov_len = (size_t)len;
+                    memset(&msgs[ready].msg_hdr, 0, sizeof(struct msghdr));
+                    msgs[ready].msg_hdr.msg_name = &peers[ready];
+                    msgs[ready].msg_hdr.msg_namelen = peer_len;
+                    msgs[ready].msg_hdr.msg_iov = &iovs[ready];
+                    msgs[ready].msg_hdr.msg_iovlen = 1;
+#else
+                    sendto(pusher->sock, buffers[ready], len, 0,
+                           (struct sockaddr *)&peers[ready], peer_len);
+#endif
+                    ready++;
+                }
+
+#if defined __linux__
+                // sendmmsg may stop early: resend the tail, skipping a failing datagram
+                int sent = 0;
+                while (sent < ready)
+                {
+                    int n = sendmmsg(pusher->sock, msgs + sent, ready - sent, 0);
+                    sent += (n > 0) ? n : 1;
+                }
+#endif
+
+                pthread_mutex_lock(&lock);
+                stats.updates += (uint64_t)ready;
+                pthread_mutex_unlock(&lock);
+            }
+        }
+    }
+
+    free(due);
+    free(buffers);
+    free(peers);
+#if defined __linux__
+    free(iovs);
+    free(msgs);
+#endif
+    free(pusher);
+    return NULL;
+}
+
+void subscriptions_start(int sock)
+{
+    if (!subscriptions_enabled())
+        return;
+
+    struct pusher *pusher = malloc(sizeof(struct pusher));
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    if (pusher == NULL || getsockname(sock, (struct sockaddr *)&local, &local_len) < 0)
+    {
+        printf("Avviso: invio degli aggiornamenti non disponibile\n");
+        free(pusher);
+        return;
+    }
+    pusher->sock = sock;
+    pusher->family = local.ss_family;
+
+    if (pthread_create(&pusher_thread, NULL, pusher_main, pusher) != 0)
+    {
+        printf("Avviso: invio degli aggiornamenti non disponibile\n");
+        free(pusher);
+        return;
+    }
+    pusher_running = 1;
+}
+
+void subscriptions_stop(void)
+{
+    if (!pusher_running)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(pusher_thread, NULL);
+    pusher_running = 0;
+}
+
+void subscriptions_get_stats(struct subscriptions_stats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
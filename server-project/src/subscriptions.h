@@ -0,0 +1,59 @@
+/*
+ * subscriptions.h
+ *
+ * Periodic updates pushed to subscribed clients (-U option).
+ * Subscriptions live in a fixed pool indexed by (client, city) and are
+ * scheduled on a timer wheel with one-second slots: a background thread
+ * sends the updates due in each second with batched sends, and drops the
+ * subscriptions whose lease has run out.
+ */
+
+#ifndef SUBSCRIPTIONS_H_
+#define SUBSCRIPTIONS_H_
+
+#include <stdint.h>
+#include "address.h"
+#include "protocol.h"
+
+#define SUBSCRIPTIONS_WHEEL_SLOTS 4096   // one per second, power of two
+#define SUBSCRIPTIONS_MAX_INTERVAL 3600  // seconds, below the wheel size
+#define SUBSCRIPTIONS_MAX_LEASE 3600     // seconds granted at most per renewal
+#define SUBSCRIPTIONS_CONFIRM 10         // seconds to echo the cookie back
+#define SUBSCRIPTIONS_SEND_BATCH 256     // updates per sendmmsg
+
+struct subscriptions_stats {
+    uint64_t active;     // subscriptions being pushed now
+    uint64_t pending;    // waiting for the cookie to come back
+    uint64_t created;    // subscriptions confirmed
+    uint64_t expired;    // lease run out, or cookie never confirmed
+    uint64_t cancelled;  // cancelled by the client
+    uint64_t rejected;   // requests refused because the pool was full
+    uint64_t updates;    // update datagrams sent
+};
+
+// Value of a type for a city at push time: returns the status and stores
+// the value in *value
+typedef unsigned int (*subscription_value_fn)(char type, int city_id, float *value);
+
+// Allocates room for max_subscriptions subscriptions. 0 disables them.
+int subscriptions_init(int max_subscriptions, subscription_value_fn value);
+
+// Whether subscriptions_init() enabled them
+int subscriptions_enabled(void);
+
+// Starts the thread pushing updates from sock (the server socket, or the
+// first worker's); does nothing when subscriptions are disabled
+void subscriptions_start(int sock);
+
+// Stops the pushing thread and waits for it: call it before closing the
+// socket given to subscriptions_start()
+void subscriptions_stop(void);
+
+// Handles a subscription request for a supported city (see protocol.h for
+// the cookie exchange) and fills in the ack
+void subscriptions_request(const struct client_address *client, int city_id,
+                           const struct subscribe_request *req, struct subscribe_ack *ack);
+
+void subscriptions_get_stats(struct subscriptions_stats *stats);
+
+#endif /* SUBSCRIPTIONS_H_ */
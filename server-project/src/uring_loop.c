@@ -0,0 +1,568 @@
+/*
+ * uring_loop.c
+ *
+ * io_uring receive/send loop of the UDP server (-u option, Linux only).
+ *
+ * A single multishot recvmsg request stays armed on the socket and takes
+ * its buffers from a provided buffer ring, so the kernel keeps delivering
+ * datagrams without one submission per datagram. Every completion that
+ * is ready is processed in one pass; the replies are queued as sendmsg
+ * requests and submitted together with the wait for the next completions,
+ * so a busy loop costs one io_uring_enter() per batch instead of two
+ * syscalls per datagram.
+ *
+ * A timeout request completes every SERVER_POLL_MS to check for a stop.
+ * On a stop the multishot recvmsg is cancelled and the loop keeps reaping
+ * until its last completion and every reply in flight are done, so no
+ * datagram the kernel already handed to the ring is left unanswered.
+ *
+ * The ring is driven with raw syscalls (no liburing). serve_uring() returns
+ * -1 without serving when the kernel lacks any of the needed features, and
+ * the caller falls back to the classic loops.
+ */
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include "server.h"
+
+#if defined __linux__ && __has_include(<linux/io_uring.h>)
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "metrics.h"
+#include "signals.h"
+
+// IORING_RECV_MULTISHOT (Linux 6.0) implies buffer rings (5.19) as well
+#if defined IORING_RECV_MULTISHOT
+
+#define URING_BUFFERS 1024              // provided receive buffers (power of two)
+#define URING_SEND_SLOTS 1024           // replies in flight
+#define URING_BUFFER_GROUP 0
+#define URING_RECV_TAG UINT64_MAX       // user_data of the multishot recvmsg
+#define URING_TIMEOUT_TAG (UINT64_MAX - 1)
+#define URING_CANCEL_TAG (UINT64_MAX - 2)
+
+// io_uring_recvmsg_out, sender address, drop counter cmsg, then the datagram
+#define URING_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + \
+                           URING_CONTROL_SIZE + SERVER_DATAGRAM_SIZE)
+
+struct send_slot {
+    char buffer[SERVER_DATAGRAM_SIZE];
+    struct sockaddr_storage client_addr;
+    struct iovec iov;
+    struct msghdr msg;
+};
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+
+    // Submission queue
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int sq_local_tail;
+    unsigned int to_submit;
+
+    // Completion queue
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+
+    // Replies
+    struct send_slot *send_slots;
+    int *free_slots;
+    int free_count;
+
+    struct msghdr recv_msg;      // template of the multishot recvmsg
+    struct __kernel_timespec poll_timeout;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(struct uring *ring)
+{
+    if (ring->buffers != NULL)
+        munmap(ring->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring->buf_ring != NULL)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->send_slots);
+    free(ring->free_slots);
+}
+
+static int uring_open(struct uring *ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_BUFFERS + URING_SEND_SLOTS;
+#if defined IORING_SETUP_SINGLE_ISSUER && defined IORING_SETUP_COOP_TASKRUN
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+#endif
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0 && errno == EINVAL)
+    {
+        // Older kernel: retry without the optional flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_BUFFERS + URING_SEND_SLOTS;
+        ring->fd = uring_setup(entries, &params);
+    }
+    if (ring->fd < 0)
+        return -1;
+    ring->sq_entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        ring->sq_map = NULL;
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            ring->cq_map = NULL;
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Provided buffer ring: the descriptors, then the buffers themselves
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == MAP_FAILED)
+    {
+        if (ring->buf_ring == MAP_FAILED)
+            ring->buf_ring = NULL;
+        if (ring->buffers == MAP_FAILED)
+            ring->buffers = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    ring->send_slots = calloc(URING_SEND_SLOTS, sizeof(struct send_slot));
+    ring->free_slots = calloc(URING_SEND_SLOTS, sizeof(int));
+    if (ring->send_slots == NULL || ring->free_slots == NULL)
+        return -1;
+    for (int i = 0; i < URING_SEND_SLOTS; i++)
+    {
+        struct send_slot *slot = &ring->send_slots[i];
+        slot->iov.iov_base = slot->buffer;
+        slot->msg.msg_name = &slot->client_addr;
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        ring->free_slots[ring->free_count++] = i;
+    }
+
+    return 0;
+}
+
+// Hands buffer bid back to the kernel (published by uring_publish_buffers)
+static void uring_recycle_buffer(struct uring *ring, unsigned short bid)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static void uring_publish_buffers(struct uring *ring)
+{
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Next free SQE, or NULL if the submission queue is full
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+
+    unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// Submits the queued SQEs and waits for at least min_complete completions
+static int uring_submit(struct uring *ring, unsigned int min_complete)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = uring_enter(ring->fd, ring->to_submit, min_complete, flags);
+    if (ret < 0)
+        return (errno == EINTR) ? 0 : -1;
+    ring->to_submit -= (unsigned int)ret < ring->to_submit ? (unsigned int)ret : ring->to_submit;
+    return 0;
+}
+
+static int uring_arm_recv(struct uring *ring, int sock)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+    {
+        if (uring_submit(ring, 0) < 0 || (sqe = uring_get_sqe(ring)) == NULL)
+            return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECV_TAG;
+    return 0;
+}
+
+// Queues a request of no fd that only completes, with user_data tag
+static int uring_queue(struct uring *ring, unsigned char opcode, uint64_t addr, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+    {
+        if (uring_submit(ring, 0) < 0 || (sqe = uring_get_sqe(ring)) == NULL)
+            return -1;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = addr;
+    sqe->len = (opcode == IORING_OP_TIMEOUT) ? 1 : 0;
+    sqe->user_data = tag;
+    return 0;
+}
+
+// Pure timer: completes with -ETIME after SERVER_POLL_MS
+static int uring_arm_timeout(struct uring *ring)
+{
+    ring->poll_timeout.tv_sec = SERVER_POLL_MS / 1000;
+    ring->poll_timeout.tv_nsec = (long long)(SERVER_POLL_MS % 1000) * 1000000;
+    return uring_queue(ring, IORING_OP_TIMEOUT, (uint64_t)(uintptr_t)&ring->poll_timeout,
+                       URING_TIMEOUT_TAG);
+}
+
+static int uring_cancel_recv(struct uring *ring)
+{
+    return uring_queue(ring, IORING_OP_ASYNC_CANCEL, URING_RECV_TAG, URING_CANCEL_TAG);
+}
+
+static void uring_account_drops(struct io_uring_recvmsg_out *out, char *control)
+{
+#if defined SO_RXQ_OVFL
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = out->controllen;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            metrics_kernel_drops(drops);
+        }
+    }
+#else
+    (void)out;
+    (void)control;
+#endif
+}
+
+// Processes one received datagram and queues the reply
+static void uring_handle_datagram(struct uring *ring, int sock, const struct io_uring_cqe *cqe)
+{
+    unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    char *buf = ring->buffers + (size_t)bid * URING_BUFFER_SIZE;
+
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *name = buf + sizeof(*out);
+    char *control = name + ring->recv_msg.msg_namelen;
+    char *payload = control + ring->recv_msg.msg_controllen;
+
+    uring_account_drops(out, control);
+
+    if (!(out->flags & MSG_TRUNC) && ring->free_count > 0)
+    {
+        struct send_slot *slot = &ring->send_slots[ring->free_slots[--ring->free_count]];
+        memcpy(&slot->client_addr, name, sizeof(slot->client_addr));
+
+        int send_len = process_request(payload, (int)out->payloadlen,
+                                       &slot->client_addr, slot->buffer);
+        slot->iov.iov_len = (size_t)send_len;
+        slot->msg.msg_namelen = out->namelen;
+
+        struct io_uring_sqe *sqe = NULL;
+        if (send_len > 0)
+        {
+            sqe = uring_get_sqe(ring);
+            if (sqe == NULL && uring_submit(ring, 0) == 0)
+                sqe = uring_get_sqe(ring);
+            if (sqe == NULL)
+            {
+                // Submission queue still full: send it now and keep going
+                sendmsg(sock, &slot->msg, 0);
+            }
+        }
+
+        if (sqe == NULL)
+        {
+            // Sent already, or dropped without a reply
+            ring->free_slots[ring->free_count++] = (int)(slot - ring->send_slots);
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = sock;
+            sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+            sqe->len = 1;
+            sqe->user_data = (uint64_t)(slot - ring->send_slots);
+        }
+    }
+    else if (!(out->flags & MSG_TRUNC))
+    {
+        // Every reply slot is busy: answer synchronously
+        char send_buffer[SERVER_DATAGRAM_SIZE];
+        struct sockaddr_storage client_addr;
+        memcpy(&client_addr, name, sizeof(client_addr));
+        int send_len = process_request(payload, (int)out->payloadlen, &client_addr, send_buffer);
+        if (send_len > 0)
+            sendto(sock, send_buffer, send_len, 0, (struct sockaddr *)&client_addr, out->namelen);
+    }
+
+    uring_recycle_buffer(ring, bid);
+}
+
+int serve_uring(int sock)
+{
+    struct uring ring;
+    if (uring_open(&ring, URING_SEND_SLOTS) < 0)
+    {
+        uring_close(&ring);
+        return -1;
+    }
+
+    for (unsigned short bid = 0; bid < URING_BUFFERS; bid++)
+        uring_recycle_buffer(&ring, bid);
+    uring_publish_buffers(&ring);
+
+    // Only the sizes matter: the kernel lays out every buffer accordingly
+    ring.recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    ring.recv_msg.msg_controllen = URING_CONTROL_SIZE;
+
+    if (uring_arm_recv(&ring, sock) < 0 || uring_arm_timeout(&ring) < 0)
+    {
+        uring_close(&ring);
+        return -1;
+    }
+
+    int served = 0;
+    int recv_armed = 1;
+    int stopping = 0;
+    unsigned int recent = 0;   // datagrams since the last timeout
+    while (!stopping || recv_armed || ring.free_count < URING_SEND_SLOTS)
+    {
+        if (uring_submit(&ring, 1) < 0)
+        {
+            printf("Errore in io_uring_enter\n");
+            break;
+        }
+
+        int rearm = 0;
+        int rearm_timeout = 0;
+        int idle = 0;
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+            if (cqe->user_data == URING_TIMEOUT_TAG)
+            {
+                idle = (recent == 0);
+                recent = 0;
+                rearm_timeout = 1;
+                continue;
+            }
+            if (cqe->user_data == URING_CANCEL_TAG)
+                continue;
+
+            if (cqe->user_data != URING_RECV_TAG)
+            {
+                // A reply has been sent: its slot is free again
+                ring.free_slots[ring.free_count++] = (int)cqe->user_data;
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                rearm = 1;
+
+            if (cqe->res < 0)
+            {
+                // Multishot recvmsg or buffer rings not supported: nothing
+                // has been served yet, so the caller can still fall back
+                if (!served && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP))
+                {
+                    uring_close(&ring);
+                    return -1;
+                }
+                // -ENOBUFS: all buffers in use, re-armed below
+                continue;
+            }
+
+            uring_handle_datagram(&ring, sock, cqe);
+            served = 1;
+            recent++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        uring_publish_buffers(&ring);
+
+        if (!stopping && server_should_exit(idle))
+        {
+            stopping = 1;
+            if (!rearm && uring_cancel_recv(&ring) < 0)
+                break;
+        }
+
+        if (rearm && stopping)
+        {
+            recv_armed = 0;
+        }
+        else if (rearm && uring_arm_recv(&ring, sock) < 0)
+        {
+            printf("Errore nel riavvio della ricezione io_uring\n");
+            break;
+        }
+
+        if (rearm_timeout && !stopping && uring_arm_timeout(&ring) < 0)
+        {
+            printf("Errore nel riavvio del timeout io_uring\n");
+            break;
+        }
+    }
+
+    uring_close(&ring);
+    return 0;
+}
+
+#else
+
+int serve_uring(int sock)
+{
+    (void)sock;
+    return -1; // kernel headers without multishot recvmsg or buffer rings
+}
+
+#endif
+
+#else
+
+int serve_uring(int sock)
+{
+    (void)sock;
+    return -1; // io_uring is Linux only
+}
+
+#endif
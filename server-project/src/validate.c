@@ -0,0 +1,125 @@
+/*
+ * validate.c
+ *
+ * Request validation.
+ *
+ * The scalar path (contains_invalid_chars() in common/protocol.c) looks every
+ * byte up in char_class[] instead of running a chain of comparisons.
+ * validate_city_field() processes the fixed 64-byte city field with SIMD. The
+ * 28 forbidden characters form 8 byte ranges: each 16-byte SSE2 vector is
+ * classified with a handful of range tests, each 32-byte AVX2 vector with two
+ * nibble table lookups (vpshufb). The terminator position, the length and the
+ * invalid-character test all come out of the same two bit masks. The scan
+ * stops at the first vector holding a terminator or an invalid character, so
+ * a short name costs a single load.
+ */
+
+#include <stdint.h>
+#if defined __AVX2__ || defined __SSE2__
+#include <immintrin.h>
+#endif
+#include "validate.h"
+
+// Result of a vector at offset whose terminator or invalid-character mask
+// has a bit set: -1 if an invalid character comes before the first
+// terminator (there may be none in this vector), else the name length
+static inline int vector_result(uint32_t nul_mask, uint32_t bad_mask, int offset)
+{
+    if (bad_mask & ((nul_mask & (0 - nul_mask)) - 1))
+        return -1;
+    return offset + __builtin_ctz(nul_mask);
+}
+
+#if defined __AVX2__
+
+// Nibble classes of the forbidden characters: a byte is invalid when the
+// entries of its high and low nibble share a bit.
+//   0x01: '\t'                  high 0, low 9
+//   0x02: !"#$%&()*+/            high 2, low 1-6, 8-B, F
+//   0x04: :;<=>?                 high 3, low A-F
+//   0x08: @ `                    high 4 or 6, low 0
+//   0x10: [\]^ {|}~              high 5 or 7, low B-E
+// High nibbles 8-F map to 0, so bytes >= 0x80 are never invalid.
+static inline __m256i invalid_lanes32(__m256i v)
+{
+    const __m256i high_table = _mm256_setr_epi8(
+        0x01, 0, 0x02, 0x04, 0x08, 0x10, 0x08, 0x10, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0, 0x02, 0x04, 0x08, 0x10, 0x08, 0x10, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i low_table = _mm256_setr_epi8(
+        0x08, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0, 0x02, 0x03, 0x06, 0x16, 0x14, 0x14, 0x14, 0x06,
+        0x08, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0, 0x02, 0x03, 0x06, 0x16, 0x14, 0x14, 0x14, 0x06);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+    __m256i classes = _mm256_and_si256(high, low);
+    // 0xFF where classes != 0
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(classes, _mm256_setzero_si256()),
+                            _mm256_set1_epi8(-1));
+}
+
+int validate_city_field(const char *field)
+{
+    for (int i = 0; i < CITY_SIZE / 32; i++)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(field + i * 32));
+        uint32_t nul_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        uint32_t bad_mask = (uint32_t)_mm256_movemask_epi8(invalid_lanes32(v));
+        if (i == CITY_SIZE / 32 - 1)
+            nul_mask |= 1u << 31;   // byte 63 always ends the name
+        if (nul_mask | bad_mask)
+            return vector_result(nul_mask, bad_mask, i * 32);
+    }
+    return CITY_SIZE - 1;   // not reached: the last vector always ends the name
+}
+
+#elif defined __SSE2__
+
+// Byte-wise lo <= v <= hi (unsigned) as 0xFF/0x00 lanes
+#define RANGE16(v, lo, hi)                                           \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), \
+                                _mm_set1_epi8((hi) - (lo))),         \
+                   _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+
+static inline __m128i invalid_lanes16(__m128i v)
+{
+    __m128i bad = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+    bad = _mm_or_si128(bad, RANGE16(v, '!', '&'));
+    bad = _mm_or_si128(bad, RANGE16(v, '(', '+'));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    bad = _mm_or_si128(bad, RANGE16(v, ':', '@'));
+    bad = _mm_or_si128(bad, RANGE16(v, '[', '^'));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('`')));
+    bad = _mm_or_si128(bad, RANGE16(v, '{', '~'));
+    return bad;
+}
+
+int validate_city_field(const char *field)
+{
+    for (int i = 0; i < CITY_SIZE / 16; i++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(field + i * 16));
+        uint32_t nul_mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        uint32_t bad_mask = (uint32_t)_mm_movemask_epi8(invalid_lanes16(v));
+        if (i == CITY_SIZE / 16 - 1)
+            nul_mask |= 1u << 15;   // byte 63 always ends the name
+        if (nul_mask | bad_mask)
+            return vector_result(nul_mask, bad_mask, i * 16);
+    }
+    return CITY_SIZE - 1;   // not reached: the last vector always ends the name
+}
+
+#else
+
+int validate_city_field(const char *field)
+{
+    int len = 0;
+    for (; len < CITY_SIZE - 1 && field[len] != '\0'; len++)
+    {
+        if (char_class[(unsigned char)field[len]] & CHAR_INVALID)
+            return -1;
+    }
+    return len;
+}
+
+#endif
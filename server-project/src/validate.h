@@ -0,0 +1,20 @@
+/*
+ * validate.h
+ *
+ * Server-side request validation. validate_city_field() checks a whole
+ * received city field in one pass, with SSE2/AVX2 when the compiler
+ * targets them, and agrees with contains_invalid_chars() and the
+ * char_class[] table of protocol.h.
+ */
+
+#ifndef VALIDATE_H_
+#define VALIDATE_H_
+
+#include "protocol.h"
+
+// Checks the CITY_SIZE-byte city field of a request as received: the name
+// ends at the first '\0' or at byte CITY_SIZE - 1 (like deserialize_request).
+// Returns the name length, or -1 if it contains an invalid character.
+int validate_city_field(const char *field);
+
+#endif /* VALIDATE_H_ */
@@ -0,0 +1,418 @@
+/*
+ * weather_provider.c
+ *
+ * Weather value providers.
+ *
+ * Random values come from a xoshiro128** generator kept in thread-local
+ * storage and seeded per thread with splitmix64, so workers never share the
+ * global, locked state of rand().
+ *
+ * Observations are held in an immutable table published through an atomic
+ * pointer. The refresh thread builds a new table off to the side and swaps
+ * it in; readers just load the pointer, so they never block or see a half
+ * written table. Readers hold the table within a grace section (grace.h)
+ * and a replaced table is freed once every one of them has left. A table
+ * is only ever indexed by the IDs of the provider's catalog: a reloaded
+ * catalog comes with a new provider, swapped in together with it.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "weather_provider.h"
+#include "protocol.h"
+#include "grace.h"
+
+#define NUM_TYPES 4
+#define LINE_SIZE 256
+
+/*
+ * Per-thread generator
+ */
+
+static _Thread_local uint32_t rng_state[4];
+static _Thread_local int rng_seeded;
+static atomic_uint_fast64_t rng_streams;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void rng_seed(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    uint64_t seed = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    seed ^= (uint64_t)(uintptr_t)&rng_state;
+    seed += atomic_fetch_add(&rng_streams, 1) * 0xD1B54A32D192ED03ull;
+
+    uint64_t a = splitmix64(&seed);
+    uint64_t b = splitmix64(&seed);
+    rng_state[0] = (uint32_t)a;
+    rng_state[1] = (uint32_t)(a >> 32);
+    rng_state[2] = (uint32_t)b;
+    rng_state[3] = (uint32_t)(b >> 32) | 1; // never all zero
+    rng_seeded = 1;
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t xoshiro128ss(void)
+{
+    uint32_t *s = rng_state;
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+
+    return result;
+}
+
+float random_unit(void)
+{
+    if (!rng_seeded)
+        rng_seed();
+    // 24 random bits: every value is exactly representable as a float
+    return (float)(xoshiro128ss() >> 8) * (1.0f / 16777216.0f);
+}
+
+float get_temperature(void)
+{
+    return -10.0f + random_unit() * 50.0f;
+}
+
+float get_humidity(void)
+{
+    return 20.0f + random_unit() * 80.0f;
+}
+
+float get_wind(void)
+{
+    return random_unit() * 100.0f;
+}
+
+float get_pressure(void)
+{
+    return 950.0f + random_unit() * 100.0f;
+}
+
+static int type_slot(char type)
+{
+    switch (type)
+    {
+    case REQ_TEMPERATURE:
+        return 0;
+    case REQ_HUMIDITY:
+        return 1;
+    case REQ_WIND:
+        return 2;
+    case REQ_PRESSURE:
+        return 3;
+    }
+    return -1;
+}
+
+float provider_value(struct weather_provider *provider, int city_id, char type,
+                     const struct city_climate *climate)
+{
+    float value = 0.0f;
+    for (; provider != NULL; provider = provider->fallback)
+    {
+        if (provider->get(provider, city_id, type, climate, &value))
+            break;
+    }
+    return value;
+}
+
+void provider_close(struct weather_provider *provider)
+{
+    while (provider != NULL)
+    {
+        struct weather_provider *fallback = provider->fallback;
+        if (provider->close != NULL)
+            provider->close(provider);
+        provider = fallback;
+    }
+}
+
+/*
+ * Random provider
+ */
+
+static int random_get(struct weather_provider *provider, int city_id, char type,
+                      const struct city_climate *climate, float *value)
+{
+    (void)provider;
+    (void)city_id;
+
+    if (climate == NULL)
+    {
+        switch (type)
+        {
+        case REQ_TEMPERATURE:
+            *value = get_temperature();
+            break;
+        case REQ_HUMIDITY:
+            *value = get_humidity();
+            break;
+        case REQ_WIND:
+            *value = get_wind();
+            break;
+        default:
+            *value = get_pressure();
+            break;
+        }
+        return 1;
+    }
+
+    float r = random_unit();
+    switch (type)
+    {
+    case REQ_TEMPERATURE:
+        *value = climate->temp_min + r * (climate->temp_max - climate->temp_min);
+        break;
+    case REQ_HUMIDITY:
+        *value = climate->humidity_min + r * (climate->humidity_max - climate->humidity_min);
+        break;
+    case REQ_WIND:
+        *value = r * climate->wind_max;
+        break;
+    default:
+        *value = climate->pressure_min + r * (climate->pressure_max - climate->pressure_min);
+        break;
+    }
+    return 1;
+}
+
+struct weather_provider *provider_random(void)
+{
+    static struct weather_provider random_provider = {"random", random_get, NULL, NULL, NULL};
+    return &random_provider;
+}
+
+/*
+ * Observation provider
+ */
+
+struct observation {
+    float values[NUM_TYPES];
+    uint8_t known;            // bit i set if values[i] is valid
+};
+
+struct observation_table {
+    int count;                // catalog cities
+    struct observation cities[];
+};
+
+struct observation_state {
+    _Atomic(struct observation_table *) current;
+    pthread_mutex_t lock;                 // held by the refresh thread except while waiting
+    pthread_cond_t wake;                  // signalled to stop the refresh thread
+    int stopping;
+    pthread_t thread;
+    int refreshing;                       // whether thread was started
+    const char *path;
+    time_t mtime;
+    int refresh_seconds;
+    const struct city_catalog *catalog;
+};
+
+static struct observation_table *load_observations(const char *path, const struct city_catalog *catalog)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    int count = catalog_city_count(catalog);
+    struct observation_table *table = calloc(1, sizeof(struct observation_table) +
+                                                    (size_t)count * sizeof(struct observation));
+    if (table == NULL)
+    {
+        fclose(f);
+        return NULL;
+    }
+    table->count = count;
+
+    char line[LINE_SIZE];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *fields[1 + NUM_TYPES] = {NULL};
+        char *p = line;
+        int n = 0;
+        while (n < 1 + NUM_TYPES)
+        {
+            fields[n++] = p;
+            p = strchr(p, ',');
+            if (p == NULL)
+                break;
+            *p++ = '\0';
+        }
+        if (line[0] == '#' || n < 2)
+            continue;
+
+        int id = catalog_find(catalog, fields[0], strlen(fields[0]));
+        if (id < 0)
+            continue;
+
+        for (int t = 0; t < NUM_TYPES && t + 1 < n; t++)
+        {
+            char *end;
+            float v = strtof(fields[t + 1], &end);
+            if (end != fields[t + 1])
+            {
+                table->cities[id].values[t] = v;
+                table->cities[id].known |= (uint8_t)(1u << t);
+            }
+        }
+    }
+
+    fclose(f);
+    return table;
+}
+
+static int file_mtime(const char *path, time_t *mtime)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return -1;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+// Publishes table and frees the one it replaces once no reader holds it
+static void swap_table(struct observation_state *state, struct observation_table *table)
+{
+    struct observation_table *old = atomic_exchange(&state->current, table);
+    if (grace_wait() == 0)
+        free(old);
+}
+
+static void *refresh_main(void *arg)
+{
+    struct observation_state *state = arg;
+
+    pthread_mutex_lock(&state->lock);
+    while (!state->stopping)
+    {
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_sec += state->refresh_seconds;
+        int timed_out = 0;
+        while (!state->stopping && !timed_out)
+            timed_out = pthread_cond_timedwait(&state->wake, &state->lock, &deadline) != 0;
+        if (state->stopping)
+            break;
+
+        time_t mtime;
+        if (file_mtime(state->path, &mtime) < 0 || mtime == state->mtime)
+            continue;
+
+        struct observation_table *table = load_observations(state->path, state->catalog);
+        if (table != NULL)
+        {
+            swap_table(state, table);
+            state->mtime = mtime;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return NULL;
+}
+
+static int observation_get(struct weather_provider *provider, int city_id, char type,
+                           const struct city_climate *climate, float *value)
+{
+    (void)climate;
+    struct observation_state *state = provider->state;
+
+    grace_enter();
+    struct observation_table *table = atomic_load_explicit(&state->current, memory_order_acquire);
+
+    int slot = type_slot(type);
+    int known = slot >= 0 && city_id >= 0 && city_id < table->count &&
+                (table->cities[city_id].known & (1u << slot));
+    if (known)
+        *value = table->cities[city_id].values[slot];
+    grace_exit();
+    return known;
+}
+
+// Called once the set holding the provider has been retired and no reader
+// is left
+static void observation_close(struct weather_provider *provider)
+{
+    struct observation_state *state = provider->state;
+
+    if (state->refreshing)
+    {
+        pthread_mutex_lock(&state->lock);
+        state->stopping = 1;
+        pthread_cond_signal(&state->wake);
+        pthread_mutex_unlock(&state->lock);
+        pthread_join(state->thread, NULL);
+    }
+
+    free(atomic_load(&state->current));
+    pthread_cond_destroy(&state->wake);
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+    free(provider);
+}
+
+struct weather_provider *provider_observations(const char *path, int refresh_seconds,
+                                               const struct city_catalog *catalog,
+                                               struct weather_provider *fallback)
+{
+    struct observation_state *state = calloc(1, sizeof(struct observation_state));
+    struct weather_provider *provider = calloc(1, sizeof(struct weather_provider));
+    struct observation_table *table = load_observations(path, catalog);
+    if (state == NULL || provider == NULL || table == NULL)
+    {
+        printf("Errore nel caricamento delle osservazioni %s\n", path);
+        free(state);
+        free(provider);
+        free(table);
+        return NULL;
+    }
+
+    atomic_init(&state->current, table);
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->wake, NULL);
+    state->path = path;
+    state->refresh_seconds = (refresh_seconds > 0) ? refresh_seconds : OBSERVATION_REFRESH_DEFAULT;
+    state->catalog = catalog;
+    file_mtime(path, &state->mtime);
+
+    provider->name = "observations";
+    provider->get = observation_get;
+    provider->fallback = fallback;
+    provider->state = state;
+    provider->close = observation_close;
+
+    if (pthread_create(&state->thread, NULL, refresh_main, state) != 0)
+    {
+        printf("Avviso: aggiornamento delle osservazioni non disponibile\n");
+    }
+    else
+    {
+        state->refreshing = 1;
+    }
+
+    return provider;
+}
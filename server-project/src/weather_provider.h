@@ -0,0 +1,59 @@
+/*
+ * weather_provider.h
+ *
+ * Sources of weather values.
+ * A provider either knows the value of a (city, type) pair or defers to its
+ * fallback. The random provider always answers, using a per-thread
+ * xoshiro128** generator; the observation provider serves real values from
+ * a table reloaded in the background.
+ */
+
+#ifndef WEATHER_PROVIDER_H_
+#define WEATHER_PROVIDER_H_
+
+#include <stdint.h>
+#include "city_catalog.h"
+
+#define OBSERVATION_REFRESH_DEFAULT 60   // seconds between observation reloads
+
+struct weather_provider {
+    const char *name;
+    // Returns 1 and stores *value if known, 0 to defer to the fallback.
+    // climate is NULL when the catalog has no per-city ranges.
+    int (*get)(struct weather_provider *provider, int city_id, char type,
+               const struct city_climate *climate, float *value);
+    struct weather_provider *fallback;
+    void *state;
+    // Stops and frees the provider (not its fallback); NULL if it is static
+    void (*close)(struct weather_provider *provider);
+};
+
+// Asks provider, then its fallbacks, for a value
+float provider_value(struct weather_provider *provider, int city_id, char type,
+                     const struct city_climate *climate);
+
+// Closes provider and its fallbacks, once no thread can ask them anymore
+void provider_close(struct weather_provider *provider);
+
+// Uniform float in [0, 1) from the calling thread's generator
+float random_unit(void);
+
+// Random values in the climate ranges, or in the get_*() ranges
+struct weather_provider *provider_random(void);
+
+// Values from a CSV file "city,temperature,humidity,wind,pressure" (empty
+// fields are unknown), re-read every refresh_seconds if the file changed.
+// The table is indexed by the IDs of catalog, which must outlive the
+// provider: a reloaded catalog gets a provider of its own. Returns NULL if
+// the file cannot be loaded.
+struct weather_provider *provider_observations(const char *path, int refresh_seconds,
+                                               const struct city_catalog *catalog,
+                                               struct weather_provider *fallback);
+
+// Default value generators, drawing from random_unit()
+float get_temperature(void);
+float get_humidity(void);
+float get_wind(void);
+float get_pressure(void);
+
+#endif /* WEATHER_PROVIDER_H_ */
@@ -0,0 +1,114 @@
+/*
+ * workers.c
+ *
+ * Multi-core mode of the UDP server (-w option).
+ *
+ * Every worker thread serves its own socket bound to the same port with
+ * SO_REUSEPORT, so the kernel shards incoming datagrams across the workers
+ * by source address. The sockets are opened by main() beforehand, or taken
+ * over from the previous server (-x). Workers share no socket and no lock:
+ * each one runs the normal receive -> process_request -> send loop on its
+ * own socket.
+ */
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#if defined WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#define closesocket close
+#endif
+
+#include <pthread.h>
+#if defined __linux__
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include "server.h"
+#include "subscriptions.h"
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int sock;
+    const struct server_config *config;
+};
+
+static void pin_to_cpu(int id)
+{
+#if defined __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % cpus, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        printf("Worker %d: impossibile impostare l'affinità CPU\n", id);
+    }
+#else
+    (void)id;
+#endif
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    if (w->config->pin_cpus)
+        pin_to_cpu(w->id);
+
+    serve(w->sock, w->config);
+    return NULL;
+}
+
+int run_workers(const struct server_config *config, const int *socks)
+{
+    struct worker *workers = calloc(config->workers, sizeof(struct worker));
+    if (workers == NULL)
+    {
+        printf("Errore nell'allocazione dei worker\n");
+        for (int i = 0; i < config->workers; i++)
+            closesocket(socks[i]);
+        return 1;
+    }
+
+    for (int i = 0; i < config->workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].config = config;
+        workers[i].sock = socks[i];
+    }
+
+    // Updates go out from the first worker's socket: same port, so they
+    // come from the address clients subscribed to
+    subscriptions_start(workers[0].sock);
+
+    int started = 0;
+    for (; started < config->workers; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0)
+        {
+            printf("Errore nella creazione del worker %d\n", started);
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    // The pusher may still be sending from the first socket
+    subscriptions_stop();
+    for (int i = 0; i < config->workers; i++)
+        closesocket(workers[i].sock);
+
+    free(workers);
+    return started == config->workers ? 0 : 1;
+}
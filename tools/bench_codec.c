@@ -0,0 +1,389 @@
+/*
+ * bench_codec.c
+ *
+ * Encode/decode time of the shared protocol codec (common/protocol.c).
+ *
+ * The legacy 65/9-byte messages are timed in two versions:
+ *
+ *   original  the functions each program used to carry, out of line, with
+ *             a running offset advanced field by field
+ *   inline    the static inline codec of protocol.h, with fixed offsets
+ *
+ * next to the compact format (city by name, by ID, and by ID with a
+ * half-precision value), and the batch and history messages through the
+ * shared functions, per message and per query or sample. Before timing,
+ * the two legacy versions are checked to produce the same bytes and the
+ * same decoded fields.
+ *
+ * gcc -O2 -Icommon tools/bench_codec.c common/protocol.c -o bench_codec
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "protocol.h"
+
+#define ITERATIONS 20000000
+#define MESSAGE_ITERATIONS 200000
+
+/*
+ * original: the codec as it was copied into the client and the server
+ */
+
+__attribute__((noinline)) static int original_serialize_request(const struct request *req, char *buffer)
+{
+    int offset = 0;
+
+    // Type (1 byte)
+    memcpy(buffer + offset, &req->type, sizeof(char));
+    offset += sizeof(char);
+
+    // City (64 bytes)
+    memcpy(buffer + offset, req->city, CITY_SIZE);
+    offset += CITY_SIZE;
+
+    return offset;
+}
+
+__attribute__((noinline)) static int original_deserialize_request(const char *buffer, struct request *req)
+{
+    int offset = 0;
+
+    // Type (1 byte)
+    memcpy(&req->type, buffer + offset, sizeof(char));
+    offset += sizeof(char);
+
+    // City (64 bytes)
+    memcpy(req->city, buffer + offset, CITY_SIZE);
+    req->city[CITY_SIZE - 1] = '\0'; // Ensure null-termination
+    offset += CITY_SIZE;
+
+    return offset;
+}
+
+__attribute__((noinline)) static int original_serialize_response(const struct response *resp, char *buffer)
+{
+    int offset = 0;
+
+    // Status (4 bytes with network byte order)
+    uint32_t net_status = htonl(resp->status);
+    memcpy(buffer + offset, &net_status, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    // Type (1 byte, no conversion needed)
+    memcpy(buffer + offset, &resp->type, sizeof(char));
+    offset += sizeof(char);
+
+    // Value (float with network byte order)
+    uint32_t temp;
+    memcpy(&temp, &resp->value, sizeof(float));
+    temp = htonl(temp);
+    memcpy(buffer + offset, &temp, sizeof(float));
+    offset += sizeof(float);
+
+    return offset;
+}
+
+__attribute__((noinline)) static int original_deserialize_response(const char *buffer, struct response *resp)
+{
+    int offset = 0;
+
+    // Status (4 bytes)
+    uint32_t net_status;
+    memcpy(&net_status, buffer + offset, sizeof(uint32_t));
+    resp->status = ntohl(net_status);
+    offset += sizeof(uint32_t);
+
+    // Type (1 byte)
+    memcpy(&resp->type, buffer + offset, sizeof(char));
+    offset += sizeof(char);
+
+    // Value (float with network byte order)
+    uint32_t temp;
+    memcpy(&temp, buffer + offset, sizeof(float));
+    temp = ntohl(temp);
+    memcpy(&resp->value, &temp, sizeof(float));
+    offset += sizeof(float);
+
+    return offset;
+}
+
+/*
+ * One client/server round of a legacy exchange: the request is encoded and
+ * decoded, the response is encoded and decoded
+ */
+
+static int original_round(const struct request *req, const struct response *resp,
+                          struct request *req_out, struct response *resp_out)
+{
+    char request_buffer[REQUEST_BUFFER_SIZE];
+    char response_buffer[RESPONSE_BUFFER_SIZE];
+    int len = original_serialize_request(req, request_buffer);
+    len += original_deserialize_request(request_buffer, req_out);
+    len += original_serialize_response(resp, response_buffer);
+    len += original_deserialize_response(response_buffer, resp_out);
+    return len;
+}
+
+static int inline_round(const struct request *req, const struct response *resp,
+                        struct request *req_out, struct response *resp_out)
+{
+    char request_buffer[REQUEST_BUFFER_SIZE];
+    char response_buffer[RESPONSE_BUFFER_SIZE];
+    int len = serialize_request(req, request_buffer);
+    len += deserialize_request(request_buffer, req_out);
+    len += serialize_response(resp, response_buffer);
+    len += deserialize_response(response_buffer, resp_out);
+    return len;
+}
+
+typedef int (*round_fn)(const struct request *, const struct response *,
+                        struct request *, struct response *);
+
+#define CORPUS 64
+
+static struct request requests[CORPUS];
+static struct response responses[CORPUS];
+
+static int cross_check(void)
+{
+    for (int i = 0; i < CORPUS; i++)
+    {
+        char a[REQUEST_BUFFER_SIZE], b[REQUEST_BUFFER_SIZE];
+        char c[RESPONSE_BUFFER_SIZE], d[RESPONSE_BUFFER_SIZE];
+        struct request ra, rb;
+        struct response sa, sb;
+
+        if (original_serialize_request(&requests[i], a) != serialize_request(&requests[i], b) ||
+            memcmp(a, b, sizeof(a)) != 0 ||
+            original_serialize_response(&responses[i], c) != serialize_response(&responses[i], d) ||
+            memcmp(c, d, sizeof(c)) != 0)
+        {
+            printf("Mismatch encoding message %d\n", i);
+            return -1;
+        }
+
+        original_deserialize_request(a, &ra);
+        deserialize_request(a, &rb);
+        original_deserialize_response(c, &sa);
+        deserialize_response(c, &sb);
+        if (ra.type != rb.type || memcmp(ra.city, rb.city, CITY_SIZE) != 0 ||
+            sa.status != sb.status || sa.type != sb.type ||
+            memcmp(&sa.value, &sb.value, sizeof(float)) != 0)
+        {
+            printf("Mismatch decoding message %d\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_legacy(const char *name, round_fn fn)
+{
+    struct request req_out;
+    struct response resp_out;
+    volatile int sink = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(requests), "r"(responses) : "memory");
+        sink += fn(&requests[i % CORPUS], &responses[i % CORPUS], &req_out, &resp_out);
+        sink += resp_out.type;
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-18s %12.2f %12s %10d\n", name, elapsed / ITERATIONS, "-",
+           (int)(REQUEST_BUFFER_SIZE + RESPONSE_BUFFER_SIZE));
+}
+
+static struct compact_request compact_requests[CORPUS];
+static struct compact_response compact_responses[CORPUS];
+
+// One compact exchange; returns the bytes on the wire
+static int compact_round(const struct compact_request *req, const struct compact_response *resp,
+                         struct compact_request *req_out, struct compact_response *resp_out)
+{
+    char request_buffer[COMPACT_MAX_REQUEST];
+    char response_buffer[COMPACT_MAX_RESPONSE];
+    int request_len = serialize_compact_request(req, request_buffer, sizeof(request_buffer));
+    deserialize_compact_request(request_buffer, request_len, req_out);
+    int response_len = serialize_compact_response(resp, response_buffer, sizeof(response_buffer));
+    deserialize_compact_response(response_buffer, response_len, resp_out);
+    return request_len + response_len;
+}
+
+static void bench_compact(const char *name, int by_id, unsigned int flags)
+{
+    struct compact_request req_out;
+    struct compact_response resp_out;
+    volatile int sink = 0;
+    unsigned long bytes = 0;
+
+    for (int i = 0; i < CORPUS; i++)
+    {
+        compact_requests[i].flags = flags;
+        compact_requests[i].id = (uint32_t)i;
+        compact_requests[i].query.type = requests[i].type;
+        compact_requests[i].query.city_id = by_id ? i % 8 : -1;
+        memcpy(compact_requests[i].query.city, requests[i].city, CITY_SIZE);
+        compact_responses[i].flags = flags;
+        compact_responses[i].id = (uint32_t)i;
+        compact_responses[i].resp = responses[i];
+        bytes += (unsigned long)compact_round(&compact_requests[i], &compact_responses[i],
+                                              &req_out, &resp_out);
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(compact_requests), "r"(compact_responses) : "memory");
+        sink += compact_round(&compact_requests[i % CORPUS], &compact_responses[i % CORPUS],
+                              &req_out, &resp_out);
+        sink += resp_out.resp.type;
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-18s %12.2f %12s %10.1f\n", name, elapsed / ITERATIONS, "-", (double)bytes / CORPUS);
+}
+
+static void report(const char *name, double elapsed, unsigned int items)
+{
+    printf("%-18s %12.2f %12.2f\n", name, elapsed / MESSAGE_ITERATIONS,
+           elapsed / MESSAGE_ITERATIONS / items);
+}
+
+static void bench_batch(void)
+{
+    static struct batch_request req, req_out;
+    static struct batch_response resp, resp_out;
+    char buffer[BATCH_MAX_DATAGRAM];
+    volatile int sink = 0;
+
+    // A full datagram of queries, half by name and half by ID
+    req.count = 100;
+    req.max_response = BATCH_MAX_DATAGRAM;
+    for (unsigned int i = 0; i < req.count; i++)
+    {
+        req.queries[i].type = "thwp"[i % 4];
+        req.queries[i].city_id = (i % 2) ? (int)i : -1;
+        strcpy(req.queries[i].city, requests[i % CORPUS].city);
+    }
+    resp.count = BATCH_MAX_QUERIES;
+    for (unsigned int i = 0; i < resp.count; i++)
+        resp.results[i] = (struct batch_result){i % 3, "thwp"[i % 4], (float)i * 0.1f};
+
+    double start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(&req) : "memory");
+        sink += serialize_batch_request(&req, buffer, sizeof(buffer));
+    }
+    report("batch req encode", now_ns() - start, req.count);
+
+    int len = serialize_batch_request(&req, buffer, sizeof(buffer));
+    start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(buffer) : "memory");
+        sink += deserialize_batch_request(buffer, len, &req_out);
+    }
+    report("batch req decode", now_ns() - start, req.count);
+
+    start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(&resp) : "memory");
+        sink += serialize_batch_response(&resp, buffer, sizeof(buffer));
+    }
+    report("batch resp encode", now_ns() - start, resp.count);
+
+    len = serialize_batch_response(&resp, buffer, sizeof(buffer));
+    start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(buffer) : "memory");
+        sink += deserialize_batch_response(buffer, len, &resp_out);
+    }
+    report("batch resp decode", now_ns() - start, resp.count);
+}
+
+static void bench_history(void)
+{
+    static struct history_response resp, resp_out;
+    char buffer[BATCH_MAX_DATAGRAM];
+    volatile int sink = 0;
+
+    // One sample a second of a slowly changing value
+    resp.status = STATUS_SUCCESS;
+    resp.type = 't';
+    resp.count = 1000;
+    float value = 20.0f;
+    for (unsigned int i = 0; i < resp.count; i++)
+    {
+        resp.timestamps[i] = 1700000000u + i;
+        if (i % 10 == 0)
+            value += (float)(rand() % 5 - 2) * 0.1f;
+        resp.values[i] = value;
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(&resp) : "memory");
+        sink += serialize_history_response(&resp, buffer, sizeof(buffer));
+    }
+    int len = serialize_history_response(&resp, buffer, sizeof(buffer));
+    deserialize_history_response(buffer, len, &resp_out);
+    report("history encode", now_ns() - start, resp_out.count);
+
+    start = now_ns();
+    for (int i = 0; i < MESSAGE_ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(buffer) : "memory");
+        sink += deserialize_history_response(buffer, len, &resp_out);
+    }
+    report("history decode", now_ns() - start, resp_out.count);
+    printf("\n%u samples in %d bytes\n", resp_out.count, len);
+}
+
+int main(void)
+{
+    static const char *cities[] = {
+        "bari", "Roma", "MILANO", "napoli", "venezia", "gotham", "San Giovanni in Fiore", "firenze",
+    };
+
+    srand(1);
+    for (int i = 0; i < CORPUS; i++)
+    {
+        requests[i].type = "thwpx"[rand() % 5];
+        memset(requests[i].city, 0, CITY_SIZE);
+        strcpy(requests[i].city, cities[i % 8]);
+        responses[i].status = (unsigned int)(rand() % 3);
+        responses[i].type = requests[i].type;
+        responses[i].value = (float)(rand() % 2000) / 10.0f - 50.0f;
+    }
+
+    if (cross_check() < 0)
+        return 1;
+    printf("Cross-check OK\n\n");
+
+    printf("%-18s %12s %12s %10s\n", "codec", "ns/message", "ns/item", "bytes");
+    bench_legacy("legacy original", original_round);
+    bench_legacy("legacy inline", inline_round);
+    bench_compact("compact name", 0, 0);
+    bench_compact("compact id", 1, 0);
+    bench_compact("compact id half", 1, COMPACT_HALF);
+    bench_batch();
+    bench_history();
+    return 0;
+}
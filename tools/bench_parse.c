@@ -0,0 +1,261 @@
+/*
+ * bench_parse.c
+ *
+ * Bytes copied and time per legacy request along three versions of the
+ * server's request path:
+ *
+ *   original  deserialize_request() into a struct request, strncpy() into
+ *             city_lower for is_city_supported(), linear strcmp() scan
+ *   struct    deserialize_request(), then the fused validation and the
+ *             hash index; the log record takes the whole 64-byte field
+ *   view      type and city read in place from the receive buffer, the
+ *             log record takes only the name
+ *
+ * Every copy goes through COPY(), which counts its bytes; the 9 response
+ * bytes written into the send buffer are output, not copies, and are not
+ * counted. Before timing, the three paths are checked to produce the same
+ * response bytes and the same logged city for a corpus of requests.
+ *
+ * gcc -O2 -Iserver-project/src tools/bench_parse.c server-project/src/validate.c \
+ *     server-project/src/city_index.c common/protocol.c -o bench_parse
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "protocol.h"
+#include "validate.h"
+#include "city_index.h"
+
+#define ITERATIONS 5000000
+#define NUM_CITIES 10
+
+static const char *supported_cities[NUM_CITIES] = {
+    "bari", "roma", "milano", "napoli", "torino",
+    "palermo", "genova", "bologna", "firenze", "venezia"};
+
+static struct city_index *index_;
+static unsigned long long copied;
+
+#define COPY(dst, src, n)           \
+    do                              \
+    {                               \
+        memcpy((dst), (src), (n));  \
+        copied += (n);              \
+    } while (0)
+
+// Stand-in for the log ring record
+static char log_city[CITY_SIZE];
+
+// Deterministic stand-in for the weather providers
+static float city_value(char type, int city_id)
+{
+    return (float)city_id * 10.0f + (float)(unsigned char)type;
+}
+
+// deserialize_request() of protocol.h, with its copies counted
+static int counted_deserialize_request(const char *buffer, struct request *req)
+{
+    COPY(&req->type, buffer, sizeof(char));
+    COPY(req->city, buffer + sizeof(char), CITY_SIZE);
+    req->city[CITY_SIZE - 1] = '\0';
+    return sizeof(char) + CITY_SIZE;
+}
+
+/*
+ * original: the request handling of the first version of the server
+ */
+
+static int original_city_id(const char *city)
+{
+    char city_lower[CITY_SIZE];
+    size_t len = strnlen(city, CITY_SIZE - 1);
+    COPY(city_lower, city, len);
+    city_lower[len] = '\0';
+    for (int i = 0; city_lower[i]; i++)
+        city_lower[i] = (char)tolower((unsigned char)city_lower[i]);
+
+    for (int i = 0; i < NUM_CITIES; i++)
+    {
+        if (strcmp(city_lower, supported_cities[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int original_path(const char *recv_buffer, char *send_buffer)
+{
+    struct request req;
+    counted_deserialize_request(recv_buffer, &req);
+
+    struct response resp;
+    resp.type = req.type;
+    resp.value = 0.0f;
+    int id = -1;
+    if (!is_valid_request_type(req.type) || contains_invalid_chars(req.city))
+        resp.status = STATUS_INVALID_REQUEST;
+    else if ((id = original_city_id(req.city)) < 0)
+        resp.status = STATUS_CITY_NOT_FOUND;
+    else
+    {
+        resp.status = STATUS_SUCCESS;
+        resp.value = city_value(req.type, id);
+    }
+
+    // The first server printed req.city directly; kept for the cross-check
+    // only and not counted
+    strcpy(log_city, req.city);
+    return serialize_response(&resp, send_buffer);
+}
+
+/*
+ * struct: deserialize_request(), then validate_city_field() and the index
+ */
+
+static void answer(char type, const char *city, struct response *resp)
+{
+    resp->type = type;
+    resp->value = 0.0f;
+    resp->status = STATUS_SUCCESS;
+
+    int id = -1;
+    if (!is_valid_request_type(type))
+    {
+        resp->status = STATUS_INVALID_REQUEST;
+    }
+    else
+    {
+        int len = validate_city_field(city);
+        if (len < 0)
+            resp->status = STATUS_INVALID_REQUEST;
+        else
+            id = city_index_find(index_, city, (size_t)len);
+    }
+    if (resp->status == STATUS_SUCCESS && id < 0)
+        resp->status = STATUS_CITY_NOT_FOUND;
+    if (resp->status == STATUS_SUCCESS)
+        resp->value = city_value(type, id);
+}
+
+static int struct_path(const char *recv_buffer, char *send_buffer)
+{
+    struct request req;
+    counted_deserialize_request(recv_buffer, &req);
+
+    struct response resp;
+    answer(req.type, req.city, &resp);
+
+    COPY(log_city, req.city, CITY_SIZE);
+    return serialize_response(&resp, send_buffer);
+}
+
+/*
+ * view: parsed in place, as process_single() does now
+ */
+
+static int view_path(const char *recv_buffer, char *send_buffer)
+{
+    char type = recv_buffer[0];
+    const char *city = recv_buffer + sizeof(char);
+
+    struct response resp;
+    answer(type, city, &resp);
+
+    size_t len = strnlen(city, CITY_SIZE - 1);
+    COPY(log_city, city, len);
+    log_city[len] = '\0';
+    return serialize_response(&resp, send_buffer);
+}
+
+typedef int (*path_fn)(const char *, char *);
+
+static int cross_check(char corpus[][BATCH_MAX_DATAGRAM], int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        char out[3][RESPONSE_BUFFER_SIZE];
+        char logged[3][CITY_SIZE];
+        path_fn paths[3] = {original_path, struct_path, view_path};
+        for (int p = 0; p < 3; p++)
+        {
+            paths[p](corpus[i], out[p]);
+            memcpy(logged[p], log_city, CITY_SIZE);
+        }
+        for (int p = 1; p < 3; p++)
+        {
+            if (memcmp(out[0], out[p], RESPONSE_BUFFER_SIZE) != 0 ||
+                strcmp(logged[0], logged[p]) != 0)
+            {
+                printf("Mismatch on request %d (path %d)\n", i, p);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(const char *name, path_fn fn, char corpus[][BATCH_MAX_DATAGRAM], int count)
+{
+    char send_buffer[RESPONSE_BUFFER_SIZE];
+    volatile int sink = 0;
+
+    copied = 0;
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        __asm__ volatile("" : : "r"(corpus) : "memory");
+        sink += fn(corpus[i % count], send_buffer);
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-10s %14.1f %12.2f\n", name, (double)copied / ITERATIONS, elapsed / ITERATIONS);
+}
+
+int main(void)
+{
+    index_ = city_index_create(NUM_CITIES);
+    for (int i = 0; i < NUM_CITIES; i++)
+        city_index_add(index_, supported_cities[i], strlen(supported_cities[i]), i);
+
+    // Receive slots as the server sees them: full-size buffers
+    static const char *requests[] = {
+        "tbari", "hRoma", "wMILANO", "pnapoli", "tvenezia", "tgotham",
+        "hba@ri", "xbari", "tSan Giovanni in Fiore", "pfirenze",
+    };
+    enum { COUNT = sizeof(requests) / sizeof(requests[0]) };
+    static char corpus[COUNT][BATCH_MAX_DATAGRAM];
+    for (int i = 0; i < COUNT; i++)
+        strncpy(corpus[i], requests[i], REQUEST_BUFFER_SIZE);
+
+    if (cross_check(corpus, COUNT) < 0)
+        return 1;
+
+    // A field without terminator and random bytes must agree as well
+    static char noise[1000][BATCH_MAX_DATAGRAM];
+    srand(1);
+    for (int i = 0; i < 1000; i++)
+    {
+        noise[i][0] = "thwpx"[rand() % 5];
+        for (size_t j = 1; j < REQUEST_BUFFER_SIZE; j++)
+            noise[i][j] = (char)(rand() % 3 ? "bariomlnpz"[rand() % 10] : rand() % 256);
+    }
+    if (cross_check(noise, 1000) < 0)
+        return 1;
+    printf("Cross-check OK\n\n");
+
+    printf("%-10s %14s %12s\n", "path", "bytes copied", "ns/request");
+    bench("original", original_path, corpus, COUNT);
+    bench("struct", struct_path, corpus, COUNT);
+    bench("view", view_path, corpus, COUNT);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * catalog_compile.c
+ *
+ * Compiles a CSV list of cities into the binary catalog loaded by the
+ * server with -c (layout in server-project/src/catalog_format.h).
+ *
+ * Usage: catalog_compile <input.csv> <output.bin>
+ *
+ * One city per line:
+ *   name,temp_min,temp_max,humidity_min,humidity_max,wind_max,pressure_min,pressure_max[,alias|alias...]
+ * Empty lines and lines starting with '#' are skipped. A name or alias
+ * that repeats an earlier one (ignoring ASCII case) is an error, since the
+ * server could not tell which city it means.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../server-project/src/catalog_format.h"
+
+#define CITY_SIZE 64
+#define LINE_SIZE 1024
+#define NUM_CLIMATE_FIELDS 7
+
+struct city_row {
+    float climate[NUM_CLIMATE_FIELDS];
+    uint32_t first_name;   // canonical name, followed by the aliases
+};
+
+struct name_row {
+    uint32_t string;
+    uint32_t city;
+    uint16_t length;
+    int line;              // input row, for error messages
+};
+
+static struct city_row *cities;
+static struct name_row *names;
+static char *strings;
+static uint32_t city_count, city_cap;
+static uint32_t name_count, name_cap;
+static uint32_t strings_len, strings_cap;
+static uint32_t *seen;          // hash set of names: name index + 1, 0 = empty
+static uint32_t seen_mask;
+
+static void *grow(void *array, uint32_t *cap, size_t item)
+{
+    *cap = (*cap == 0) ? 64 : *cap * 2;
+    void *p = realloc(array, (size_t)*cap * item);
+    if (p == NULL)
+    {
+        printf("Memoria esaurita\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char *trim(char *s)
+{
+    while (*s == ' ' || *s == '\t')
+        s++;
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' ||
+                       s[len - 1] == '\r' || s[len - 1] == '\n'))
+        s[--len] = '\0';
+    return s;
+}
+
+// ASCII only, like the server's index: other bytes must match exactly
+static char fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)fold(name[i])) * 16777619u;
+    return h;
+}
+
+// Slot of name in the set: the one holding it, or the empty one to put it in
+static uint32_t *find_seen(const char *name, size_t len)
+{
+    uint32_t slot = hash_name(name, len) & seen_mask;
+    while (seen[slot] != 0)
+    {
+        const struct name_row *row = &names[seen[slot] - 1];
+        if (row->length == len)
+        {
+            size_t i = 0;
+            while (i < len && fold(strings[row->string + i]) == fold(name[i]))
+                i++;
+            if (i == len)
+                break;
+        }
+        slot = (slot + 1) & seen_mask;
+    }
+    return &seen[slot];
+}
+
+// Keeps the set at most half full
+static void grow_seen(void)
+{
+    if (seen != NULL && (name_count + 1) * 2 <= seen_mask + 1)
+        return;
+
+    free(seen);
+    uint32_t size = (seen == NULL) ? 128 : (seen_mask + 1) * 2;
+    seen = calloc(size, sizeof(uint32_t));
+    if (seen == NULL)
+    {
+        printf("Memoria esaurita\n");
+        exit(1);
+    }
+    seen_mask = size - 1;
+    for (uint32_t i = 0; i < name_count; i++)
+        *find_seen(strings + names[i].string, names[i].length) = i + 1;
+}
+
+static int add_name(const char *name, uint32_t city, int line)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len >= CITY_SIZE)
+    {
+        printf("Riga %d: nome '%s' vuoto o più lungo di %d caratteri\n", line, name, CITY_SIZE - 1);
+        return -1;
+    }
+
+    grow_seen();
+    uint32_t *slot = find_seen(name, len);
+    if (*slot != 0)
+    {
+        printf("Riga %d: nome '%s' già presente alla riga %d\n", line, name, names[*slot - 1].line);
+        return -1;
+    }
+
+    if (name_count == name_cap)
+        names = grow(names, &name_cap, sizeof(struct name_row));
+    while (strings_len + len > strings_cap)
+        strings = grow(strings, &strings_cap, 1);
+
+    names[name_count].string = strings_len;
+    names[name_count].city = city;
+    names[name_count].length = (uint16_t)len;
+    names[name_count].line = line;
+    name_count++;
+    *slot = name_count;
+
+    memcpy(strings + strings_len, name, len);
+    strings_len += (uint32_t)len;
+    return 0;
+}
+
+static int parse_line(char *line, int line_no)
+{
+    char *fields[NUM_CLIMATE_FIELDS + 2];
+    int count = 0;
+
+    for (char *p = line; count < NUM_CLIMATE_FIELDS + 2; count++)
+    {
+        fields[count] = p;
+        p = strchr(p, ',');
+        if (p == NULL)
+        {
+            count++;
+            break;
+        }
+        *p++ = '\0';
+    }
+
+    if (count < NUM_CLIMATE_FIELDS + 1)
+    {
+        printf("Riga %d: attesi nome e %d valori climatici\n", line_no, NUM_CLIMATE_FIELDS);
+        return -1;
+    }
+
+    if (city_count == city_cap)
+        cities = grow(cities, &city_cap, sizeof(struct city_row));
+    struct city_row *city = &cities[city_count];
+
+    for (int i = 0; i < NUM_CLIMATE_FIELDS; i++)
+    {
+        char *end;
+        city->climate[i] = strtof(trim(fields[i + 1]), &end);
+        if (*end != '\0')
+        {
+            printf("Riga %d: valore '%s' non numerico\n", line_no, fields[i + 1]);
+            return -1;
+        }
+    }
+
+    city->first_name = name_count;
+    if (add_name(trim(fields[0]), city_count, line_no) < 0)
+        return -1;
+
+    if (count == NUM_CLIMATE_FIELDS + 2)
+    {
+        for (char *alias = strtok(fields[NUM_CLIMATE_FIELDS + 1], "|"); alias != NULL;
+             alias = strtok(NULL, "|"))
+        {
+            char *name = trim(alias);
+            if (*name != '\0' && add_name(name, city_count, line_no) < 0)
+                return -1;
+        }
+    }
+
+    city_count++;
+    return 0;
+}
+
+static int write_catalog(const char *path)
+{
+    uint32_t cities_off = CATALOG_HEADER_SIZE;
+    uint32_t names_off = cities_off + city_count * CATALOG_CITY_SIZE;
+    uint32_t strings_off = names_off + name_count * CATALOG_NAME_SIZE;
+    uint32_t file_size = strings_off + strings_len;
+
+    unsigned char *out = calloc(1, file_size);
+    if (out == NULL)
+    {
+        printf("Memoria esaurita\n");
+        return -1;
+    }
+
+    memcpy(out + CATALOG_OFF_MAGIC, CATALOG_MAGIC, 4);
+    catalog_put_u32(out + CATALOG_OFF_VERSION, CATALOG_VERSION);
+    catalog_put_u32(out + CATALOG_OFF_CITY_COUNT, city_count);
+    catalog_put_u32(out + CATALOG_OFF_NAME_COUNT, name_count);
+    catalog_put_u32(out + CATALOG_OFF_CITIES, cities_off);
+    catalog_put_u32(out + CATALOG_OFF_NAMES, names_off);
+    catalog_put_u32(out + CATALOG_OFF_STRINGS, strings_off);
+    catalog_put_u32(out + CATALOG_OFF_FILE_SIZE, file_size);
+
+    static const int climate_offsets[NUM_CLIMATE_FIELDS] = {
+        CATALOG_CITY_TEMP_MIN, CATALOG_CITY_TEMP_MAX,
+        CATALOG_CITY_HUMIDITY_MIN, CATALOG_CITY_HUMIDITY_MAX,
+        CATALOG_CITY_WIND_MAX,
+        CATALOG_CITY_PRESSURE_MIN, CATALOG_CITY_PRESSURE_MAX};
+
+    for (uint32_t i = 0; i < city_count; i++)
+    {
+        unsigned char *rec = out + cities_off + i * CATALOG_CITY_SIZE;
+        catalog_put_u32(rec + CATALOG_CITY_NAME, cities[i].first_name);
+        for (int f = 0; f < NUM_CLIMATE_FIELDS; f++)
+            catalog_put_float(rec + climate_offsets[f], cities[i].climate[f]);
+    }
+
+    for (uint32_t i = 0; i < name_count; i++)
+    {
+        unsigned char *rec = out + names_off + i * CATALOG_NAME_SIZE;
+        catalog_put_u32(rec + CATALOG_NAME_STRING, names[i].string);
+        catalog_put_u32(rec + CATALOG_NAME_CITY, names[i].city);
+        catalog_put_u16(rec + CATALOG_NAME_LENGTH, names[i].length);
+    }
+
+    memcpy(out + strings_off, strings, strings_len);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(out, 1, file_size, f) != file_size)
+    {
+        printf("Errore nella scrittura di %s\n", path);
+        if (f != NULL)
+            fclose(f);
+        free(out);
+        return -1;
+    }
+
+    fclose(f);
+    free(out);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        printf("Uso: %s <input.csv> <output.bin>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "r");
+    if (in == NULL)
+    {
+        printf("Errore nell'apertura di %s\n", argv[1]);
+        return 1;
+    }
+
+    char line[LINE_SIZE];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        line_no++;
+        char *p = trim(line);
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (parse_line(p, line_no) < 0)
+        {
+            fclose(in);
+            return 1;
+        }
+    }
+    fclose(in);
+
+    if (city_count == 0)
+    {
+        printf("Nessuna città in %s\n", argv[1]);
+        return 1;
+    }
+
+    if (write_catalog(argv[2]) < 0)
+        return 1;
+
+    printf("Catalogo %s: %u città, %u nomi\n", argv[2], (unsigned int)city_count, (unsigned int)name_count);
+    return 0;
+}
@@ -0,0 +1,535 @@
+/*
+ * fuzz_protocol.c
+ *
+ * Fuzz harness for the shared protocol codec (common/protocol.c).
+ *
+ * Every input is handed to each deserializer. None may read past the
+ * input (run under AddressSanitizer to catch it), and whatever one accepts
+ * must survive a round trip: serializing it and decoding the result gives
+ * back the same message, and serializing that again gives the same bytes.
+ * The validation helpers run on the input as a string as well.
+ *
+ * With libFuzzer (clang):
+ *   clang -O1 -g -fsanitize=fuzzer,address,undefined -DFUZZ_WITH_LIBFUZZER \
+ *       -Icommon tools/fuzz_protocol.c common/protocol.c -o fuzz_protocol
+ *   ./fuzz_protocol corpus/
+ * Without it, a built-in driver mutates valid messages and random bytes:
+ *   gcc -O1 -g -fsanitize=address,undefined -Icommon tools/fuzz_protocol.c \
+ *       common/protocol.c -o fuzz_protocol
+ *   ./fuzz_protocol [iterations] [file...]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+static void fail(const char *what, const uint8_t *data, size_t size)
+{
+    printf("Errore: %s (input di %zu byte)\n", what, size);
+    FILE *f = fopen("fuzz_crash.bin", "wb");
+    if (f != NULL)
+    {
+        fwrite(data, 1, size, f);
+        fclose(f);
+        printf("Input salvato in fuzz_crash.bin\n");
+    }
+    fflush(stdout);
+    abort();
+}
+
+// Decoded messages compare field by field: structs have padding and the
+// unused tail of a city name is not part of the message
+static int same_query(const struct batch_query *a, const struct batch_query *b)
+{
+    if (a->type != b->type || a->city_id != b->city_id)
+        return 0;
+    return a->city_id >= 0 || strcmp(a->city, b->city) == 0;
+}
+
+static void check_batch_request(const uint8_t *data, size_t size)
+{
+    static struct batch_request first, second;
+    static char buffer[2][BATCH_MAX_DATAGRAM * 2];
+
+    if (deserialize_batch_request((const char *)data, (int)size, &first) < 0)
+        return;
+
+    // A name with an embedded '\0' is cut there: compare names as strings
+    int len = serialize_batch_request(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0)
+        return; // e.g. a name cut to nothing by an embedded '\0'
+    // The decoder stops after the last query, before any padding byte
+    int used = deserialize_batch_request(buffer[0], len, &second);
+    if (used < len - 1 || second.count != first.count)
+        fail("richiesta batch non decodificabile dopo la codifica", data, size);
+    for (unsigned int i = 0; i < first.count; i++)
+    {
+        if (!same_query(&first.queries[i], &second.queries[i]))
+            fail("richiesta batch diversa dopo il giro completo", data, size);
+    }
+    if (serialize_batch_request(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica batch non stabile", data, size);
+}
+
+static void check_batch_response(const uint8_t *data, size_t size)
+{
+    static struct batch_response first, second;
+    static char buffer[BATCH_MAX_DATAGRAM * 2];
+
+    int consumed = deserialize_batch_response((const char *)data, (int)size, &first);
+    if (consumed < 0)
+        return;
+
+    // Every field has a single encoding: the bytes must come back unchanged
+    int len = serialize_batch_response(&first, buffer, sizeof(buffer));
+    if (len != consumed || memcmp(buffer, data, (size_t)len) != 0)
+        fail("risposta batch diversa dopo la codifica", data, size);
+    if (deserialize_batch_response(buffer, len, &second) != len || second.count != first.count)
+        fail("risposta batch non decodificabile dopo la codifica", data, size);
+    for (unsigned int i = 0; i < first.count; i++)
+    {
+        // Status travels in one byte
+        if ((first.results[i].status & 0xFF) != second.results[i].status ||
+            first.results[i].type != second.results[i].type ||
+            memcmp(&first.results[i].value, &second.results[i].value, sizeof(float)) != 0)
+            fail("risposta batch diversa dopo il giro completo", data, size);
+    }
+}
+
+static void check_history_request(const uint8_t *data, size_t size)
+{
+    static struct history_request first, second;
+    static char buffer[2][BATCH_MAX_DATAGRAM];
+
+    if (deserialize_history_request((const char *)data, (int)size, &first) < 0)
+        return;
+
+    int len = serialize_history_request(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0)
+        return;
+    if (deserialize_history_request(buffer[0], len, &second) != len ||
+        first.from != second.from || first.to != second.to ||
+        first.max_response != second.max_response ||
+        !same_query(&first.query, &second.query))
+        fail("richiesta di storico diversa dopo il giro completo", data, size);
+    if (serialize_history_request(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica dello storico non stabile", data, size);
+}
+
+static void check_history_response(const uint8_t *data, size_t size)
+{
+    static struct history_response first, second;
+    static char buffer[BATCH_MAX_DATAGRAM * 4];
+
+    if (deserialize_history_response((const char *)data, (int)size, &first) < 0)
+        return;
+
+    // The encoder may choose other XOR windows than the input did, so the
+    // bytes can differ; the samples it keeps must not
+    int len = serialize_history_response(&first, buffer, sizeof(buffer));
+    if (len < 0 || deserialize_history_response(buffer, len, &second) != len)
+        fail("risposta di storico non decodificabile dopo la codifica", data, size);
+    if (second.count > first.count ||
+        (second.count < first.count && second.next != first.timestamps[second.count]) ||
+        (second.count == first.count && second.next != first.next))
+        fail("continuazione dello storico errata", data, size);
+    for (unsigned int i = 0; i < second.count; i++)
+    {
+        if (first.timestamps[i] != second.timestamps[i] ||
+            memcmp(&first.values[i], &second.values[i], sizeof(float)) != 0)
+            fail("campioni dello storico diversi dopo il giro completo", data, size);
+    }
+}
+
+static void check_compact_request(const uint8_t *data, size_t size)
+{
+    struct compact_request first, second;
+    char buffer[2][COMPACT_MAX_REQUEST];
+
+    if (deserialize_compact_request((const char *)data, (int)size, &first) < 0)
+        return;
+
+    int len = serialize_compact_request(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0)
+        return; // a name cut to nothing by an embedded '\0'
+    int used = deserialize_compact_request(buffer[0], len, &second);
+    if (used < len - 1 || first.flags != second.flags || first.id != second.id ||
+        !same_query(&first.query, &second.query))
+        fail("richiesta compatta diversa dopo il giro completo", data, size);
+    if (serialize_compact_request(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica compatta non stabile", data, size);
+}
+
+static void check_compact_response(const uint8_t *data, size_t size)
+{
+    struct compact_response first, second;
+    char buffer[2][COMPACT_MAX_RESPONSE];
+
+    if (deserialize_compact_response((const char *)data, (int)size, &first) < 0)
+        return;
+
+    // A NaN may come back with another payload, so compare the bytes of
+    // the second encoding with the first rather than with the input
+    int len = serialize_compact_response(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0 || deserialize_compact_response(buffer[0], len, &second) != len ||
+        first.flags != second.flags || first.id != second.id ||
+        first.resp.status != second.resp.status || first.resp.type != second.resp.type)
+        fail("risposta compatta diversa dopo il giro completo", data, size);
+    if (serialize_compact_response(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica compatta della risposta non stabile", data, size);
+}
+
+static void check_subscribe_request(const uint8_t *data, size_t size)
+{
+    struct subscribe_request first, second;
+    char buffer[2][BATCH_MAX_DATAGRAM];
+
+    if (deserialize_subscribe_request((const char *)data, (int)size, &first) < 0)
+        return;
+
+    int len = serialize_subscribe_request(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0)
+        return; // a name cut to nothing by an embedded '\0'
+    int used = deserialize_subscribe_request(buffer[0], len, &second);
+    if (used < len - 1 || first.types != second.types || first.interval != second.interval ||
+        first.lease != second.lease || first.cookie != second.cookie ||
+        first.city_id != second.city_id || strcmp(first.city, second.city) != 0)
+        fail("sottoscrizione diversa dopo il giro completo", data, size);
+    if (serialize_subscribe_request(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica della sottoscrizione non stabile", data, size);
+}
+
+static void check_subscribe_ack(const uint8_t *data, size_t size)
+{
+    struct subscribe_ack first, second;
+    char buffer[SUBSCRIBE_ACK_SIZE];
+
+    if (deserialize_subscribe_ack((const char *)data, (int)size, &first) < 0)
+        return;
+
+    int len = serialize_subscribe_ack(&first, buffer, sizeof(buffer));
+    if (len != SUBSCRIBE_ACK_SIZE || memcmp(buffer, data, SUBSCRIBE_ACK_SIZE) != 0 ||
+        deserialize_subscribe_ack(buffer, len, &second) != len ||
+        memcmp(&first, &second, sizeof(first)) != 0)
+        fail("conferma della sottoscrizione diversa dopo il giro completo", data, size);
+}
+
+static void check_subscribe_update(const uint8_t *data, size_t size)
+{
+    struct subscribe_update first, second;
+    char buffer[2][SUBSCRIBE_UPDATE_HEADER_SIZE + SUBSCRIBE_MAX_TYPES * BATCH_RESULT_SIZE];
+
+    if (deserialize_subscribe_update((const char *)data, (int)size, &first) < 0)
+        return;
+
+    int len = serialize_subscribe_update(&first, buffer[0], sizeof(buffer[0]));
+    if (len < 0 || deserialize_subscribe_update(buffer[0], len, &second) != len ||
+        first.city_id != second.city_id || first.timestamp != second.timestamp ||
+        first.count != second.count)
+        fail("aggiornamento diverso dopo il giro completo", data, size);
+    if (serialize_subscribe_update(&second, buffer[1], sizeof(buffer[1])) != len ||
+        memcmp(buffer[0], buffer[1], (size_t)len) != 0)
+        fail("codifica dell'aggiornamento non stabile", data, size);
+}
+
+static void check_fixed(const uint8_t *data, size_t size)
+{
+    // The fixed-size decoders read exactly their message size
+    static char buffer[REQUEST_WITH_ID_SIZE];
+    struct request req;
+    struct response resp;
+    uint32_t id;
+
+    if (size >= REQUEST_BUFFER_SIZE)
+    {
+        memcpy(buffer, data, REQUEST_BUFFER_SIZE);
+        deserialize_request(buffer, &req);
+        if (serialize_request(&req, buffer) != (int)REQUEST_BUFFER_SIZE ||
+            memcmp(buffer, data, REQUEST_BUFFER_SIZE - 1) != 0)
+            fail("richiesta classica diversa dopo il giro completo", data, size);
+    }
+    if (size >= RESPONSE_WITH_ID_SIZE)
+    {
+        memcpy(buffer, data, RESPONSE_WITH_ID_SIZE);
+        deserialize_response(buffer, &resp);
+        deserialize_request_id(buffer + RESPONSE_BUFFER_SIZE, &id);
+        serialize_response(&resp, buffer);
+        serialize_request_id(id, buffer + RESPONSE_BUFFER_SIZE);
+        if (memcmp(buffer, data, RESPONSE_WITH_ID_SIZE) != 0)
+            fail("risposta classica diversa dopo il giro completo", data, size);
+    }
+}
+
+static void check_strings(const uint8_t *data, size_t size)
+{
+    char city[CITY_SIZE];
+    size_t len = (size < CITY_SIZE - 1) ? size : CITY_SIZE - 1;
+    memcpy(city, data, len);
+    city[len] = '\0';
+
+    int invalid = contains_invalid_chars(city);
+    for (size_t i = 0; i < strlen(city); i++)
+    {
+        if (char_class[(unsigned char)city[i]] & CHAR_INVALID)
+        {
+            if (!invalid)
+                fail("carattere non valido non rilevato", data, size);
+            break;
+        }
+    }
+    if (size > 0)
+        is_valid_request_type((char)data[0]);
+    to_lowercase(city);
+    capitalize_city(city);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > BATCH_MAX_DATAGRAM * 2)
+        return 0;
+
+    check_fixed(data, size);
+    check_batch_request(data, size);
+    check_batch_response(data, size);
+    check_history_request(data, size);
+    check_history_response(data, size);
+    check_compact_request(data, size);
+    check_compact_response(data, size);
+    check_subscribe_request(data, size);
+    check_subscribe_ack(data, size);
+    check_subscribe_update(data, size);
+    check_strings(data, size);
+    return 0;
+}
+
+#if !defined FUZZ_WITH_LIBFUZZER
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static void random_query(struct batch_query *q)
+{
+    static const char types[] = "thwpx";
+    q->type = types[next_random() % 5];
+    if (next_random() % 3 == 0)
+    {
+        q->city_id = (int)(next_random() % 70000);
+        q->city[0] = '\0';
+        return;
+    }
+    q->city_id = -1;
+    memset(q->city, 0, CITY_SIZE);
+    int len = 1 + (int)(next_random() % (CITY_SIZE - 1));
+    for (int i = 0; i < len; i++)
+        q->city[i] = (char)(' ' + next_random() % 95);
+}
+
+// A valid message of a random kind, as a starting point for mutations
+static int valid_message(char *buffer, int size)
+{
+    static struct batch_request breq;
+    static struct batch_response bresp;
+    static struct history_request hreq;
+    static struct history_response hresp;
+    struct compact_request creq;
+    struct compact_response cresp;
+    struct subscribe_request sreq;
+    struct subscribe_ack sack;
+    struct subscribe_update supd;
+
+    switch (next_random() % 9)
+    {
+    case 0:
+        breq.count = next_random() % 40;
+        breq.max_response = next_random() % 2000;
+        for (unsigned int i = 0; i < breq.count; i++)
+            random_query(&breq.queries[i]);
+        return serialize_batch_request(&breq, buffer, size);
+    case 1:
+        bresp.count = next_random() % BATCH_MAX_QUERIES;
+        for (unsigned int i = 0; i < bresp.count; i++)
+        {
+            bresp.results[i].status = next_random() % 3;
+            bresp.results[i].type = "thwp"[next_random() % 4];
+            bresp.results[i].value = (float)(next_random() % 20000) / 10.0f - 500.0f;
+        }
+        return serialize_batch_response(&bresp, buffer, size);
+    case 2:
+        hreq.max_response = next_random() % 2000;
+        hreq.from = next_random();
+        hreq.to = next_random();
+        random_query(&hreq.query);
+        return serialize_history_request(&hreq, buffer, size);
+    case 3:
+        creq.flags = next_random() & (COMPACT_HALF | COMPACT_ID);
+        creq.id = next_random();
+        random_query(&creq.query);
+        return serialize_compact_request(&creq, buffer, size);
+    case 4:
+        cresp.flags = next_random() & (COMPACT_HALF | COMPACT_ID);
+        cresp.id = next_random();
+        cresp.resp.status = next_random() % 3;
+        cresp.resp.type = "thwpx"[next_random() % 5];
+        cresp.resp.value = (float)(next_random() % 20000) / 10.0f - 500.0f;
+        return serialize_compact_response(&cresp, buffer, size);
+    case 5:
+    {
+        struct batch_query q;
+        random_query(&q);
+        sreq.types = 1 + next_random() % 15;
+        sreq.interval = next_random() % 70000;
+        sreq.lease = next_random() % 70000;
+        sreq.cookie = next_random();
+        sreq.city_id = q.city_id;
+        memcpy(sreq.city, q.city, CITY_SIZE);
+        return serialize_subscribe_request(&sreq, buffer, size);
+    }
+    case 6:
+        sack.status = next_random() % 4;
+        sack.city_id = (int)(next_random() % 0x10000) - 1;
+        sack.interval = next_random() % 0x10000;
+        sack.lease = next_random() % 0x10000;
+        sack.cookie = next_random();
+        return serialize_subscribe_ack(&sack, buffer, size);
+    case 7:
+        supd.city_id = (int)(next_random() % 0x10000);
+        supd.timestamp = next_random();
+        supd.count = next_random() % (SUBSCRIBE_MAX_TYPES + 1);
+        for (unsigned int i = 0; i < supd.count; i++)
+        {
+            supd.results[i].status = next_random() % 3;
+            supd.results[i].type = "thwp"[i];
+            supd.results[i].value = (float)(next_random() % 20000) / 10.0f - 500.0f;
+        }
+        return serialize_subscribe_update(&supd, buffer, size);
+    default:
+    {
+        hresp.status = next_random() % 3;
+        hresp.type = "thwp"[next_random() % 4];
+        hresp.count = next_random() % 2000;
+        hresp.next = next_random();
+        uint32_t timestamp = next_random();
+        float value = 20.0f;
+        for (unsigned int i = 0; i < hresp.count; i++)
+        {
+            timestamp += (next_random() % 8 == 0) ? next_random() % 5000 : 60;
+            if (next_random() % 4 == 0)
+                value += (float)((int)(next_random() % 21) - 10) / 10.0f;
+            hresp.timestamps[i] = timestamp;
+            hresp.values[i] = value;
+        }
+        return serialize_history_response(&hresp, buffer, size);
+    }
+    }
+}
+
+static void mutate(uint8_t *data, size_t *size, size_t capacity)
+{
+    int mutations = 1 + (int)(next_random() % 8);
+    for (int m = 0; m < mutations && *size > 0; m++)
+    {
+        size_t at = next_random() % *size;
+        switch (next_random() % 4)
+        {
+        case 0:
+            data[at] ^= (uint8_t)(1u << (next_random() % 8));
+            break;
+        case 1:
+            data[at] = (uint8_t)next_random();
+            break;
+        case 2:
+            *size = at; // truncate
+            break;
+        default:
+            if (*size < capacity)
+                data[(*size)++] = (uint8_t)next_random();
+            break;
+        }
+    }
+}
+
+static int replay_file(const char *path)
+{
+    static uint8_t data[BATCH_MAX_DATAGRAM * 2];
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        printf("Errore nell'apertura del file %s\n", path);
+        return -1;
+    }
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+    int first_file = 1;
+    if (argc > 1 && strspn(argv[1], "0123456789") == strlen(argv[1]))
+    {
+        iterations = atol(argv[1]);
+        first_file = 2;
+    }
+
+    // Given files are replayed instead of fuzzing
+    if (argc > first_file)
+    {
+        for (int i = first_file; i < argc; i++)
+        {
+            if (replay_file(argv[i]) < 0)
+                return 1;
+        }
+        printf("%d file verificati\n", argc - first_file);
+        return 0;
+    }
+
+    static uint8_t data[BATCH_MAX_DATAGRAM * 2];
+    for (long i = 0; i < iterations; i++)
+    {
+        size_t size;
+        if (next_random() % 4 == 0)
+        {
+            // Random bytes, often with a valid magic and version
+            size = next_random() % sizeof(data);
+            for (size_t j = 0; j < size; j++)
+                data[j] = (uint8_t)next_random();
+            if (size >= 2 && next_random() % 2 == 0)
+            {
+                data[0] = (next_random() % 2) ? BATCH_MAGIC : HISTORY_MAGIC;
+                data[1] = 1;
+            }
+        }
+        else
+        {
+            int len = valid_message((char *)data, BATCH_MAX_DATAGRAM);
+            size = (len > 0) ? (size_t)len : 0;
+            LLVMFuzzerTestOneInput(data, size); // the valid message itself
+            mutate(data, &size, sizeof(data));
+        }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    printf("%ld iterazioni senza errori\n", iterations);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,579 @@
+/*
+ * loadgen.c
+ *
+ * Load generator for the UDP weather server.
+ *
+ * Requests are drawn from a weighted scenario file and sent with the request
+ * ID trailer (or, with -C, in the compact format with its request ID), so
+ * replies are matched to their request whatever their order.
+ * In open-loop mode (-r) requests leave on a fixed schedule and latency is
+ * measured from the scheduled send time, so a stalled server is charged for
+ * the requests it delayed instead of hiding them (coordinated omission).
+ * In closed-loop mode a fixed number of requests (-c) is kept in flight and
+ * each reply immediately triggers the next request.
+ *
+ * Latencies go into a log-linear histogram in the style of HdrHistogram:
+ * every power of two is split into 2^(SUB_BITS - 1) linear buckets, so any
+ * recorded value is reported within 1% in constant memory.
+ *
+ * gcc -O2 -Iclient-project/src tools/loadgen.c common/protocol.c -o loadgen
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define MAX_ENTRIES 1024
+#define MAX_SLOTS 65536              // requests in flight (power of two)
+#define DEFAULT_REQUESTS 100000
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_TIMEOUT_MS 1000
+
+#define SUB_BITS 8                   // 128 linear buckets per power of two
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAGNITUDES (64 - SUB_BITS)
+
+/*
+ * Histogram
+ */
+
+struct histogram {
+    uint64_t counts[MAGNITUDES][SUB_COUNT];
+    uint64_t total;
+    uint64_t max;
+};
+
+static void hist_record(struct histogram *h, uint64_t value)
+{
+    int magnitude = 0;
+    if (value >= SUB_COUNT)
+        magnitude = 64 - __builtin_clzll(value) - SUB_BITS;
+    h->counts[magnitude][(value >> magnitude) & (SUB_COUNT - 1)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+// Highest value that falls in the bucket
+static uint64_t bucket_top(int magnitude, int sub)
+{
+    return (((uint64_t)sub + 1) << magnitude) - 1;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double percentile)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int m = 0; m < MAGNITUDES; m++)
+    {
+        // Sub-buckets below SUB_COUNT / 2 only exist for magnitude 0
+        for (int s = (m == 0) ? 0 : SUB_COUNT / 2; s < SUB_COUNT; s++)
+        {
+            seen += h->counts[m][s];
+            if (seen >= rank)
+            {
+                uint64_t top = bucket_top(m, s);
+                return (top < h->max) ? top : h->max;
+            }
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Scenario
+ */
+
+struct entry {
+    unsigned int weight;
+    int expected;              // expected status, -1 = any
+    struct request req;
+};
+
+struct scenario {
+    struct entry entries[MAX_ENTRIES];
+    unsigned long cumulative[MAX_ENTRIES];
+    int count;
+    unsigned long total_weight;
+};
+
+static int parse_status(const char *s)
+{
+    if (strcmp(s, "ok") == 0)
+        return STATUS_SUCCESS;
+    if (strcmp(s, "notfound") == 0)
+        return STATUS_CITY_NOT_FOUND;
+    if (strcmp(s, "invalid") == 0)
+        return STATUS_INVALID_REQUEST;
+    if (strcmp(s, "any") == 0)
+        return -1;
+    return -2;
+}
+
+// Lines "weight outcome type city", outcome one of ok, notfound, invalid, any
+static int load_scenario(const char *path, struct scenario *sc)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        printf("Errore nell'apertura dello scenario %s\n", path);
+        return -1;
+    }
+
+    char line[BUFFER_SIZE];
+    int line_no = 0;
+    sc->count = 0;
+    sc->total_weight = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        char outcome[16];
+        char type;
+        unsigned int weight;
+        int city_start = 0;
+        if (sscanf(line, "%u %15s %c %n", &weight, outcome, &type, &city_start) < 3 ||
+            city_start == 0 || parse_status(outcome) == -2 || sc->count == MAX_ENTRIES ||
+            strlen(line + city_start) >= CITY_SIZE)
+        {
+            printf("Errore nello scenario %s alla riga %d\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+
+        struct entry *e = &sc->entries[sc->count];
+        memset(e, 0, sizeof(*e));
+        e->weight = weight;
+        e->expected = parse_status(outcome);
+        e->req.type = type;
+        strncpy(e->req.city, line + city_start, CITY_SIZE - 1);
+
+        sc->total_weight += weight;
+        sc->cumulative[sc->count++] = sc->total_weight;
+    }
+
+    fclose(f);
+    if (sc->total_weight == 0)
+    {
+        printf("Errore: lo scenario %s non contiene richieste\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static int pick_entry(const struct scenario *sc)
+{
+    unsigned long r = (unsigned long)(next_random() % sc->total_weight);
+    int lo = 0, hi = sc->count - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (sc->cumulative[mid] > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/*
+ * Load loop
+ */
+
+struct slot {
+    int in_use;
+    uint32_t id;
+    int entry;
+    uint64_t start_ns;         // scheduled (open loop) or actual send time
+};
+
+struct results {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t unexpected;       // status differs from the scenario
+    uint64_t late;             // replies after the timeout
+    uint64_t errors;           // send failures
+    uint64_t bytes_sent;       // UDP payload
+    uint64_t bytes_received;
+    struct histogram latency;  // nanoseconds
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct slot slots[MAX_SLOTS];
+static struct results results;
+static uint64_t outstanding;     // slots in use
+static uint64_t last_reply_ns;
+static unsigned int compact;     // -C: compact format, with these flags
+
+static void send_one(int sock, const struct sockaddr_storage *server, const struct scenario *sc,
+                     uint32_t id, uint64_t start_ns)
+{
+    struct slot *s = &slots[id & (MAX_SLOTS - 1)];
+    if (s->in_use)
+    {
+        // The request that held the slot has been outstanding far too long
+        results.lost++;
+        outstanding--;
+    }
+
+    s->in_use = 1;
+    s->id = id;
+    s->entry = pick_entry(sc);
+    s->start_ns = start_ns;
+
+    char buffer[COMPACT_MAX_REQUEST];
+    const struct request *req = &sc->entries[s->entry].req;
+    int len;
+    if (compact)
+    {
+        struct compact_request creq;
+        creq.flags = compact;
+        creq.id = id;
+        creq.query.type = req->type;
+        creq.query.city_id = -1;
+        memcpy(creq.query.city, req->city, CITY_SIZE);
+        len = serialize_compact_request(&creq, buffer, sizeof(buffer));
+    }
+    else
+    {
+        len = serialize_request(req, buffer);
+        len += serialize_request_id(id, buffer + len);
+    }
+
+    results.sent++;
+    results.bytes_sent += (uint64_t)len;
+    socklen_t server_len = (server->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6)
+                                                          : sizeof(struct sockaddr_in);
+    if (len < 0 || sendto(sock, buffer, len, 0, (const struct sockaddr *)server, server_len) < 0)
+    {
+        results.errors++;
+        s->in_use = 0;
+        return;
+    }
+    outstanding++;
+}
+
+static void receive_one(const char *buffer, int len, const struct scenario *sc, uint64_t timeout_ns)
+{
+    struct response resp;
+    uint32_t id;
+    if (compact)
+    {
+        struct compact_response cresp;
+        if (deserialize_compact_response(buffer, len, &cresp) < 0 || !(cresp.flags & COMPACT_ID))
+            return;
+        resp = cresp.resp;
+        id = cresp.id;
+    }
+    else
+    {
+        if (len != (int)RESPONSE_WITH_ID_SIZE)
+            return;
+        deserialize_response(buffer, &resp);
+        deserialize_request_id(buffer + RESPONSE_BUFFER_SIZE, &id);
+    }
+    results.bytes_received += (uint64_t)len;
+
+    struct slot *s = &slots[id & (MAX_SLOTS - 1)];
+    if (!s->in_use || s->id != id)
+    {
+        results.late++;
+        return;
+    }
+    s->in_use = 0;
+    outstanding--;
+
+    last_reply_ns = now_ns();
+    uint64_t latency = last_reply_ns - s->start_ns;
+    if (latency > timeout_ns)
+    {
+        results.lost++;
+        results.late++;
+        return;
+    }
+
+    int expected = sc->entries[s->entry].expected;
+    if (expected >= 0 && resp.status != (unsigned int)expected)
+        results.unexpected++;
+
+    results.received++;
+    hist_record(&results.latency, latency);
+}
+
+// Counts as lost the requests outstanding for longer than the timeout
+static void expire(uint64_t now, uint64_t timeout_ns)
+{
+    for (int i = 0; i < MAX_SLOTS && outstanding > 0; i++)
+    {
+        if (slots[i].in_use && now - slots[i].start_ns > timeout_ns)
+        {
+            slots[i].in_use = 0;
+            outstanding--;
+            results.lost++;
+        }
+    }
+}
+
+// Handles the replies that arrive within wait_ms
+static void drain(int sock, const struct scenario *sc, uint64_t timeout_ns, int wait_ms)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    char buffer[BUFFER_SIZE];
+
+    if (poll(&pfd, 1, wait_ms) <= 0)
+        return;
+    int len;
+    while ((len = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0)
+        receive_one(buffer, len, sc, timeout_ns);
+}
+
+static void run_open_loop(int sock, const struct sockaddr_storage *server, const struct scenario *sc,
+                          uint64_t requests, double rate, uint64_t timeout_ns)
+{
+    uint64_t interval_ns = (uint64_t)(1e9 / rate);
+    uint64_t start = now_ns();
+    uint64_t last_expire = start;
+    uint32_t id = 0;
+
+    while (id < requests)
+    {
+        uint64_t now = now_ns();
+
+        // Send everything that is due, timed from its scheduled instant
+        while (id < requests && start + id * interval_ns <= now)
+        {
+            send_one(sock, server, sc, id, start + id * interval_ns);
+            id++;
+        }
+
+        if (now - last_expire > timeout_ns / 4)
+        {
+            expire(now, timeout_ns);
+            last_expire = now;
+        }
+
+        uint64_t next = start + id * interval_ns;
+        int wait_ms = (next > now) ? (int)((next - now) / 1000000) : 0;
+        drain(sock, sc, timeout_ns, wait_ms);
+    }
+}
+
+static void run_closed_loop(int sock, const struct sockaddr_storage *server, const struct scenario *sc,
+                            uint64_t requests, int concurrency, uint64_t timeout_ns)
+{
+    uint32_t id = 0;
+
+    while (id < requests)
+    {
+        while (id < requests && outstanding < (uint64_t)concurrency)
+        {
+            send_one(sock, server, sc, id, now_ns());
+            id++;
+        }
+
+        drain(sock, sc, timeout_ns, 1);
+        expire(now_ns(), timeout_ns);
+    }
+}
+
+static void print_report(double seconds)
+{
+    double loss = results.sent ? 100.0 * results.lost / results.sent : 0.0;
+    const struct histogram *h = &results.latency;
+
+    printf("Richieste inviate:   %llu\n", (unsigned long long)results.sent);
+    printf("Risposte ricevute:   %llu\n", (unsigned long long)results.received);
+    printf("Perse:               %llu (%.3f%%)\n", (unsigned long long)results.lost, loss);
+    printf("Esito inatteso:      %llu\n", (unsigned long long)results.unexpected);
+    printf("Risposte in ritardo: %llu\n", (unsigned long long)results.late);
+    printf("Errori di invio:     %llu\n", (unsigned long long)results.errors);
+    printf("Durata:              %.3f s\n", seconds);
+    printf("QPS ottenuti:        %.0f\n", results.received / seconds);
+    if (results.sent > 0 && results.received > 0)
+        printf("Byte per richiesta:  %.1f inviati, %.1f ricevuti\n",
+               (double)results.bytes_sent / results.sent,
+               (double)results.bytes_received / results.received);
+    printf("Latenza (us):  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hist_percentile(h, 50.0) / 1e3, hist_percentile(h, 90.0) / 1e3,
+           hist_percentile(h, 99.0) / 1e3, hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+// Percentile distribution in the HdrHistogram text layout
+static void print_distribution(void)
+{
+    const struct histogram *h = &results.latency;
+    static const double percentiles[] = {0, 10, 20, 30, 40, 50, 60, 70, 75, 80, 85, 90,
+                                         95, 97.5, 99, 99.5, 99.9, 99.95, 99.99, 100};
+
+    printf("\n%12s %12s %12s\n", "Value(us)", "Percentile", "TotalCount");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        double p = percentiles[i];
+        printf("%12.1f %12.6f %12llu\n", hist_percentile(h, p) / 1e3, p / 100.0,
+               (unsigned long long)(p / 100.0 * h->total + 0.5));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server_name = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    const char *scenario_path = NULL;
+    uint64_t requests = DEFAULT_REQUESTS;
+    double rate = 0.0;
+    int concurrency = DEFAULT_CONCURRENCY;
+    int timeout_ms = DEFAULT_TIMEOUT_MS;
+    int distribution = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            server_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            scenario_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            requests = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            rate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            concurrency = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            timeout_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-H") == 0)
+        {
+            distribution = 1;
+        }
+        else if (strcmp(argv[i], "-C") == 0)
+        {
+            compact |= COMPACT_ID;
+        }
+        else if (strcmp(argv[i], "-M") == 0)
+        {
+            compact |= COMPACT_ID | COMPACT_HALF;
+        }
+    }
+
+    if (scenario_path == NULL || requests == 0)
+    {
+        printf("Uso: %s -f scenario [-s server] [-p port] [-n richieste] [-r rate | -c concorrenza] [-t timeout] [-C | -M] [-H]\n", argv[0]);
+        printf("  -f scenario: righe \"peso esito type city\" (esito: ok, notfound, invalid, any)\n");
+        printf("  -n richieste: numero di richieste (default: %d)\n", DEFAULT_REQUESTS);
+        printf("  -r rate: richieste/s a ciclo aperto (default: ciclo chiuso alla massima velocità)\n");
+        printf("  -c concorrenza: richieste in volo a ciclo chiuso (default: %d, max %d)\n", DEFAULT_CONCURRENCY, MAX_SLOTS);
+        printf("  -t timeout: ms dopo i quali una richiesta è persa (default: %d)\n", DEFAULT_TIMEOUT_MS);
+        printf("  -C: richieste nel formato compatto (versione 2) invece di quello a 65 byte\n");
+        printf("  -M: come -C, con i valori a mezza precisione\n");
+        printf("  -H: stampa la distribuzione completa delle latenze\n");
+        return 1;
+    }
+    if (concurrency < 1)
+        concurrency = 1;
+    if (concurrency > MAX_SLOTS)
+        concurrency = MAX_SLOTS;
+    if (timeout_ms < 1)
+        timeout_ms = DEFAULT_TIMEOUT_MS;
+
+    static struct scenario sc;
+    if (load_scenario(scenario_path, &sc) < 0)
+        return 1;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(server_name, service, &hints, &res) != 0)
+    {
+        printf("Errore nella risoluzione del server: %s\n", server_name);
+        return 1;
+    }
+    // The first address getaddrinfo() prefers, IPv6 or IPv4
+    struct sockaddr_storage server;
+    memset(&server, 0, sizeof(server));
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    int sock = socket(server.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        printf("Errore nella creazione del socket\n");
+        return 1;
+    }
+
+    // Room for the replies of a whole burst
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000;
+    uint64_t start = now_ns();
+    if (rate > 0)
+        run_open_loop(sock, &server, &sc, requests, rate, timeout_ns);
+    else
+        run_closed_loop(sock, &server, &sc, requests, concurrency, timeout_ns);
+
+    // Collect the last replies; whatever is still missing is lost
+    uint64_t end = now_ns();
+    while (outstanding > 0 && now_ns() - end < timeout_ns)
+        drain(sock, &sc, timeout_ns, 10);
+    expire(now_ns(), 0);
+
+    end = (last_reply_ns > end) ? last_reply_ns : end;
+    print_report((end - start) / 1e9);
+    if (distribution)
+        print_distribution();
+
+    close(sock);
+    return (results.lost > 0 || results.unexpected > 0) ? 2 : 0;
+}